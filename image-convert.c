@@ -1,395 +1,4683 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <linux/videodev2.h>
+
+#include <image-convert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 static inline uint32_t pixel_pack(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
 {
-	uint32_t color = 0;
+	uint32_t color = 0;
+
+	color |= b << 0;
+	color |= g << 8;
+	color |= r << 16;
+	color |= a << 24;
+
+	return color;
+}
+
+static const unsigned int image_convert_output_bpp[] = {
+	[IMAGE_CONVERT_OUTPUT_XRGB32] = 4,
+	[IMAGE_CONVERT_OUTPUT_RGB24] = 3,
+	[IMAGE_CONVERT_OUTPUT_BGR24] = 3,
+	[IMAGE_CONVERT_OUTPUT_RGB565] = 2,
+	[IMAGE_CONVERT_OUTPUT_RGB48] = 6,
+};
+
+/* Fill the gamma table with a power curve, enabling the stage. */
+void image_convert_isp_gamma(struct image_convert_isp *isp, double gamma)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; i++)
+		isp->gamma[i] = pow(i / 255., 1. / gamma) * 255. + .5;
+
+	isp->modules_used |= IMAGE_CONVERT_ISP_GAMMA;
+}
+
+typedef void (*image_store_t)(uint8_t *dst, uint32_t *pixels,
+			      unsigned int width);
+
+static const image_store_t *image_stores;
+
+static void (*image_ccm_row)(uint32_t *pixels, unsigned int width,
+			     const int16_t (*ccm)[3]);
+
+/*
+ * Converters always produce XRGB32 lines. Those are written in place for
+ * XRGB32 output, or to a line on the stack that is then stored in the
+ * output layout while still in cache. Lines on the stack, including source
+ * lines corrected by the ISP, bound the width.
+ */
+#define IMAGE_CONVERT_LINE_MAX	8192
+
+/* Bytes are looked up in place, all loaded before any store. */
+static inline void image_gamma_row(uint32_t *pixels, unsigned int width,
+				   const uint8_t *gamma)
+{
+	uint8_t *bytes = (uint8_t *)pixels;
+	unsigned int x;
+
+	for (x = 0; x < width; x++, bytes += 4) {
+		uint8_t b = gamma[bytes[0]];
+		uint8_t g = gamma[bytes[1]];
+		uint8_t r = gamma[bytes[2]];
+
+		bytes[0] = b;
+		bytes[1] = g;
+		bytes[2] = r;
+	}
+}
+
+static inline uint32_t *image_convert_line(struct image_convert_job *job,
+					   uint32_t *line, unsigned int y,
+					   unsigned int width)
+{
+	if (job->output == IMAGE_CONVERT_OUTPUT_XRGB32)
+		return (uint32_t *)job->dst + y * width;
+
+	return line;
+}
+
+/* Colour stages apply to converted lines before they are stored. */
+static inline void image_convert_line_store(struct image_convert_job *job,
+					    uint32_t *line, unsigned int y,
+					    unsigned int width,
+					    unsigned int x_start,
+					    unsigned int x_end)
+{
+	const struct image_convert_isp *isp = job->isp;
+	unsigned int bpp = image_convert_output_bpp[job->output];
+
+	if (isp && (isp->modules_used & IMAGE_CONVERT_ISP_CCM))
+		image_ccm_row(line + x_start, x_end - x_start, isp->ccm);
+
+	if (isp && (isp->modules_used & IMAGE_CONVERT_ISP_GAMMA))
+		image_gamma_row(line + x_start, x_end - x_start, isp->gamma);
+
+	if (job->output == IMAGE_CONVERT_OUTPUT_XRGB32)
+		return;
+
+	image_stores[job->output](job->dst + (y * width + x_start) * bpp,
+				  line + x_start, x_end - x_start);
+}
+
+/*
+ * Bilinear Bayer interpolation.
+ *
+ * SBGGR bayer pattern:
+ *
+ * BGBGBGBGBG
+ * GRGRGRGRGR
+ * BGBGBGBGBG
+ * GRGRGRGRGR
+ *
+ * SGBRG bayer pattern:
+ *
+ * GBGBGBGBGB
+ * RGRGRGRGRG
+ * GBGBGBGBGB
+ * RGRGRGRGRG
+ *
+ * SGRBG bayer pattern:
+ *
+ * GRGRGRGRGR
+ * BGBGBGBGBG
+ * GRGRGRGRGR
+ * BGBGBGBGBG
+ *
+ * SRGGB bayer pattern:
+ *
+ * RGRGRGRGRG
+ * GBGBGBGBGB
+ * RGRGRGRGRG
+ * GBGBGBGBGB
+ *
+ * Each line only holds green and one other colour, found at even or odd
+ * columns (phase). Out of bounds neighbours are mirrored from the other side.
+ *
+ * Converters are generated for each CFA order and sample depth, so that the
+ * phase and colour of each line are compile-time constants in row kernels.
+ *
+ * Binning takes the two colour samples of each quad as they are and averages
+ * its two green samples, with odd last lines and columns left out.
+ *
+ * Malvar-He-Cutler interpolation corrects the bilinear estimates with the
+ * laplacian of the centre colour, over a 5x5 neighbourhood. With weights
+ * scaled by 16, filters are (C: centre, H1/H2 and V1/V2: horizontal and
+ * vertical neighbours at distance 1/2, D: diagonal neighbours):
+ *
+ * green at colour sites:	8C + 4(H1 + V1) - 2(H2 + V2)
+ * colour at colour sites:	12C + 4D - 3(H2 + V2)
+ * colour from H1 at green:	10C + 8H1 - 2H2 - 2D + V2
+ * colour from V1 at green:	10C + 8V1 - 2V2 - 2D + H2
+ *
+ * Intermediate values fit 16-bit signed lanes for up to 10-bit samples.
+ * Lines are converted in column blocks, so that the five source lines of
+ * a block stay in cache while going down the frame.
+ *
+ * MIPI CSI-2 packed samples (RAW10: 4 pixels in 5 bytes, RAW12: 2 pixels in
+ * 3 bytes) hold the most significant bits of each pixel in one byte each,
+ * followed by a byte with the remaining bits of the group, starting with the
+ * first pixel in the lowest bits. Packed lines are unpacked into a window of
+ * three 16-bit lines as the conversion sweeps down, so that the same 16-bit
+ * row kernels apply without an intermediate frame.
+ *
+ * Software ISP offsets and gains are applied the same way, to source lines
+ * copied to a window of corrected lines, which then holds up to five lines
+ * for Malvar-He-Cutler, converted over the whole width.
+ */
+
+#define bayer_inline	static inline __attribute__((always_inline))
+
+enum bayer_cfa {
+	BAYER_CFA_BGGR,
+	BAYER_CFA_RGGB,
+	BAYER_CFA_GBRG,
+	BAYER_CFA_GRBG,
+	BAYER_CFA_COUNT,
+};
+
+enum bayer_depth {
+	BAYER_DEPTH_8,
+	BAYER_DEPTH_10,
+	BAYER_DEPTH_12,
+	BAYER_DEPTH_16,
+	BAYER_DEPTH_COUNT,
+};
+
+enum bayer_packing {
+	BAYER_PACKING_NONE,
+	BAYER_PACKING_MIPI,
+	BAYER_PACKING_COUNT,
+};
+
+struct bayer_format {
+	unsigned int format;
+	enum bayer_cfa cfa;
+	enum bayer_depth depth;
+	enum bayer_packing packing;
+};
+
+static const struct bayer_format bayer_formats[] = {
+	{ V4L2_PIX_FMT_SBGGR8,	BAYER_CFA_BGGR,	BAYER_DEPTH_8,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SRGGB8,	BAYER_CFA_RGGB,	BAYER_DEPTH_8,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SGBRG8,	BAYER_CFA_GBRG,	BAYER_DEPTH_8,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SGRBG8,	BAYER_CFA_GRBG,	BAYER_DEPTH_8,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SBGGR10,	BAYER_CFA_BGGR,	BAYER_DEPTH_10,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SRGGB10,	BAYER_CFA_RGGB,	BAYER_DEPTH_10,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SGBRG10,	BAYER_CFA_GBRG,	BAYER_DEPTH_10,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SGRBG10,	BAYER_CFA_GRBG,	BAYER_DEPTH_10,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SBGGR12,	BAYER_CFA_BGGR,	BAYER_DEPTH_12,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SRGGB12,	BAYER_CFA_RGGB,	BAYER_DEPTH_12,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SGBRG12,	BAYER_CFA_GBRG,	BAYER_DEPTH_12,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SGRBG12,	BAYER_CFA_GRBG,	BAYER_DEPTH_12,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SBGGR16,	BAYER_CFA_BGGR,	BAYER_DEPTH_16,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SRGGB16,	BAYER_CFA_RGGB,	BAYER_DEPTH_16,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SGBRG16,	BAYER_CFA_GBRG,	BAYER_DEPTH_16,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SGRBG16,	BAYER_CFA_GRBG,	BAYER_DEPTH_16,	BAYER_PACKING_NONE },
+	{ V4L2_PIX_FMT_SBGGR10P,	BAYER_CFA_BGGR,	BAYER_DEPTH_10,	BAYER_PACKING_MIPI },
+	{ V4L2_PIX_FMT_SRGGB10P,	BAYER_CFA_RGGB,	BAYER_DEPTH_10,	BAYER_PACKING_MIPI },
+	{ V4L2_PIX_FMT_SGBRG10P,	BAYER_CFA_GBRG,	BAYER_DEPTH_10,	BAYER_PACKING_MIPI },
+	{ V4L2_PIX_FMT_SGRBG10P,	BAYER_CFA_GRBG,	BAYER_DEPTH_10,	BAYER_PACKING_MIPI },
+	{ V4L2_PIX_FMT_SBGGR12P,	BAYER_CFA_BGGR,	BAYER_DEPTH_12,	BAYER_PACKING_MIPI },
+	{ V4L2_PIX_FMT_SRGGB12P,	BAYER_CFA_RGGB,	BAYER_DEPTH_12,	BAYER_PACKING_MIPI },
+	{ V4L2_PIX_FMT_SGBRG12P,	BAYER_CFA_GBRG,	BAYER_DEPTH_12,	BAYER_PACKING_MIPI },
+	{ V4L2_PIX_FMT_SGRBG12P,	BAYER_CFA_GRBG,	BAYER_DEPTH_12,	BAYER_PACKING_MIPI },
+};
+
+/* Channels found at each line and column parity of each CFA order. */
+static const uint8_t bayer_channels[BAYER_CFA_COUNT][2][2] = {
+	[BAYER_CFA_BGGR] = {
+		{ IMAGE_CONVERT_CHANNEL_B, IMAGE_CONVERT_CHANNEL_GB },
+		{ IMAGE_CONVERT_CHANNEL_GR, IMAGE_CONVERT_CHANNEL_R },
+	},
+	[BAYER_CFA_RGGB] = {
+		{ IMAGE_CONVERT_CHANNEL_R, IMAGE_CONVERT_CHANNEL_GR },
+		{ IMAGE_CONVERT_CHANNEL_GB, IMAGE_CONVERT_CHANNEL_B },
+	},
+	[BAYER_CFA_GBRG] = {
+		{ IMAGE_CONVERT_CHANNEL_GB, IMAGE_CONVERT_CHANNEL_B },
+		{ IMAGE_CONVERT_CHANNEL_R, IMAGE_CONVERT_CHANNEL_GR },
+	},
+	[BAYER_CFA_GRBG] = {
+		{ IMAGE_CONVERT_CHANNEL_GR, IMAGE_CONVERT_CHANNEL_R },
+		{ IMAGE_CONVERT_CHANNEL_B, IMAGE_CONVERT_CHANNEL_GB },
+	},
+};
+
+static const struct bayer_format *bayer_format_find(unsigned int format)
+{
+	unsigned int count = sizeof(bayer_formats) / sizeof(bayer_formats[0]);
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (bayer_formats[i].format == format)
+			return &bayer_formats[i];
+
+	return NULL;
+}
+
+typedef image_convert_t
+bayer_converters_t[BAYER_PACKING_COUNT][BAYER_DEPTH_COUNT][BAYER_CFA_COUNT];
+
+static unsigned int bayer_mipi_stride(unsigned int width, unsigned int bits)
+{
+	return width * bits / 8;
+}
+
+static unsigned int bayer_stride(const struct bayer_format *bayer,
+				 unsigned int width)
+{
+	switch (bayer->depth) {
+	case BAYER_DEPTH_8:
+		return width;
+	case BAYER_DEPTH_10:
+		if (bayer->packing == BAYER_PACKING_MIPI)
+			return bayer_mipi_stride(width, 10);
+		return width * 2;
+	case BAYER_DEPTH_12:
+		if (bayer->packing == BAYER_PACKING_MIPI)
+			return bayer_mipi_stride(width, 12);
+		return width * 2;
+	case BAYER_DEPTH_16:
+	default:
+		return width * 2;
+	}
+}
+
+bayer_inline void bayer_mipi_unpack_scalar(uint16_t *line, uint8_t *packed,
+				      unsigned int width, unsigned int bits)
+{
+	unsigned int x;
+
+	if (bits == 10) {
+		for (x = 0; x < width; x += 4, packed += 5) {
+			uint8_t low = packed[4];
+
+			line[x] = (packed[0] << 2) | (low & 0x3);
+			line[x + 1] = (packed[1] << 2) | ((low >> 2) & 0x3);
+			line[x + 2] = (packed[2] << 2) | ((low >> 4) & 0x3);
+			line[x + 3] = (packed[3] << 2) | (low >> 6);
+		}
+	} else {
+		for (x = 0; x < width; x += 2, packed += 3) {
+			uint8_t low = packed[2];
+
+			line[x] = (packed[0] << 4) | (low & 0xf);
+			line[x + 1] = (packed[1] << 4) | (low >> 4);
+		}
+	}
+}
+
+/*
+ * Each line goes to a fixed slot of the window and is only unpacked and
+ * corrected once. Without ISP correction, unpacked samples are read in place.
+ */
+#define BAYER_LINE(isa, attr, size)					\
+bayer_inline attr uint##size##_t *bayer_##size##_line_##isa(		\
+	uint##size##_t (*lines)[IMAGE_CONVERT_LINE_MAX],		\
+	unsigned int *lines_y, unsigned int count,			\
+	struct image_convert_job *job, unsigned int y,			\
+	unsigned int bits)						\
+{									\
+	uint##size##_t *samples = (uint##size##_t *)job->src +		\
+				  y * job->width;			\
+	unsigned int slot = y % count;					\
+									\
+	if (!job->isp_bayer)						\
+		return samples;						\
+									\
+	if (lines_y[slot] != y) {					\
+		bayer_##size##_correct_##isa(lines[slot], samples,	\
+					     job->width,		\
+					     job->isp_offsets[y & 1],	\
+					     job->isp_gains[y & 1],	\
+					     bits);			\
+		lines_y[slot] = y;					\
+	}								\
+									\
+	return lines[slot];						\
+}
+
+#define BAYER_MIPI_LINE(isa, attr)					\
+bayer_inline attr uint16_t *bayer_mipi_line_##isa(			\
+	uint16_t (*lines)[IMAGE_CONVERT_LINE_MAX], unsigned int *lines_y, \
+	struct image_convert_job *job, unsigned int y,			\
+	unsigned int bits)						\
+{									\
+	unsigned int stride = bayer_mipi_stride(job->width, bits);	\
+	unsigned int slot = y % 3;					\
+									\
+	if (lines_y[slot] != y) {					\
+		bayer_mipi_unpack_##isa(lines[slot],			\
+					job->src + y * stride,		\
+					job->width, bits);		\
+		if (job->isp_bayer)					\
+			bayer_16_correct_##isa(lines[slot], lines[slot], \
+					       job->width,		\
+					       job->isp_offsets[y & 1],	\
+					       job->isp_gains[y & 1],	\
+					       bits);			\
+		lines_y[slot] = y;					\
+	}								\
+									\
+	return lines[slot];						\
+}
+
+/*
+ * Converters for one CFA order and depth, iterating over lines with their
+ * mirrored neighbours. Odd lines swap both the phase and the colour.
+ */
+#define BAYER_CONVERT(isa, attr, size, bits, cfa, phase, red)		\
+attr static void bayer_##bits##_##cfa##_convert_##isa(			\
+	struct image_convert_job *job, unsigned int y_start,		\
+	unsigned int y_end)						\
+{									\
+	uint##size##_t lines[3][IMAGE_CONVERT_LINE_MAX];		\
+	uint32_t line[IMAGE_CONVERT_LINE_MAX];				\
+	unsigned int width = job->width;				\
+	unsigned int height = job->height;				\
+	unsigned int lines_y[3] = { height, height, height };		\
+	unsigned int y;							\
+									\
+	for (y = y_start; y < y_end; y++) {				\
+		uint32_t *pixels = image_convert_line(job, line, y, width); \
+		uint##size##_t *up, *row, *down;			\
+									\
+		up = bayer_##size##_line_##isa(lines, lines_y, 3, job,	\
+					       y > 0 ? y - 1 : y + 1,	\
+					       bits);			\
+		row = bayer_##size##_line_##isa(lines, lines_y, 3, job,	\
+						y, bits);		\
+		down = bayer_##size##_line_##isa(lines, lines_y, 3, job, \
+						 y < (height - 1) ?	\
+						 y + 1 : y - 1, bits);	\
+									\
+		if (y & 1)						\
+			bayer_##size##_row_##isa(pixels, up, row, down,	\
+						 width, !(phase),	\
+						 !(red), bits);		\
+		else							\
+			bayer_##size##_row_##isa(pixels, up, row, down,	\
+						 width, phase, red,	\
+						 bits);			\
+									\
+		image_convert_line_store(job, pixels, y, width, 0, width); \
+	}								\
+}
+
+#define BAYER_MIPI_CONVERT(isa, attr, bits, cfa, phase, red)		\
+attr static void bayer_##bits##p_##cfa##_convert_##isa(			\
+	struct image_convert_job *job, unsigned int y_start,		\
+	unsigned int y_end)						\
+{									\
+	uint16_t lines[3][IMAGE_CONVERT_LINE_MAX];			\
+	uint32_t line[IMAGE_CONVERT_LINE_MAX];				\
+	unsigned int width = job->width;				\
+	unsigned int height = job->height;				\
+	unsigned int lines_y[3] = { height, height, height };		\
+	unsigned int y;							\
+									\
+	for (y = y_start; y < y_end; y++) {				\
+		uint32_t *pixels = image_convert_line(job, line, y, width); \
+		uint16_t *up, *row, *down;				\
+									\
+		up = bayer_mipi_line_##isa(lines, lines_y, job,		\
+					   y > 0 ? y - 1 : y + 1, bits); \
+		row = bayer_mipi_line_##isa(lines, lines_y, job, y,	\
+					    bits);			\
+		down = bayer_mipi_line_##isa(lines, lines_y, job,	\
+					     y < (height - 1) ?		\
+					     y + 1 : y - 1, bits);	\
+									\
+		if (y & 1)						\
+			bayer_16_row_##isa(pixels, up, row, down, width, \
+					   !(phase), !(red), bits);	\
+		else							\
+			bayer_16_row_##isa(pixels, up, row, down, width, \
+					   phase, red, bits);		\
+									\
+		image_convert_line_store(job, pixels, y, width, 0, width); \
+	}								\
+}
+
+/* Binned converters iterate over quads, the first line of which is even. */
+#define BAYER_BIN_CONVERT(isa, attr, size, bits, cfa, phase, red)	\
+attr static void bayer_##bits##_##cfa##_bin_convert_##isa(		\
+	struct image_convert_job *job, unsigned int y_start,		\
+	unsigned int y_end)						\
+{									\
+	uint##size##_t lines[3][IMAGE_CONVERT_LINE_MAX];		\
+	uint32_t line[IMAGE_CONVERT_LINE_MAX];				\
+	unsigned int width = job->width;				\
+	unsigned int height = job->height;				\
+	unsigned int lines_y[3] = { height, height, height };		\
+	unsigned int y, y_last;						\
+									\
+	y_last = (y_end + 1) / 2;					\
+	if (y_last > height / 2)					\
+		y_last = height / 2;					\
+									\
+	for (y = (y_start + 1) / 2; y < y_last; y++) {			\
+		uint32_t *pixels = image_convert_line(job, line, y,	\
+						      width / 2);	\
+		uint##size##_t *row, *next;				\
+									\
+		row = bayer_##size##_line_##isa(lines, lines_y, 3, job,	\
+						2 * y, bits);		\
+		next = bayer_##size##_line_##isa(lines, lines_y, 3, job, \
+						 2 * y + 1, bits);	\
+									\
+		bayer_##size##_bin_row_##isa(pixels, row, next,		\
+					     width / 2, phase, red,	\
+					     bits);			\
+									\
+		image_convert_line_store(job, pixels, y, width / 2, 0,	\
+					 width / 2);			\
+	}								\
+}
+
+#define BAYER_MIPI_BIN_CONVERT(isa, attr, bits, cfa, phase, red)	\
+attr static void bayer_##bits##p_##cfa##_bin_convert_##isa(		\
+	struct image_convert_job *job, unsigned int y_start,		\
+	unsigned int y_end)						\
+{									\
+	uint16_t lines[3][IMAGE_CONVERT_LINE_MAX];			\
+	uint32_t line[IMAGE_CONVERT_LINE_MAX];				\
+	unsigned int width = job->width;				\
+	unsigned int height = job->height;				\
+	unsigned int lines_y[3] = { height, height, height };		\
+	unsigned int y, y_last;						\
+									\
+	y_last = (y_end + 1) / 2;					\
+	if (y_last > height / 2)					\
+		y_last = height / 2;					\
+									\
+	for (y = (y_start + 1) / 2; y < y_last; y++) {			\
+		uint32_t *pixels = image_convert_line(job, line, y,	\
+						      width / 2);	\
+		uint16_t *row, *next;					\
+									\
+		row = bayer_mipi_line_##isa(lines, lines_y, job, 2 * y,	\
+					    bits);			\
+		next = bayer_mipi_line_##isa(lines, lines_y, job,	\
+					     2 * y + 1, bits);		\
+									\
+		bayer_16_bin_row_##isa(pixels, row, next, width / 2,	\
+				       phase, red, bits);		\
+									\
+		image_convert_line_store(job, pixels, y, width / 2, 0,	\
+					 width / 2);			\
+	}								\
+}
+
+#define BAYER_MALVAR_BLOCK	512
+
+bayer_inline unsigned int bayer_mirror(int i, unsigned int count)
+{
+	if (i < 0)
+		return -i;
+	else if (i >= (int)count)
+		return 2 * (count - 1) - i;
+	else
+		return i;
+}
+
+/* Corrected lines are only kept for one block, which then spans the line. */
+#define BAYER_MALVAR_CONVERT(isa, attr, size, bits, cfa, phase, red)	\
+attr static void bayer_##bits##_##cfa##_malvar_convert_##isa(		\
+	struct image_convert_job *job, unsigned int y_start,		\
+	unsigned int y_end)						\
+{									\
+	uint##size##_t lines[5][IMAGE_CONVERT_LINE_MAX];		\
+	uint32_t line[IMAGE_CONVERT_LINE_MAX];				\
+	unsigned int width = job->width;				\
+	unsigned int height = job->height;				\
+	unsigned int lines_y[5] = { height, height, height, height,	\
+				    height };				\
+	unsigned int block = job->isp_bayer ? width :			\
+			     BAYER_MALVAR_BLOCK;			\
+	unsigned int x, y, i;						\
+									\
+	for (x = 0; x < width; x += block) {				\
+		unsigned int x_end = x + block;				\
+									\
+		if (x_end > width)					\
+			x_end = width;					\
+									\
+		for (y = y_start; y < y_end; y++) {			\
+			uint32_t *pixels = image_convert_line(job, line, \
+							      y, width); \
+			uint##size##_t *rows[5];			\
+									\
+			for (i = 0; i < 5; i++)				\
+				rows[i] = bayer_##size##_line_##isa(	\
+					lines, lines_y, 5, job,		\
+					bayer_mirror(y + i - 2, height), \
+					bits);				\
+									\
+			if (y & 1)					\
+				bayer_##size##_malvar_row_##isa(	\
+					pixels, rows, width, x, x_end,	\
+					!(phase), !(red), bits);	\
+			else						\
+				bayer_##size##_malvar_row_##isa(	\
+					pixels, rows, width, x, x_end,	\
+					phase, red, bits);		\
+									\
+			image_convert_line_store(job, pixels, y, width,	\
+						 x, x_end);		\
+		}							\
+	}								\
+}
+
+#define BAYER_MALVAR_CONVERTERS_DEPTH(isa, attr, size, bits)		\
+	BAYER_MALVAR_CONVERT(isa, attr, size, bits, bggr, 0, false)	\
+	BAYER_MALVAR_CONVERT(isa, attr, size, bits, rggb, 0, true)	\
+	BAYER_MALVAR_CONVERT(isa, attr, size, bits, gbrg, 1, false)	\
+	BAYER_MALVAR_CONVERT(isa, attr, size, bits, grbg, 1, true)
+
+#define BAYER_CONVERTERS_DEPTH(isa, attr, size, bits)			\
+	BAYER_CONVERT(isa, attr, size, bits, bggr, 0, false)		\
+	BAYER_CONVERT(isa, attr, size, bits, rggb, 0, true)		\
+	BAYER_CONVERT(isa, attr, size, bits, gbrg, 1, false)		\
+	BAYER_CONVERT(isa, attr, size, bits, grbg, 1, true)		\
+	BAYER_BIN_CONVERT(isa, attr, size, bits, bggr, 0, false)	\
+	BAYER_BIN_CONVERT(isa, attr, size, bits, rggb, 0, true)		\
+	BAYER_BIN_CONVERT(isa, attr, size, bits, gbrg, 1, false)	\
+	BAYER_BIN_CONVERT(isa, attr, size, bits, grbg, 1, true)
+
+#define BAYER_MIPI_CONVERTERS_DEPTH(isa, attr, bits)			\
+	BAYER_MIPI_CONVERT(isa, attr, bits, bggr, 0, false)		\
+	BAYER_MIPI_CONVERT(isa, attr, bits, rggb, 0, true)		\
+	BAYER_MIPI_CONVERT(isa, attr, bits, gbrg, 1, false)		\
+	BAYER_MIPI_CONVERT(isa, attr, bits, grbg, 1, true)		\
+	BAYER_MIPI_BIN_CONVERT(isa, attr, bits, bggr, 0, false)		\
+	BAYER_MIPI_BIN_CONVERT(isa, attr, bits, rggb, 0, true)		\
+	BAYER_MIPI_BIN_CONVERT(isa, attr, bits, gbrg, 1, false)		\
+	BAYER_MIPI_BIN_CONVERT(isa, attr, bits, grbg, 1, true)
+
+#define BAYER_CONVERTERS_ENTRY(isa, bits, kind)				\
+	{								\
+		bayer_##bits##_bggr_##kind##_##isa,			\
+		bayer_##bits##_rggb_##kind##_##isa,			\
+		bayer_##bits##_gbrg_##kind##_##isa,			\
+		bayer_##bits##_grbg_##kind##_##isa,			\
+	}
+
+#define BAYER_CONVERTERS_TABLE(isa, kind)				\
+	{								\
+		[BAYER_PACKING_NONE] = {				\
+			[BAYER_DEPTH_8] =				\
+				BAYER_CONVERTERS_ENTRY(isa, 8, kind),	\
+			[BAYER_DEPTH_10] =				\
+				BAYER_CONVERTERS_ENTRY(isa, 10, kind),	\
+			[BAYER_DEPTH_12] =				\
+				BAYER_CONVERTERS_ENTRY(isa, 12, kind),	\
+			[BAYER_DEPTH_16] =				\
+				BAYER_CONVERTERS_ENTRY(isa, 16, kind),	\
+		},							\
+		[BAYER_PACKING_MIPI] = {				\
+			[BAYER_DEPTH_10] =				\
+				BAYER_CONVERTERS_ENTRY(isa, 10p, kind),	\
+			[BAYER_DEPTH_12] =				\
+				BAYER_CONVERTERS_ENTRY(isa, 12p, kind),	\
+		},							\
+	}
+
+#define BAYER_CONVERTERS(isa, attr)					\
+	BAYER_LINE(isa, attr, 8)					\
+	BAYER_LINE(isa, attr, 16)					\
+	BAYER_MIPI_LINE(isa, attr)					\
+	BAYER_CONVERTERS_DEPTH(isa, attr, 8, 8)				\
+	BAYER_CONVERTERS_DEPTH(isa, attr, 16, 10)			\
+	BAYER_CONVERTERS_DEPTH(isa, attr, 16, 12)			\
+	BAYER_CONVERTERS_DEPTH(isa, attr, 16, 16)			\
+	BAYER_MIPI_CONVERTERS_DEPTH(isa, attr, 10)			\
+	BAYER_MIPI_CONVERTERS_DEPTH(isa, attr, 12)			\
+	BAYER_MALVAR_CONVERTERS_DEPTH(isa, attr, 8, 8)			\
+	BAYER_MALVAR_CONVERTERS_DEPTH(isa, attr, 16, 10)		\
+									\
+static const bayer_converters_t						\
+bayer_converters_##isa[IMAGE_CONVERT_ALGORITHM_COUNT] = {		\
+	[IMAGE_CONVERT_BILINEAR] = BAYER_CONVERTERS_TABLE(isa, convert), \
+	[IMAGE_CONVERT_BINNING] = BAYER_CONVERTERS_TABLE(isa, bin_convert), \
+	[IMAGE_CONVERT_MALVAR] = {					\
+		[BAYER_PACKING_NONE] = {				\
+			[BAYER_DEPTH_8] =				\
+				BAYER_CONVERTERS_ENTRY(isa, 8,		\
+						       malvar_convert),	\
+			[BAYER_DEPTH_10] =				\
+				BAYER_CONVERTERS_ENTRY(isa, 10,		\
+						       malvar_convert),	\
+		},							\
+	},								\
+};
+
+/* 8-bit samples */
+
+bayer_inline uint32_t bayer_8_pixel(uint8_t *up, uint8_t *row, uint8_t *down,
+				    unsigned int xp, unsigned int x,
+				    unsigned int xn, bool site, bool red)
+{
+	uint8_t hn, vn, di;
+	uint8_t c, g, o;
+
+	/* Average matching neighbours. */
+	hn = (row[xp] + row[xn]) / 2;
+	vn = (up[x] + down[x]) / 2;
+	di = (up[xp] + up[xn] + down[xp] + down[xn]) / 4;
+
+	/* Line colour, green and other colour. */
+	if (site) {
+		c = row[x];
+		g = (vn + hn) / 2;
+		o = di;
+	} else {
+		c = hn;
+		g = row[x];
+		o = vn;
+	}
+
+	if (red)
+		return pixel_pack(c, g, o, 0);
+	else
+		return pixel_pack(o, g, c, 0);
+}
+
+bayer_inline void bayer_8_row_span(uint32_t *pixels, uint8_t *up,
+				   uint8_t *row, uint8_t *down,
+				   unsigned int width, unsigned int x_start,
+				   unsigned int x_end, unsigned int phase,
+				   bool red)
+{
+	unsigned int x;
+
+	for (x = x_start; x < x_end; x++) {
+		unsigned int xp = x > 0 ? x - 1 : x + 1;
+		unsigned int xn = x < (width - 1) ? x + 1 : x - 1;
+
+		pixels[x] = bayer_8_pixel(up, row, down, xp, x, xn,
+					  (x & 1) == phase, red);
+	}
+}
+
+/* The bits argument is always 8 here, it is kept for generated converters. */
+bayer_inline void bayer_8_row_scalar(uint32_t *pixels, uint8_t *up,
+				     uint8_t *row, uint8_t *down,
+				     unsigned int width, unsigned int phase,
+				     bool red, unsigned int bits)
+{
+	unsigned int x;
+
+	bayer_8_row_span(pixels, up, row, down, width, 0, 1, phase, red);
+
+	for (x = 1; x + 2 < width; x += 2) {
+		pixels[x] = bayer_8_pixel(up, row, down, x - 1, x, x + 1,
+					  phase == 1, red);
+		pixels[x + 1] = bayer_8_pixel(up, row, down, x, x + 1, x + 2,
+					      phase == 0, red);
+	}
+
+	bayer_8_row_span(pixels, up, row, down, width, x, width, phase, red);
+}
+
+/* 16-bit samples */
+
+/* Smallest factors for which (value * factor) >> (bits + 8) is exact. */
+bayer_inline uint16_t bayer_16_scale(unsigned int bits)
+{
+	switch (bits) {
+	case 10:
+		return 65344;
+	case 12:
+		return 65296;
+	case 14:
+		return 65284;
+	case 16:
+	default:
+		return 65281;
+	}
+}
+
+/* Line colour, green and other colour, at sample precision. */
+bayer_inline void bayer_16_values(uint32_t *values, uint16_t *up,
+				  uint16_t *row, uint16_t *down,
+				  unsigned int xp, unsigned int x,
+				  unsigned int xn, bool site)
+{
+	if (site) {
+		values[0] = row[x];
+		values[1] = (row[xp] + row[xn] + up[x] + down[x]) / 4;
+		values[2] = (up[xp] + up[xn] + down[xp] + down[xn]) / 4;
+	} else {
+		values[0] = (row[xp] + row[xn]) / 2;
+		values[1] = row[x];
+		values[2] = (up[x] + down[x]) / 2;
+	}
+}
+
+bayer_inline uint32_t bayer_16_pixel(uint16_t *up, uint16_t *row,
+				     uint16_t *down, unsigned int xp,
+				     unsigned int x, unsigned int xn, bool site,
+				     bool red, unsigned int bits)
+{
+	uint32_t scale = bayer_16_scale(bits);
+	uint32_t values[3];
+	uint32_t c, g, o;
+
+	bayer_16_values(values, up, row, down, xp, x, xn, site);
+
+	c = (values[0] * scale) >> (bits + 8);
+	g = (values[1] * scale) >> (bits + 8);
+	o = (values[2] * scale) >> (bits + 8);
+
+	if (red)
+		return pixel_pack(c, g, o, 255);
+	else
+		return pixel_pack(o, g, c, 255);
+}
+
+bayer_inline void bayer_16_row_span(uint32_t *pixels, uint16_t *up,
+				    uint16_t *row, uint16_t *down,
+				    unsigned int width, unsigned int x_start,
+				    unsigned int x_end, unsigned int phase,
+				    bool red, unsigned int bits)
+{
+	unsigned int x;
+
+	for (x = x_start; x < x_end; x++) {
+		unsigned int xp = x > 0 ? x - 1 : x + 1;
+		unsigned int xn = x < (width - 1) ? x + 1 : x - 1;
+
+		pixels[x] = bayer_16_pixel(up, row, down, xp, x, xn,
+					   (x & 1) == phase, red, bits);
+	}
+}
+
+bayer_inline void bayer_16_row_scalar(uint32_t *pixels, uint16_t *up,
+				      uint16_t *row, uint16_t *down,
+				      unsigned int width, unsigned int phase,
+				      bool red, unsigned int bits)
+{
+	unsigned int x;
+
+	bayer_16_row_span(pixels, up, row, down, width, 0, 1, phase, red,
+			  bits);
+
+	for (x = 1; x + 2 < width; x += 2) {
+		pixels[x] = bayer_16_pixel(up, row, down, x - 1, x, x + 1,
+					   phase == 1, red, bits);
+		pixels[x + 1] = bayer_16_pixel(up, row, down, x, x + 1, x + 2,
+					       phase == 0, red, bits);
+	}
+
+	bayer_16_row_span(pixels, up, row, down, width, x, width, phase, red,
+			  bits);
+}
+
+/* Binning */
+
+bayer_inline void bayer_8_bin_row_span(uint32_t *pixels, uint8_t *row,
+				       uint8_t *next, unsigned int x_start,
+				       unsigned int width, unsigned int phase,
+				       bool red)
+{
+	unsigned int x;
+
+	for (x = x_start; x < width; x++) {
+		uint8_t *q0 = row + 2 * x;
+		uint8_t *q1 = next + 2 * x;
+		uint8_t c0 = q0[phase];
+		uint8_t c1 = q1[!phase];
+		uint8_t g = (q0[!phase] + q1[phase]) / 2;
+
+		if (red)
+			pixels[x] = pixel_pack(c0, g, c1, 0);
+		else
+			pixels[x] = pixel_pack(c1, g, c0, 0);
+	}
+}
+
+bayer_inline void bayer_8_bin_row_scalar(uint32_t *pixels, uint8_t *row,
+					 uint8_t *next, unsigned int width,
+					 unsigned int phase, bool red,
+					 unsigned int bits)
+{
+	bayer_8_bin_row_span(pixels, row, next, 0, width, phase, red);
+}
+
+bayer_inline void bayer_16_bin_row_span(uint32_t *pixels, uint16_t *row,
+					uint16_t *next, unsigned int x_start,
+					unsigned int width, unsigned int phase,
+					bool red, unsigned int bits)
+{
+	uint32_t scale = bayer_16_scale(bits);
+	unsigned int x;
+
+	for (x = x_start; x < width; x++) {
+		uint16_t *q0 = row + 2 * x;
+		uint16_t *q1 = next + 2 * x;
+		uint32_t c0 = q0[phase];
+		uint32_t c1 = q1[!phase];
+		uint32_t g = (q0[!phase] + q1[phase]) / 2;
+
+		c0 = (c0 * scale) >> (bits + 8);
+		c1 = (c1 * scale) >> (bits + 8);
+		g = (g * scale) >> (bits + 8);
+
+		if (red)
+			pixels[x] = pixel_pack(c0, g, c1, 255);
+		else
+			pixels[x] = pixel_pack(c1, g, c0, 255);
+	}
+}
+
+bayer_inline void bayer_16_bin_row_scalar(uint32_t *pixels, uint16_t *row,
+					  uint16_t *next, unsigned int width,
+					  unsigned int phase, bool red,
+					  unsigned int bits)
+{
+	bayer_16_bin_row_span(pixels, row, next, 0, width, phase, red, bits);
+}
+
+/* Malvar-He-Cutler */
+
+bayer_inline void bayer_malvar_pixel(int *values, int c, int h1, int h2,
+				     int v1, int v2, int di, bool site,
+				     int max)
+{
+	int i;
+
+	if (site) {
+		values[0] = 16 * c;
+		values[1] = 8 * c + 4 * (h1 + v1) - 2 * (h2 + v2);
+		values[2] = 12 * c + 4 * di - 3 * (h2 + v2);
+	} else {
+		values[0] = 10 * c + 8 * h1 - 2 * h2 - 2 * di + v2;
+		values[1] = 16 * c;
+		values[2] = 10 * c + 8 * v1 - 2 * v2 - 2 * di + h2;
+	}
+
+	for (i = 0; i < 3; i++) {
+		values[i] = (values[i] + 8) >> 4;
+
+		if (values[i] < 0)
+			values[i] = 0;
+		else if (values[i] > max)
+			values[i] = max;
+	}
+}
+
+bayer_inline void bayer_8_malvar_row_span(uint32_t *pixels, uint8_t **rows,
+					  unsigned int width,
+					  unsigned int x_start,
+					  unsigned int x_end,
+					  unsigned int phase, bool red)
+{
+	uint8_t *r0 = rows[0], *r1 = rows[1], *r2 = rows[2];
+	uint8_t *r3 = rows[3], *r4 = rows[4];
+	unsigned int x;
+	int values[3];
+
+	for (x = x_start; x < x_end; x++) {
+		unsigned int xp2 = bayer_mirror(x - 2, width);
+		unsigned int xp1 = bayer_mirror(x - 1, width);
+		unsigned int xn1 = bayer_mirror(x + 1, width);
+		unsigned int xn2 = bayer_mirror(x + 2, width);
+
+		bayer_malvar_pixel(values, r2[x], r2[xp1] + r2[xn1],
+				   r2[xp2] + r2[xn2], r1[x] + r3[x],
+				   r0[x] + r4[x],
+				   r1[xp1] + r1[xn1] + r3[xp1] + r3[xn1],
+				   (x & 1) == phase, 255);
+
+		if (red)
+			pixels[x] = pixel_pack(values[0], values[1],
+					       values[2], 0);
+		else
+			pixels[x] = pixel_pack(values[2], values[1],
+					       values[0], 0);
+	}
+}
+
+bayer_inline void bayer_8_malvar_row_scalar(uint32_t *pixels, uint8_t **rows,
+					    unsigned int width,
+					    unsigned int x_start,
+					    unsigned int x_end,
+					    unsigned int phase, bool red,
+					    unsigned int bits)
+{
+	bayer_8_malvar_row_span(pixels, rows, width, x_start, x_end, phase,
+				red);
+}
+
+bayer_inline void bayer_16_malvar_row_span(uint32_t *pixels, uint16_t **rows,
+					   unsigned int width,
+					   unsigned int x_start,
+					   unsigned int x_end,
+					   unsigned int phase, bool red,
+					   unsigned int bits)
+{
+	uint16_t *r0 = rows[0], *r1 = rows[1], *r2 = rows[2];
+	uint16_t *r3 = rows[3], *r4 = rows[4];
+	uint32_t scale = bayer_16_scale(bits);
+	unsigned int x, i;
+	int values[3];
+
+	for (x = x_start; x < x_end; x++) {
+		unsigned int xp2 = bayer_mirror(x - 2, width);
+		unsigned int xp1 = bayer_mirror(x - 1, width);
+		unsigned int xn1 = bayer_mirror(x + 1, width);
+		unsigned int xn2 = bayer_mirror(x + 2, width);
+
+		bayer_malvar_pixel(values, r2[x], r2[xp1] + r2[xn1],
+				   r2[xp2] + r2[xn2], r1[x] + r3[x],
+				   r0[x] + r4[x],
+				   r1[xp1] + r1[xn1] + r3[xp1] + r3[xn1],
+				   (x & 1) == phase, (1 << bits) - 1);
+
+		for (i = 0; i < 3; i++)
+			values[i] = (values[i] * scale) >> (bits + 8);
+
+		if (red)
+			pixels[x] = pixel_pack(values[0], values[1],
+					       values[2], 255);
+		else
+			pixels[x] = pixel_pack(values[2], values[1],
+					       values[0], 255);
+	}
+}
+
+bayer_inline void bayer_16_malvar_row_scalar(uint32_t *pixels, uint16_t **rows,
+					     unsigned int width,
+					     unsigned int x_start,
+					     unsigned int x_end,
+					     unsigned int phase, bool red,
+					     unsigned int bits)
+{
+	bayer_16_malvar_row_span(pixels, rows, width, x_start, x_end, phase,
+				 red, bits);
+}
+
+/* ISP correction */
+
+bayer_inline uint32_t bayer_correct(uint32_t value, uint32_t offset,
+				    uint32_t gain, uint32_t max)
+{
+	value = value > offset ? value - offset : 0;
+	value = (value * gain) >> 8;
+
+	return value < max ? value : max;
+}
+
+bayer_inline void bayer_8_correct_span(uint8_t *line, uint8_t *samples,
+				       unsigned int x_start,
+				       unsigned int width, uint16_t *offsets,
+				       uint16_t *gains)
+{
+	unsigned int x;
+
+	for (x = x_start; x < width; x++)
+		line[x] = bayer_correct(samples[x], offsets[x & 1],
+					gains[x & 1], 255);
+}
+
+bayer_inline void bayer_8_correct_scalar(uint8_t *line, uint8_t *samples,
+					 unsigned int width,
+					 uint16_t *offsets, uint16_t *gains,
+					 unsigned int bits)
+{
+	bayer_8_correct_span(line, samples, 0, width, offsets, gains);
+}
+
+bayer_inline void bayer_16_correct_span(uint16_t *line, uint16_t *samples,
+					unsigned int x_start,
+					unsigned int width, uint16_t *offsets,
+					uint16_t *gains, unsigned int bits)
+{
+	unsigned int x;
+
+	for (x = x_start; x < width; x++)
+		line[x] = bayer_correct(samples[x], offsets[x & 1],
+					gains[x & 1], (1 << bits) - 1);
+}
+
+bayer_inline void bayer_16_correct_scalar(uint16_t *line, uint16_t *samples,
+					  unsigned int width,
+					  uint16_t *offsets, uint16_t *gains,
+					  unsigned int bits)
+{
+	bayer_16_correct_span(line, samples, 0, width, offsets, gains, bits);
+}
+
+BAYER_CONVERTERS(scalar, )
+
+/*
+ * RGB48 output from deep samples is computed at sample precision, without
+ * the XRGB32 lines, by a scalar converter covering all CFA orders.
+ */
+
+static unsigned int bayer_bits(const struct bayer_format *bayer)
+{
+	switch (bayer->depth) {
+	case BAYER_DEPTH_8:
+		return 8;
+	case BAYER_DEPTH_10:
+		return 10;
+	case BAYER_DEPTH_12:
+		return 12;
+	case BAYER_DEPTH_16:
+	default:
+		return 16;
+	}
+}
+
+/* The top bits are replicated so that the largest sample maps to 0xffff. */
+bayer_inline void bayer_wide_store(uint16_t *pixel, uint32_t c, uint32_t g,
+				   uint32_t o, bool red, unsigned int bits)
+{
+	uint32_t r = red ? c : o;
+	uint32_t b = red ? o : c;
+
+	pixel[0] = (r << (16 - bits)) | (r >> (2 * bits - 16));
+	pixel[1] = (g << (16 - bits)) | (g >> (2 * bits - 16));
+	pixel[2] = (b << (16 - bits)) | (b >> (2 * bits - 16));
+}
+
+static uint16_t *bayer_wide_line(struct image_convert_job *job,
+				 const struct bayer_format *bayer,
+				 uint16_t (*lines)[IMAGE_CONVERT_LINE_MAX],
+				 unsigned int *lines_y, unsigned int count,
+				 unsigned int y)
+{
+	if (bayer->packing == BAYER_PACKING_MIPI)
+		return bayer_mipi_line_scalar(lines, lines_y, job, y,
+					      bayer_bits(bayer));
+
+	return bayer_16_line_scalar(lines, lines_y, count, job, y,
+				    bayer_bits(bayer));
+}
+
+static void bayer_wide_row(uint16_t *pixels, uint16_t *up, uint16_t *row,
+			   uint16_t *down, unsigned int width,
+			   unsigned int phase, bool red, unsigned int bits)
+{
+	uint32_t values[3];
+	unsigned int x;
+
+	for (x = 0; x < width; x++) {
+		unsigned int xp = x > 0 ? x - 1 : x + 1;
+		unsigned int xn = x < (width - 1) ? x + 1 : x - 1;
+
+		bayer_16_values(values, up, row, down, xp, x, xn,
+				(x & 1) == phase);
+		bayer_wide_store(pixels + 3 * x, values[0], values[1],
+				 values[2], red, bits);
+	}
+}
+
+static void bayer_wide_bin_row(uint16_t *pixels, uint16_t *row,
+			       uint16_t *next, unsigned int width,
+			       unsigned int phase, bool red, unsigned int bits)
+{
+	unsigned int x;
+
+	for (x = 0; x < width; x++) {
+		uint16_t *q0 = row + 2 * x;
+		uint16_t *q1 = next + 2 * x;
+
+		bayer_wide_store(pixels + 3 * x, q0[phase],
+				 (q0[!phase] + q1[phase]) / 2, q1[!phase],
+				 red, bits);
+	}
+}
+
+static void bayer_wide_malvar_row(uint16_t *pixels, uint16_t **rows,
+				  unsigned int width, unsigned int phase,
+				  bool red, unsigned int bits)
+{
+	uint16_t *r0 = rows[0], *r1 = rows[1], *r2 = rows[2];
+	uint16_t *r3 = rows[3], *r4 = rows[4];
+	unsigned int x;
+	int values[3];
+
+	for (x = 0; x < width; x++) {
+		unsigned int xp2 = bayer_mirror(x - 2, width);
+		unsigned int xp1 = bayer_mirror(x - 1, width);
+		unsigned int xn1 = bayer_mirror(x + 1, width);
+		unsigned int xn2 = bayer_mirror(x + 2, width);
+
+		bayer_malvar_pixel(values, r2[x], r2[xp1] + r2[xn1],
+				   r2[xp2] + r2[xn2], r1[x] + r3[x],
+				   r0[x] + r4[x],
+				   r1[xp1] + r1[xn1] + r3[xp1] + r3[xn1],
+				   (x & 1) == phase, (1 << bits) - 1);
+		bayer_wide_store(pixels + 3 * x, values[0], values[1],
+				 values[2], red, bits);
+	}
+}
+
+/* The colour matrix applies at full precision, gamma is not supported. */
+static void bayer_wide_ccm_row(struct image_convert_job *job,
+			       uint16_t *pixels, unsigned int width)
+{
+	const struct image_convert_isp *isp = job->isp;
+	unsigned int x, i;
+
+	if (!isp || !(isp->modules_used & IMAGE_CONVERT_ISP_CCM))
+		return;
+
+	for (x = 0; x < width; x++, pixels += 3) {
+		int64_t r = pixels[0], g = pixels[1], b = pixels[2];
+
+		for (i = 0; i < 3; i++) {
+			int64_t v = (isp->ccm[i][0] * r + isp->ccm[i][1] * g +
+				     isp->ccm[i][2] * b + 128) >> 8;
+
+			pixels[i] = v < 0 ? 0 : v > 0xffff ? 0xffff : v;
+		}
+	}
+}
+
+static void bayer_wide_convert(struct image_convert_job *job,
+			       unsigned int y_start, unsigned int y_end)
+{
+	const struct bayer_format *bayer = bayer_format_find(job->format);
+	uint16_t lines[5][IMAGE_CONVERT_LINE_MAX];
+	uint16_t *pixels = (uint16_t *)job->dst;
+	unsigned int width = job->width;
+	unsigned int height = job->height;
+	unsigned int lines_y[5] = { height, height, height, height, height };
+	unsigned int bits = bayer_bits(bayer);
+	unsigned int phase = bayer->cfa == BAYER_CFA_GBRG ||
+			     bayer->cfa == BAYER_CFA_GRBG;
+	bool red = bayer->cfa == BAYER_CFA_RGGB || bayer->cfa == BAYER_CFA_GRBG;
+	unsigned int y, y_last, i;
+
+	switch (job->algorithm) {
+	case IMAGE_CONVERT_BINNING:
+		y_last = (y_end + 1) / 2;
+		if (y_last > height / 2)
+			y_last = height / 2;
+
+		for (y = (y_start + 1) / 2; y < y_last; y++) {
+			uint16_t *row, *next;
+
+			row = bayer_wide_line(job, bayer, lines, lines_y, 3,
+					      2 * y);
+			next = bayer_wide_line(job, bayer, lines, lines_y, 3,
+					       2 * y + 1);
+
+			bayer_wide_bin_row(pixels + y * (width / 2) * 3, row,
+					   next, width / 2, phase, red, bits);
+			bayer_wide_ccm_row(job, pixels + y * (width / 2) * 3,
+					   width / 2);
+		}
+		break;
+	case IMAGE_CONVERT_MALVAR:
+		/* Only unpacked samples are supported. */
+		for (y = y_start; y < y_end; y++) {
+			uint16_t *rows[5];
+
+			for (i = 0; i < 5; i++)
+				rows[i] = bayer_wide_line(job, bayer, lines,
+							  lines_y, 5,
+							  bayer_mirror(y + i - 2,
+								       height));
+
+			bayer_wide_malvar_row(pixels + y * width * 3, rows,
+					      width, (y & 1) ? !phase : phase,
+					      (y & 1) ? !red : red, bits);
+			bayer_wide_ccm_row(job, pixels + y * width * 3, width);
+		}
+		break;
+	default:
+		for (y = y_start; y < y_end; y++) {
+			uint16_t *up, *row, *down;
+
+			up = bayer_wide_line(job, bayer, lines, lines_y, 3,
+					     y > 0 ? y - 1 : y + 1);
+			row = bayer_wide_line(job, bayer, lines, lines_y, 3, y);
+			down = bayer_wide_line(job, bayer, lines, lines_y, 3,
+					       y < (height - 1) ? y + 1 : y - 1);
+
+			bayer_wide_row(pixels + y * width * 3, up, row, down,
+				       width, (y & 1) ? !phase : phase,
+				       (y & 1) ? !red : red, bits);
+			bayer_wide_ccm_row(job, pixels + y * width * 3, width);
+		}
+		break;
+	}
+}
+
+/*
+ * Statistics are gathered from source lines after each chunk of lines is
+ * converted, while they are still in cache, to a set for the band that is
+ * merged at the end. Quads are counted with the band of their first line.
+ */
+
+#define BAYER_STATS_LINES	32
+
+static pthread_mutex_t bayer_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+bayer_inline uint32_t bayer_stats_sample(const struct bayer_format *bayer,
+				   uint8_t *line, unsigned int x,
+				   unsigned int bits)
+{
+	uint8_t *group;
+
+	if (bayer->packing == BAYER_PACKING_NONE)
+		return bits == 8 ? line[x] : ((uint16_t *)line)[x];
+
+	if (bits == 10) {
+		group = line + (x / 4) * 5;
+		return (group[x % 4] << 2) | ((group[4] >> (2 * (x % 4))) & 0x3);
+	}
+
+	group = line + (x / 2) * 3;
+	return (group[x % 2] << 4) | ((group[2] >> (4 * (x % 2))) & 0xf);
+}
+
+static void bayer_stats_lines(struct image_convert_job *job,
+			      struct image_convert_stats *stats,
+			      unsigned int y_start, unsigned int y_end)
+{
+	const struct bayer_format *bayer = bayer_format_find(job->format);
+	unsigned int stride = bayer_stride(bayer, job->width);
+	unsigned int step = 2 * job->stats->step;
+	unsigned int bits = bayer_bits(bayer);
+	uint32_t max = (1 << bits) - 1;
+	unsigned int x, y, i, j;
+
+	y = (y_start + step - 1) / step * step;
+
+	for (; y < y_end && y + 1 < job->height; y += step) {
+		for (i = 0; i < 2; i++) {
+			const uint8_t *channels = bayer_channels[bayer->cfa][i];
+			uint8_t *line = job->src + (y + i) * stride;
+			uint32_t *histograms[2] = {
+				stats->histograms[channels[0]],
+				stats->histograms[channels[1]],
+			};
+			/* Sums are kept in registers rather than in memory. */
+			uint64_t sums[2] = { 0, 0 };
+			uint32_t clipped[2] = { 0, 0 };
+			uint32_t count = 0;
+
+			for (x = 0; x + 1 < job->width; x += step, count++) {
+				for (j = 0; j < 2; j++) {
+					uint32_t value;
+
+					value = bayer_stats_sample(bayer, line,
+								   x + j, bits);
+					if (value >= max) {
+						value = max;
+						clipped[j]++;
+					}
+
+					histograms[j][value >> (bits - 8)]++;
+					sums[j] += value;
+				}
+			}
+
+			for (j = 0; j < 2; j++) {
+				stats->sums[channels[j]] += sums[j];
+				stats->counts[channels[j]] += count;
+				stats->clipped[channels[j]] += clipped[j];
+			}
+		}
+	}
+}
+
+static void bayer_stats_convert(struct image_convert_job *job,
+				unsigned int y_start, unsigned int y_end)
+{
+	struct image_convert_stats stats = { 0 };
+	unsigned int y, y_next, c, i;
+
+	for (y = y_start; y < y_end; y = y_next) {
+		y_next = y + BAYER_STATS_LINES;
+		if (y_next > y_end)
+			y_next = y_end;
+
+		job->stats_convert(job, y, y_next);
+		bayer_stats_lines(job, &stats, y, y_next);
+	}
+
+	pthread_mutex_lock(&bayer_stats_mutex);
+
+	for (c = 0; c < IMAGE_CONVERT_CHANNEL_COUNT; c++) {
+		for (i = 0; i < 256; i++)
+			job->stats->histograms[c][i] += stats.histograms[c][i];
+
+		job->stats->sums[c] += stats.sums[c];
+		job->stats->counts[c] += stats.counts[c];
+		job->stats->clipped[c] += stats.clipped[c];
+	}
+
+	pthread_mutex_unlock(&bayer_stats_mutex);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * The 8-bit SIMD kernels work on 8-bit lanes only: truncating averages are
+ * derived from the rounding pavgb instruction and the diagonal average is
+ * rebuilt from the two truncated pair averages and their dropped low bits.
+ * The 16-bit kernels use the same approach on 16-bit lanes.
+ */
+
+#define sse2_inline	bayer_inline __attribute__((target("sse2")))
+#define avx2_inline	bayer_inline __attribute__((target("avx2")))
+
+sse2_inline __m128i bayer_8_avg_sse2(__m128i a, __m128i b, __m128i one)
+{
+	return _mm_sub_epi8(_mm_avg_epu8(a, b),
+			    _mm_and_si128(_mm_xor_si128(a, b), one));
+}
+
+sse2_inline void bayer_8_row_sse2(uint32_t *pixels, uint8_t *up, uint8_t *row,
+				  uint8_t *down, unsigned int width,
+				  unsigned int phase, bool red,
+				  unsigned int bits)
+{
+	__m128i one = _mm_set1_epi8(1);
+	__m128i zero = _mm_setzero_si128();
+	__m128i mask = _mm_set1_epi16(phase ? 0xff00 : 0x00ff);
+	unsigned int x;
+
+	bayer_8_row_span(pixels, up, row, down, width, 0, 2, phase, red);
+
+	for (x = 2; x + 16 < width; x += 16) {
+		__m128i l, c, r, u, d, ul, ur, dl, dr;
+		__m128i hn, vn, gq, di, h1, h2, carry;
+		__m128i vc, vg, vo, vr, vb, bg, r0;
+
+		l = _mm_loadu_si128((__m128i *)(row + x - 1));
+		c = _mm_loadu_si128((__m128i *)(row + x));
+		r = _mm_loadu_si128((__m128i *)(row + x + 1));
+		u = _mm_loadu_si128((__m128i *)(up + x));
+		d = _mm_loadu_si128((__m128i *)(down + x));
+		ul = _mm_loadu_si128((__m128i *)(up + x - 1));
+		ur = _mm_loadu_si128((__m128i *)(up + x + 1));
+		dl = _mm_loadu_si128((__m128i *)(down + x - 1));
+		dr = _mm_loadu_si128((__m128i *)(down + x + 1));
+
+		hn = bayer_8_avg_sse2(l, r, one);
+		vn = bayer_8_avg_sse2(u, d, one);
+		gq = bayer_8_avg_sse2(hn, vn, one);
+
+		h1 = bayer_8_avg_sse2(ul, ur, one);
+		h2 = bayer_8_avg_sse2(dl, dr, one);
+		carry = _mm_and_si128(_mm_xor_si128(ul, ur),
+				      _mm_xor_si128(dl, dr));
+		di = _mm_sub_epi8(_mm_avg_epu8(h1, h2),
+				  _mm_andnot_si128(carry,
+						   _mm_and_si128(_mm_xor_si128(h1, h2),
+								 one)));
+
+		vc = _mm_or_si128(_mm_and_si128(mask, c),
+				  _mm_andnot_si128(mask, hn));
+		vg = _mm_or_si128(_mm_and_si128(mask, gq),
+				  _mm_andnot_si128(mask, c));
+		vo = _mm_or_si128(_mm_and_si128(mask, di),
+				  _mm_andnot_si128(mask, vn));
+
+		vr = red ? vc : vo;
+		vb = red ? vo : vc;
+
+		bg = _mm_unpacklo_epi8(vb, vg);
+		r0 = _mm_unpacklo_epi8(vr, zero);
+		_mm_storeu_si128((__m128i *)(pixels + x),
+				 _mm_unpacklo_epi16(bg, r0));
+		_mm_storeu_si128((__m128i *)(pixels + x + 4),
+				 _mm_unpackhi_epi16(bg, r0));
+
+		bg = _mm_unpackhi_epi8(vb, vg);
+		r0 = _mm_unpackhi_epi8(vr, zero);
+		_mm_storeu_si128((__m128i *)(pixels + x + 8),
+				 _mm_unpacklo_epi16(bg, r0));
+		_mm_storeu_si128((__m128i *)(pixels + x + 12),
+				 _mm_unpackhi_epi16(bg, r0));
+	}
+
+	bayer_8_row_span(pixels, up, row, down, width, x, width, phase, red);
+}
+
+sse2_inline __m128i bayer_16_avg_sse2(__m128i a, __m128i b, __m128i one)
+{
+	return _mm_sub_epi16(_mm_avg_epu16(a, b),
+			     _mm_and_si128(_mm_xor_si128(a, b), one));
+}
+
+sse2_inline __m128i bayer_16_avg4_sse2(__m128i a, __m128i b, __m128i c,
+				       __m128i d, __m128i one)
+{
+	__m128i h1 = bayer_16_avg_sse2(a, b, one);
+	__m128i h2 = bayer_16_avg_sse2(c, d, one);
+	__m128i carry = _mm_and_si128(_mm_xor_si128(a, b),
+				      _mm_xor_si128(c, d));
+
+	return _mm_sub_epi16(_mm_avg_epu16(h1, h2),
+			     _mm_andnot_si128(carry,
+					      _mm_and_si128(_mm_xor_si128(h1, h2),
+							    one)));
+}
+
+sse2_inline __m128i bayer_16_scale_sse2(__m128i v, unsigned int bits)
+{
+	v = _mm_slli_epi16(v, 16 - bits);
+	v = _mm_mulhi_epu16(v, _mm_set1_epi16(bayer_16_scale(bits)));
+
+	return _mm_srli_epi16(v, 8);
+}
+
+sse2_inline void bayer_16_row_sse2(uint32_t *pixels, uint16_t *up,
+				   uint16_t *row, uint16_t *down,
+				   unsigned int width, unsigned int phase,
+				   bool red, unsigned int bits)
+{
+	__m128i one = _mm_set1_epi16(1);
+	__m128i alpha = _mm_set1_epi16(0xff00);
+	__m128i mask = _mm_set1_epi32(phase ? 0xffff0000 : 0x0000ffff);
+	unsigned int x;
+
+	bayer_16_row_span(pixels, up, row, down, width, 0, 2, phase, red,
+			  bits);
+
+	for (x = 2; x + 8 < width; x += 8) {
+		__m128i l, c, r, u, d, ul, ur, dl, dr;
+		__m128i hn, vn, gq, di;
+		__m128i vc, vg, vo, vr, vb, bg, ra;
+
+		l = _mm_loadu_si128((__m128i *)(row + x - 1));
+		c = _mm_loadu_si128((__m128i *)(row + x));
+		r = _mm_loadu_si128((__m128i *)(row + x + 1));
+		u = _mm_loadu_si128((__m128i *)(up + x));
+		d = _mm_loadu_si128((__m128i *)(down + x));
+		ul = _mm_loadu_si128((__m128i *)(up + x - 1));
+		ur = _mm_loadu_si128((__m128i *)(up + x + 1));
+		dl = _mm_loadu_si128((__m128i *)(down + x - 1));
+		dr = _mm_loadu_si128((__m128i *)(down + x + 1));
+
+		hn = bayer_16_avg_sse2(l, r, one);
+		vn = bayer_16_avg_sse2(u, d, one);
+		gq = bayer_16_avg4_sse2(l, r, u, d, one);
+		di = bayer_16_avg4_sse2(ul, ur, dl, dr, one);
+
+		vc = _mm_or_si128(_mm_and_si128(mask, c),
+				  _mm_andnot_si128(mask, hn));
+		vg = _mm_or_si128(_mm_and_si128(mask, gq),
+				  _mm_andnot_si128(mask, c));
+		vo = _mm_or_si128(_mm_and_si128(mask, di),
+				  _mm_andnot_si128(mask, vn));
+
+		vc = bayer_16_scale_sse2(vc, bits);
+		vg = bayer_16_scale_sse2(vg, bits);
+		vo = bayer_16_scale_sse2(vo, bits);
+
+		vr = red ? vc : vo;
+		vb = red ? vo : vc;
+
+		bg = _mm_or_si128(vb, _mm_slli_epi16(vg, 8));
+		ra = _mm_or_si128(vr, alpha);
+
+		_mm_storeu_si128((__m128i *)(pixels + x),
+				 _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *)(pixels + x + 4),
+				 _mm_unpackhi_epi16(bg, ra));
+	}
+
+	bayer_16_row_span(pixels, up, row, down, width, x, width, phase, red,
+			  bits);
+}
+
+/*
+ * Binning splits even and odd samples of two lines. Signed saturation is
+ * the only 32-bit to 16-bit packing available, so samples are offset for it.
+ */
+sse2_inline void bayer_8_bin_row_sse2(uint32_t *pixels, uint8_t *row,
+				      uint8_t *next, unsigned int width,
+				      unsigned int phase, bool red,
+				      unsigned int bits)
+{
+	__m128i one = _mm_set1_epi8(1);
+	__m128i zero = _mm_setzero_si128();
+	__m128i mask = _mm_set1_epi16(0x00ff);
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i a0 = _mm_loadu_si128((__m128i *)(row + 2 * x));
+		__m128i a1 = _mm_loadu_si128((__m128i *)(row + 2 * x + 16));
+		__m128i b0 = _mm_loadu_si128((__m128i *)(next + 2 * x));
+		__m128i b1 = _mm_loadu_si128((__m128i *)(next + 2 * x + 16));
+		__m128i e0, o0, e1, o1, c0, c1, vg, vr, vb, bg, r0;
+
+		e0 = _mm_packus_epi16(_mm_and_si128(a0, mask),
+				      _mm_and_si128(a1, mask));
+		o0 = _mm_packus_epi16(_mm_srli_epi16(a0, 8),
+				      _mm_srli_epi16(a1, 8));
+		e1 = _mm_packus_epi16(_mm_and_si128(b0, mask),
+				      _mm_and_si128(b1, mask));
+		o1 = _mm_packus_epi16(_mm_srli_epi16(b0, 8),
+				      _mm_srli_epi16(b1, 8));
+
+		c0 = phase ? o0 : e0;
+		c1 = phase ? e1 : o1;
+		vg = bayer_8_avg_sse2(phase ? e0 : o0, phase ? o1 : e1, one);
+
+		vr = red ? c0 : c1;
+		vb = red ? c1 : c0;
+
+		bg = _mm_unpacklo_epi8(vb, vg);
+		r0 = _mm_unpacklo_epi8(vr, zero);
+		_mm_storeu_si128((__m128i *)(pixels + x),
+				 _mm_unpacklo_epi16(bg, r0));
+		_mm_storeu_si128((__m128i *)(pixels + x + 4),
+				 _mm_unpackhi_epi16(bg, r0));
+
+		bg = _mm_unpackhi_epi8(vb, vg);
+		r0 = _mm_unpackhi_epi8(vr, zero);
+		_mm_storeu_si128((__m128i *)(pixels + x + 8),
+				 _mm_unpacklo_epi16(bg, r0));
+		_mm_storeu_si128((__m128i *)(pixels + x + 12),
+				 _mm_unpackhi_epi16(bg, r0));
+	}
+
+	bayer_8_bin_row_span(pixels, row, next, x, width, phase, red);
+}
+
+sse2_inline __m128i bayer_16_pack_sse2(__m128i lo, __m128i hi)
+{
+	__m128i bias = _mm_set1_epi32(0x8000);
+
+	return _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(lo, bias),
+					     _mm_sub_epi32(hi, bias)),
+			     _mm_set1_epi16(0x8000));
+}
+
+sse2_inline void bayer_16_bin_row_sse2(uint32_t *pixels, uint16_t *row,
+				       uint16_t *next, unsigned int width,
+				       unsigned int phase, bool red,
+				       unsigned int bits)
+{
+	__m128i one = _mm_set1_epi16(1);
+	__m128i alpha = _mm_set1_epi16(0xff00);
+	__m128i mask = _mm_set1_epi32(0xffff);
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i a0 = _mm_loadu_si128((__m128i *)(row + 2 * x));
+		__m128i a1 = _mm_loadu_si128((__m128i *)(row + 2 * x + 8));
+		__m128i b0 = _mm_loadu_si128((__m128i *)(next + 2 * x));
+		__m128i b1 = _mm_loadu_si128((__m128i *)(next + 2 * x + 8));
+		__m128i e0, o0, e1, o1, c0, c1, vg, vr, vb, bg, ra;
+
+		e0 = bayer_16_pack_sse2(_mm_and_si128(a0, mask),
+					_mm_and_si128(a1, mask));
+		o0 = bayer_16_pack_sse2(_mm_srli_epi32(a0, 16),
+					_mm_srli_epi32(a1, 16));
+		e1 = bayer_16_pack_sse2(_mm_and_si128(b0, mask),
+					_mm_and_si128(b1, mask));
+		o1 = bayer_16_pack_sse2(_mm_srli_epi32(b0, 16),
+					_mm_srli_epi32(b1, 16));
+
+		c0 = bayer_16_scale_sse2(phase ? o0 : e0, bits);
+		c1 = bayer_16_scale_sse2(phase ? e1 : o1, bits);
+		vg = bayer_16_avg_sse2(phase ? e0 : o0, phase ? o1 : e1, one);
+		vg = bayer_16_scale_sse2(vg, bits);
+
+		vr = red ? c0 : c1;
+		vb = red ? c1 : c0;
+
+		bg = _mm_or_si128(vb, _mm_slli_epi16(vg, 8));
+		ra = _mm_or_si128(vr, alpha);
+
+		_mm_storeu_si128((__m128i *)(pixels + x),
+				 _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *)(pixels + x + 4),
+				 _mm_unpackhi_epi16(bg, ra));
+	}
+
+	bayer_16_bin_row_span(pixels, row, next, x, width, phase, red, bits);
+}
+
+/*
+ * Malvar-He-Cutler filters are computed for all lanes, then selected by site.
+ * Outputs are left scaled by 16 and rounded by the caller.
+ */
+sse2_inline void bayer_malvar_sse2(__m128i *values, __m128i c, __m128i h1,
+				   __m128i h2, __m128i v1, __m128i v2,
+				   __m128i di, __m128i mask)
+{
+	__m128i round = _mm_set1_epi16(8);
+	__m128i c16 = _mm_slli_epi16(c, 4);
+	__m128i c10 = _mm_mullo_epi16(c, _mm_set1_epi16(10));
+	__m128i di2 = _mm_slli_epi16(di, 1);
+	__m128i x2 = _mm_add_epi16(h2, v2);
+	__m128i gq, dq, hq, vq;
+	unsigned int i;
+
+	gq = _mm_add_epi16(_mm_slli_epi16(c, 3),
+			   _mm_slli_epi16(_mm_add_epi16(h1, v1), 2));
+	gq = _mm_sub_epi16(gq, _mm_slli_epi16(x2, 1));
+
+	dq = _mm_add_epi16(_mm_mullo_epi16(c, _mm_set1_epi16(12)),
+			   _mm_slli_epi16(di, 2));
+	dq = _mm_sub_epi16(dq, _mm_mullo_epi16(x2, _mm_set1_epi16(3)));
+
+	hq = _mm_add_epi16(_mm_add_epi16(c10, _mm_slli_epi16(h1, 3)), v2);
+	hq = _mm_sub_epi16(hq, _mm_add_epi16(_mm_slli_epi16(h2, 1), di2));
+
+	vq = _mm_add_epi16(_mm_add_epi16(c10, _mm_slli_epi16(v1, 3)), h2);
+	vq = _mm_sub_epi16(vq, _mm_add_epi16(_mm_slli_epi16(v2, 1), di2));
+
+	values[0] = _mm_or_si128(_mm_and_si128(mask, c16),
+				 _mm_andnot_si128(mask, hq));
+	values[1] = _mm_or_si128(_mm_and_si128(mask, gq),
+				 _mm_andnot_si128(mask, c16));
+	values[2] = _mm_or_si128(_mm_and_si128(mask, dq),
+				 _mm_andnot_si128(mask, vq));
+
+	for (i = 0; i < 3; i++)
+		values[i] = _mm_srai_epi16(_mm_add_epi16(values[i], round), 4);
+}
+
+sse2_inline void bayer_malvar_store_sse2(uint32_t *pixels, __m128i *values,
+					 bool red, __m128i alpha)
+{
+	__m128i vr = red ? values[0] : values[2];
+	__m128i vb = red ? values[2] : values[0];
+	__m128i bg = _mm_or_si128(vb, _mm_slli_epi16(values[1], 8));
+	__m128i ra = _mm_or_si128(vr, alpha);
+
+	_mm_storeu_si128((__m128i *)pixels, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i *)(pixels + 4), _mm_unpackhi_epi16(bg, ra));
+}
+
+sse2_inline __m128i bayer_8_load_sse2(uint8_t *samples)
+{
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)samples),
+				 _mm_setzero_si128());
+}
+
+sse2_inline void bayer_8_malvar_row_sse2(uint32_t *pixels, uint8_t **rows,
+					 unsigned int width,
+					 unsigned int x_start,
+					 unsigned int x_end,
+					 unsigned int phase, bool red,
+					 unsigned int bits)
+{
+	uint8_t *r0 = rows[0], *r1 = rows[1], *r2 = rows[2];
+	uint8_t *r3 = rows[3], *r4 = rows[4];
+	__m128i mask = _mm_set1_epi32(phase ? 0xffff0000 : 0x0000ffff);
+	__m128i zero = _mm_setzero_si128();
+	__m128i max = _mm_set1_epi16(255);
+	unsigned int x = x_start > 2 ? x_start : 2;
+	unsigned int x_last = x_end < width - 2 ? x_end : width - 2;
+	unsigned int i;
+
+	bayer_8_malvar_row_span(pixels, rows, width, x_start, x, phase, red);
+
+	for (; x + 8 <= x_last; x += 8) {
+		__m128i values[3];
+
+		bayer_malvar_sse2(values, bayer_8_load_sse2(r2 + x),
+				  _mm_add_epi16(bayer_8_load_sse2(r2 + x - 1),
+						bayer_8_load_sse2(r2 + x + 1)),
+				  _mm_add_epi16(bayer_8_load_sse2(r2 + x - 2),
+						bayer_8_load_sse2(r2 + x + 2)),
+				  _mm_add_epi16(bayer_8_load_sse2(r1 + x),
+						bayer_8_load_sse2(r3 + x)),
+				  _mm_add_epi16(bayer_8_load_sse2(r0 + x),
+						bayer_8_load_sse2(r4 + x)),
+				  _mm_add_epi16(_mm_add_epi16(bayer_8_load_sse2(r1 + x - 1),
+							      bayer_8_load_sse2(r1 + x + 1)),
+						_mm_add_epi16(bayer_8_load_sse2(r3 + x - 1),
+							      bayer_8_load_sse2(r3 + x + 1))),
+				  mask);
+
+		for (i = 0; i < 3; i++)
+			values[i] = _mm_min_epi16(_mm_max_epi16(values[i],
+								zero), max);
+
+		bayer_malvar_store_sse2(pixels + x, values, red, zero);
+	}
+
+	bayer_8_malvar_row_span(pixels, rows, width, x, x_end, phase, red);
+}
+
+sse2_inline __m128i bayer_16_load_sse2(uint16_t *samples)
+{
+	return _mm_loadu_si128((__m128i *)samples);
+}
+
+sse2_inline void bayer_16_malvar_row_sse2(uint32_t *pixels, uint16_t **rows,
+					  unsigned int width,
+					  unsigned int x_start,
+					  unsigned int x_end,
+					  unsigned int phase, bool red,
+					  unsigned int bits)
+{
+	uint16_t *r0 = rows[0], *r1 = rows[1], *r2 = rows[2];
+	uint16_t *r3 = rows[3], *r4 = rows[4];
+	__m128i mask = _mm_set1_epi32(phase ? 0xffff0000 : 0x0000ffff);
+	__m128i zero = _mm_setzero_si128();
+	__m128i max = _mm_set1_epi16((1 << bits) - 1);
+	__m128i alpha = _mm_set1_epi16(0xff00);
+	unsigned int x = x_start > 2 ? x_start : 2;
+	unsigned int x_last = x_end < width - 2 ? x_end : width - 2;
+	unsigned int i;
+
+	bayer_16_malvar_row_span(pixels, rows, width, x_start, x, phase, red,
+				 bits);
+
+	for (; x + 8 <= x_last; x += 8) {
+		__m128i values[3];
+
+		bayer_malvar_sse2(values, bayer_16_load_sse2(r2 + x),
+				  _mm_add_epi16(bayer_16_load_sse2(r2 + x - 1),
+						bayer_16_load_sse2(r2 + x + 1)),
+				  _mm_add_epi16(bayer_16_load_sse2(r2 + x - 2),
+						bayer_16_load_sse2(r2 + x + 2)),
+				  _mm_add_epi16(bayer_16_load_sse2(r1 + x),
+						bayer_16_load_sse2(r3 + x)),
+				  _mm_add_epi16(bayer_16_load_sse2(r0 + x),
+						bayer_16_load_sse2(r4 + x)),
+				  _mm_add_epi16(_mm_add_epi16(bayer_16_load_sse2(r1 + x - 1),
+							      bayer_16_load_sse2(r1 + x + 1)),
+						_mm_add_epi16(bayer_16_load_sse2(r3 + x - 1),
+							      bayer_16_load_sse2(r3 + x + 1))),
+				  mask);
+
+		for (i = 0; i < 3; i++) {
+			values[i] = _mm_min_epi16(_mm_max_epi16(values[i],
+								zero), max);
+			values[i] = bayer_16_scale_sse2(values[i], bits);
+		}
+
+		bayer_malvar_store_sse2(pixels + x, values, red, alpha);
+	}
+
+	bayer_16_malvar_row_span(pixels, rows, width, x, x_end, phase, red,
+				 bits);
+}
+
+/*
+ * Corrected samples are rebuilt from the 32-bit products of 16-bit lanes,
+ * saturating those past 24 bits, then clamped with saturating subtraction.
+ */
+sse2_inline __m128i bayer_correct_sse2(__m128i v, __m128i offset,
+				       __m128i gain, __m128i max)
+{
+	__m128i lo, hi, r, fits;
+
+	v = _mm_subs_epu16(v, offset);
+	lo = _mm_mullo_epi16(v, gain);
+	hi = _mm_mulhi_epu16(v, gain);
+
+	r = _mm_or_si128(_mm_slli_epi16(hi, 8), _mm_srli_epi16(lo, 8));
+	fits = _mm_cmpeq_epi16(_mm_srli_epi16(hi, 8), _mm_setzero_si128());
+	r = _mm_or_si128(r, _mm_andnot_si128(fits, _mm_set1_epi16(-1)));
+
+	return _mm_sub_epi16(r, _mm_subs_epu16(r, max));
+}
+
+sse2_inline void bayer_8_correct_sse2(uint8_t *line, uint8_t *samples,
+				      unsigned int width, uint16_t *offsets,
+				      uint16_t *gains, unsigned int bits)
+{
+	__m128i offset = _mm_set1_epi32(offsets[0] | (offsets[1] << 16));
+	__m128i gain = _mm_set1_epi32(gains[0] | (gains[1] << 16));
+	__m128i max = _mm_set1_epi16(255);
+	__m128i zero = _mm_setzero_si128();
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *)(samples + x));
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+
+		lo = bayer_correct_sse2(lo, offset, gain, max);
+		hi = bayer_correct_sse2(hi, offset, gain, max);
+
+		_mm_storeu_si128((__m128i *)(line + x),
+				 _mm_packus_epi16(lo, hi));
+	}
+
+	bayer_8_correct_span(line, samples, x, width, offsets, gains);
+}
+
+sse2_inline void bayer_16_correct_sse2(uint16_t *line, uint16_t *samples,
+				       unsigned int width, uint16_t *offsets,
+				       uint16_t *gains, unsigned int bits)
+{
+	__m128i offset = _mm_set1_epi32(offsets[0] | (offsets[1] << 16));
+	__m128i gain = _mm_set1_epi32(gains[0] | (gains[1] << 16));
+	__m128i max = _mm_set1_epi16((1 << bits) - 1);
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i v = _mm_loadu_si128((__m128i *)(samples + x));
+
+		_mm_storeu_si128((__m128i *)(line + x),
+				 bayer_correct_sse2(v, offset, gain, max));
+	}
+
+	bayer_16_correct_span(line, samples, x, width, offsets, gains, bits);
+}
+
+/* Without byte shuffles, packed lines are unpacked as with scalar code. */
+#define bayer_mipi_unpack_sse2	bayer_mipi_unpack_scalar
+
+BAYER_CONVERTERS(sse2, __attribute__((target("sse2"))))
+
+avx2_inline __m256i bayer_8_avg_avx2(__m256i a, __m256i b, __m256i one)
+{
+	return _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+			       _mm256_and_si256(_mm256_xor_si256(a, b), one));
+}
+
+avx2_inline void bayer_8_row_avx2(uint32_t *pixels, uint8_t *up, uint8_t *row,
+				  uint8_t *down, unsigned int width,
+				  unsigned int phase, bool red,
+				  unsigned int bits)
+{
+	__m256i one = _mm256_set1_epi8(1);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i mask = _mm256_set1_epi16(phase ? 0xff00 : 0x00ff);
+	unsigned int x;
+
+	bayer_8_row_span(pixels, up, row, down, width, 0, 2, phase, red);
+
+	for (x = 2; x + 32 < width; x += 32) {
+		__m256i l, c, r, u, d, ul, ur, dl, dr;
+		__m256i hn, vn, gq, di, h1, h2, carry;
+		__m256i vc, vg, vo, vr, vb, bg, r0;
+		__m256i p0, p1, p2, p3;
+
+		l = _mm256_loadu_si256((__m256i *)(row + x - 1));
+		c = _mm256_loadu_si256((__m256i *)(row + x));
+		r = _mm256_loadu_si256((__m256i *)(row + x + 1));
+		u = _mm256_loadu_si256((__m256i *)(up + x));
+		d = _mm256_loadu_si256((__m256i *)(down + x));
+		ul = _mm256_loadu_si256((__m256i *)(up + x - 1));
+		ur = _mm256_loadu_si256((__m256i *)(up + x + 1));
+		dl = _mm256_loadu_si256((__m256i *)(down + x - 1));
+		dr = _mm256_loadu_si256((__m256i *)(down + x + 1));
+
+		hn = bayer_8_avg_avx2(l, r, one);
+		vn = bayer_8_avg_avx2(u, d, one);
+		gq = bayer_8_avg_avx2(hn, vn, one);
+
+		h1 = bayer_8_avg_avx2(ul, ur, one);
+		h2 = bayer_8_avg_avx2(dl, dr, one);
+		carry = _mm256_and_si256(_mm256_xor_si256(ul, ur),
+					 _mm256_xor_si256(dl, dr));
+		di = _mm256_sub_epi8(_mm256_avg_epu8(h1, h2),
+				     _mm256_andnot_si256(carry,
+							 _mm256_and_si256(_mm256_xor_si256(h1, h2),
+									  one)));
+
+		vc = _mm256_blendv_epi8(hn, c, mask);
+		vg = _mm256_blendv_epi8(c, gq, mask);
+		vo = _mm256_blendv_epi8(vn, di, mask);
+
+		vr = red ? vc : vo;
+		vb = red ? vo : vc;
+
+		/* Unpacking works within 128-bit lanes, reorder on store. */
+		bg = _mm256_unpacklo_epi8(vb, vg);
+		r0 = _mm256_unpacklo_epi8(vr, zero);
+		p0 = _mm256_unpacklo_epi16(bg, r0);
+		p1 = _mm256_unpackhi_epi16(bg, r0);
+
+		bg = _mm256_unpackhi_epi8(vb, vg);
+		r0 = _mm256_unpackhi_epi8(vr, zero);
+		p2 = _mm256_unpacklo_epi16(bg, r0);
+		p3 = _mm256_unpackhi_epi16(bg, r0);
+
+		_mm256_storeu_si256((__m256i *)(pixels + x),
+				    _mm256_permute2x128_si256(p0, p1, 0x20));
+		_mm256_storeu_si256((__m256i *)(pixels + x + 8),
+				    _mm256_permute2x128_si256(p2, p3, 0x20));
+		_mm256_storeu_si256((__m256i *)(pixels + x + 16),
+				    _mm256_permute2x128_si256(p0, p1, 0x31));
+		_mm256_storeu_si256((__m256i *)(pixels + x + 24),
+				    _mm256_permute2x128_si256(p2, p3, 0x31));
+	}
+
+	bayer_8_row_span(pixels, up, row, down, width, x, width, phase, red);
+}
+
+avx2_inline __m256i bayer_16_avg_avx2(__m256i a, __m256i b, __m256i one)
+{
+	return _mm256_sub_epi16(_mm256_avg_epu16(a, b),
+				_mm256_and_si256(_mm256_xor_si256(a, b), one));
+}
+
+avx2_inline __m256i bayer_16_avg4_avx2(__m256i a, __m256i b, __m256i c,
+				       __m256i d, __m256i one)
+{
+	__m256i h1 = bayer_16_avg_avx2(a, b, one);
+	__m256i h2 = bayer_16_avg_avx2(c, d, one);
+	__m256i carry = _mm256_and_si256(_mm256_xor_si256(a, b),
+					 _mm256_xor_si256(c, d));
+
+	return _mm256_sub_epi16(_mm256_avg_epu16(h1, h2),
+				_mm256_andnot_si256(carry,
+						    _mm256_and_si256(_mm256_xor_si256(h1, h2),
+								     one)));
+}
+
+avx2_inline __m256i bayer_16_scale_avx2(__m256i v, unsigned int bits)
+{
+	v = _mm256_slli_epi16(v, 16 - bits);
+	v = _mm256_mulhi_epu16(v, _mm256_set1_epi16(bayer_16_scale(bits)));
+
+	return _mm256_srli_epi16(v, 8);
+}
+
+avx2_inline void bayer_16_row_avx2(uint32_t *pixels, uint16_t *up,
+				   uint16_t *row, uint16_t *down,
+				   unsigned int width, unsigned int phase,
+				   bool red, unsigned int bits)
+{
+	__m256i one = _mm256_set1_epi16(1);
+	__m256i alpha = _mm256_set1_epi16(0xff00);
+	__m256i mask = _mm256_set1_epi32(phase ? 0xffff0000 : 0x0000ffff);
+	unsigned int x;
+
+	bayer_16_row_span(pixels, up, row, down, width, 0, 2, phase, red,
+			  bits);
+
+	for (x = 2; x + 16 < width; x += 16) {
+		__m256i l, c, r, u, d, ul, ur, dl, dr;
+		__m256i hn, vn, gq, di;
+		__m256i vc, vg, vo, vr, vb, bg, ra, p0, p1;
+
+		l = _mm256_loadu_si256((__m256i *)(row + x - 1));
+		c = _mm256_loadu_si256((__m256i *)(row + x));
+		r = _mm256_loadu_si256((__m256i *)(row + x + 1));
+		u = _mm256_loadu_si256((__m256i *)(up + x));
+		d = _mm256_loadu_si256((__m256i *)(down + x));
+		ul = _mm256_loadu_si256((__m256i *)(up + x - 1));
+		ur = _mm256_loadu_si256((__m256i *)(up + x + 1));
+		dl = _mm256_loadu_si256((__m256i *)(down + x - 1));
+		dr = _mm256_loadu_si256((__m256i *)(down + x + 1));
+
+		hn = bayer_16_avg_avx2(l, r, one);
+		vn = bayer_16_avg_avx2(u, d, one);
+		gq = bayer_16_avg4_avx2(l, r, u, d, one);
+		di = bayer_16_avg4_avx2(ul, ur, dl, dr, one);
+
+		vc = _mm256_blendv_epi8(hn, c, mask);
+		vg = _mm256_blendv_epi8(c, gq, mask);
+		vo = _mm256_blendv_epi8(vn, di, mask);
+
+		vc = bayer_16_scale_avx2(vc, bits);
+		vg = bayer_16_scale_avx2(vg, bits);
+		vo = bayer_16_scale_avx2(vo, bits);
+
+		vr = red ? vc : vo;
+		vb = red ? vo : vc;
+
+		bg = _mm256_or_si256(vb, _mm256_slli_epi16(vg, 8));
+		ra = _mm256_or_si256(vr, alpha);
+
+		/* Unpacking works within 128-bit lanes, reorder on store. */
+		p0 = _mm256_unpacklo_epi16(bg, ra);
+		p1 = _mm256_unpackhi_epi16(bg, ra);
+
+		_mm256_storeu_si256((__m256i *)(pixels + x),
+				    _mm256_permute2x128_si256(p0, p1, 0x20));
+		_mm256_storeu_si256((__m256i *)(pixels + x + 8),
+				    _mm256_permute2x128_si256(p0, p1, 0x31));
+	}
+
+	bayer_16_row_span(pixels, up, row, down, width, x, width, phase, red,
+			  bits);
+}
+
+/*
+ * Packed groups are spread to 16-bit lanes with byte shuffles, eight pixels
+ * at a time, while the low bits are aligned with a per-lane multiply.
+ */
+avx2_inline void bayer_mipi_unpack_avx2(uint16_t *line, uint8_t *packed,
+					unsigned int width, unsigned int bits)
+{
+	unsigned int stride = bayer_mipi_stride(width, bits);
+	unsigned int group = bits == 10 ? 10 : 12;
+	__m128i high, low, scale, mask;
+	unsigned int offset = 0;
+	unsigned int x = 0;
+
+	if (bits == 10) {
+		high = _mm_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1,
+				     5, -1, 6, -1, 7, -1, 8, -1);
+		low = _mm_setr_epi8(4, -1, 4, -1, 4, -1, 4, -1,
+				    9, -1, 9, -1, 9, -1, 9, -1);
+		scale = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+		mask = _mm_set1_epi16(0x3);
+	} else {
+		high = _mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1,
+				     6, -1, 7, -1, 9, -1, 10, -1);
+		low = _mm_setr_epi8(2, -1, 2, -1, 5, -1, 5, -1,
+				    8, -1, 8, -1, 11, -1, 11, -1);
+		scale = _mm_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1);
+		mask = _mm_set1_epi16(0xf);
+	}
+
+	for (; offset + 16 <= stride; x += 8, offset += group) {
+		__m128i v = _mm_loadu_si128((__m128i *)(packed + offset));
+		__m128i h, l;
+
+		h = _mm_slli_epi16(_mm_shuffle_epi8(v, high), bits - 8);
+		l = _mm_mullo_epi16(_mm_shuffle_epi8(v, low), scale);
+		l = _mm_and_si128(_mm_srli_epi16(l, 16 - bits), mask);
+
+		_mm_storeu_si128((__m128i *)(line + x), _mm_or_si128(h, l));
+	}
+
+	bayer_mipi_unpack_scalar(line + x, packed + offset, width - x, bits);
+}
+
+/* Packing works within 128-bit lanes, so quadwords are reordered after. */
+avx2_inline void bayer_8_bin_row_avx2(uint32_t *pixels, uint8_t *row,
+				      uint8_t *next, unsigned int width,
+				      unsigned int phase, bool red,
+				      unsigned int bits)
+{
+	__m256i one = _mm256_set1_epi8(1);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i mask = _mm256_set1_epi16(0x00ff);
+	unsigned int x;
+
+	for (x = 0; x + 32 <= width; x += 32) {
+		__m256i a0 = _mm256_loadu_si256((__m256i *)(row + 2 * x));
+		__m256i a1 = _mm256_loadu_si256((__m256i *)(row + 2 * x + 32));
+		__m256i b0 = _mm256_loadu_si256((__m256i *)(next + 2 * x));
+		__m256i b1 = _mm256_loadu_si256((__m256i *)(next + 2 * x + 32));
+		__m256i e0, o0, e1, o1, c0, c1, vg, vr, vb, bg, r0;
+		__m256i p0, p1, p2, p3;
+
+		e0 = _mm256_packus_epi16(_mm256_and_si256(a0, mask),
+					 _mm256_and_si256(a1, mask));
+		o0 = _mm256_packus_epi16(_mm256_srli_epi16(a0, 8),
+					 _mm256_srli_epi16(a1, 8));
+		e1 = _mm256_packus_epi16(_mm256_and_si256(b0, mask),
+					 _mm256_and_si256(b1, mask));
+		o1 = _mm256_packus_epi16(_mm256_srli_epi16(b0, 8),
+					 _mm256_srli_epi16(b1, 8));
+
+		e0 = _mm256_permute4x64_epi64(e0, 0xd8);
+		o0 = _mm256_permute4x64_epi64(o0, 0xd8);
+		e1 = _mm256_permute4x64_epi64(e1, 0xd8);
+		o1 = _mm256_permute4x64_epi64(o1, 0xd8);
+
+		c0 = phase ? o0 : e0;
+		c1 = phase ? e1 : o1;
+		vg = bayer_8_avg_avx2(phase ? e0 : o0, phase ? o1 : e1, one);
+
+		vr = red ? c0 : c1;
+		vb = red ? c1 : c0;
+
+		bg = _mm256_unpacklo_epi8(vb, vg);
+		r0 = _mm256_unpacklo_epi8(vr, zero);
+		p0 = _mm256_unpacklo_epi16(bg, r0);
+		p1 = _mm256_unpackhi_epi16(bg, r0);
+
+		bg = _mm256_unpackhi_epi8(vb, vg);
+		r0 = _mm256_unpackhi_epi8(vr, zero);
+		p2 = _mm256_unpacklo_epi16(bg, r0);
+		p3 = _mm256_unpackhi_epi16(bg, r0);
+
+		_mm256_storeu_si256((__m256i *)(pixels + x),
+				    _mm256_permute2x128_si256(p0, p1, 0x20));
+		_mm256_storeu_si256((__m256i *)(pixels + x + 8),
+				    _mm256_permute2x128_si256(p2, p3, 0x20));
+		_mm256_storeu_si256((__m256i *)(pixels + x + 16),
+				    _mm256_permute2x128_si256(p0, p1, 0x31));
+		_mm256_storeu_si256((__m256i *)(pixels + x + 24),
+				    _mm256_permute2x128_si256(p2, p3, 0x31));
+	}
+
+	bayer_8_bin_row_span(pixels, row, next, x, width, phase, red);
+}
+
+avx2_inline __m256i bayer_16_pack_avx2(__m256i lo, __m256i hi)
+{
+	return _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8);
+}
+
+avx2_inline void bayer_16_bin_row_avx2(uint32_t *pixels, uint16_t *row,
+				       uint16_t *next, unsigned int width,
+				       unsigned int phase, bool red,
+				       unsigned int bits)
+{
+	__m256i one = _mm256_set1_epi16(1);
+	__m256i alpha = _mm256_set1_epi16(0xff00);
+	__m256i mask = _mm256_set1_epi32(0xffff);
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i a0 = _mm256_loadu_si256((__m256i *)(row + 2 * x));
+		__m256i a1 = _mm256_loadu_si256((__m256i *)(row + 2 * x + 16));
+		__m256i b0 = _mm256_loadu_si256((__m256i *)(next + 2 * x));
+		__m256i b1 = _mm256_loadu_si256((__m256i *)(next + 2 * x + 16));
+		__m256i e0, o0, e1, o1, c0, c1, vg, vr, vb, bg, ra, p0, p1;
+
+		e0 = bayer_16_pack_avx2(_mm256_and_si256(a0, mask),
+					_mm256_and_si256(a1, mask));
+		o0 = bayer_16_pack_avx2(_mm256_srli_epi32(a0, 16),
+					_mm256_srli_epi32(a1, 16));
+		e1 = bayer_16_pack_avx2(_mm256_and_si256(b0, mask),
+					_mm256_and_si256(b1, mask));
+		o1 = bayer_16_pack_avx2(_mm256_srli_epi32(b0, 16),
+					_mm256_srli_epi32(b1, 16));
+
+		c0 = bayer_16_scale_avx2(phase ? o0 : e0, bits);
+		c1 = bayer_16_scale_avx2(phase ? e1 : o1, bits);
+		vg = bayer_16_avg_avx2(phase ? e0 : o0, phase ? o1 : e1, one);
+		vg = bayer_16_scale_avx2(vg, bits);
+
+		vr = red ? c0 : c1;
+		vb = red ? c1 : c0;
+
+		bg = _mm256_or_si256(vb, _mm256_slli_epi16(vg, 8));
+		ra = _mm256_or_si256(vr, alpha);
+
+		p0 = _mm256_unpacklo_epi16(bg, ra);
+		p1 = _mm256_unpackhi_epi16(bg, ra);
+
+		_mm256_storeu_si256((__m256i *)(pixels + x),
+				    _mm256_permute2x128_si256(p0, p1, 0x20));
+		_mm256_storeu_si256((__m256i *)(pixels + x + 8),
+				    _mm256_permute2x128_si256(p0, p1, 0x31));
+	}
+
+	bayer_16_bin_row_span(pixels, row, next, x, width, phase, red, bits);
+}
+
+avx2_inline void bayer_malvar_avx2(__m256i *values, __m256i c, __m256i h1,
+				   __m256i h2, __m256i v1, __m256i v2,
+				   __m256i di, __m256i mask)
+{
+	__m256i round = _mm256_set1_epi16(8);
+	__m256i c16 = _mm256_slli_epi16(c, 4);
+	__m256i c10 = _mm256_mullo_epi16(c, _mm256_set1_epi16(10));
+	__m256i di2 = _mm256_slli_epi16(di, 1);
+	__m256i x2 = _mm256_add_epi16(h2, v2);
+	__m256i gq, dq, hq, vq;
+	unsigned int i;
+
+	gq = _mm256_add_epi16(_mm256_slli_epi16(c, 3),
+			      _mm256_slli_epi16(_mm256_add_epi16(h1, v1), 2));
+	gq = _mm256_sub_epi16(gq, _mm256_slli_epi16(x2, 1));
+
+	dq = _mm256_add_epi16(_mm256_mullo_epi16(c, _mm256_set1_epi16(12)),
+			      _mm256_slli_epi16(di, 2));
+	dq = _mm256_sub_epi16(dq, _mm256_mullo_epi16(x2,
+						     _mm256_set1_epi16(3)));
+
+	hq = _mm256_add_epi16(_mm256_add_epi16(c10, _mm256_slli_epi16(h1, 3)),
+			      v2);
+	hq = _mm256_sub_epi16(hq, _mm256_add_epi16(_mm256_slli_epi16(h2, 1),
+						   di2));
+
+	vq = _mm256_add_epi16(_mm256_add_epi16(c10, _mm256_slli_epi16(v1, 3)),
+			      h2);
+	vq = _mm256_sub_epi16(vq, _mm256_add_epi16(_mm256_slli_epi16(v2, 1),
+						   di2));
+
+	values[0] = _mm256_blendv_epi8(hq, c16, mask);
+	values[1] = _mm256_blendv_epi8(c16, gq, mask);
+	values[2] = _mm256_blendv_epi8(vq, dq, mask);
+
+	for (i = 0; i < 3; i++)
+		values[i] = _mm256_srai_epi16(_mm256_add_epi16(values[i],
+							       round), 4);
+}
+
+avx2_inline void bayer_malvar_store_avx2(uint32_t *pixels, __m256i *values,
+					 bool red, __m256i alpha)
+{
+	__m256i vr = red ? values[0] : values[2];
+	__m256i vb = red ? values[2] : values[0];
+	__m256i bg = _mm256_or_si256(vb, _mm256_slli_epi16(values[1], 8));
+	__m256i ra = _mm256_or_si256(vr, alpha);
+	__m256i p0 = _mm256_unpacklo_epi16(bg, ra);
+	__m256i p1 = _mm256_unpackhi_epi16(bg, ra);
+
+	_mm256_storeu_si256((__m256i *)pixels,
+			    _mm256_permute2x128_si256(p0, p1, 0x20));
+	_mm256_storeu_si256((__m256i *)(pixels + 8),
+			    _mm256_permute2x128_si256(p0, p1, 0x31));
+}
+
+avx2_inline __m256i bayer_8_load_avx2(uint8_t *samples)
+{
+	return _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)samples));
+}
+
+avx2_inline void bayer_8_malvar_row_avx2(uint32_t *pixels, uint8_t **rows,
+					 unsigned int width,
+					 unsigned int x_start,
+					 unsigned int x_end,
+					 unsigned int phase, bool red,
+					 unsigned int bits)
+{
+	uint8_t *r0 = rows[0], *r1 = rows[1], *r2 = rows[2];
+	uint8_t *r3 = rows[3], *r4 = rows[4];
+	__m256i mask = _mm256_set1_epi32(phase ? 0xffff0000 : 0x0000ffff);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i max = _mm256_set1_epi16(255);
+	unsigned int x = x_start > 2 ? x_start : 2;
+	unsigned int x_last = x_end < width - 2 ? x_end : width - 2;
+	unsigned int i;
+
+	bayer_8_malvar_row_span(pixels, rows, width, x_start, x, phase, red);
+
+	for (; x + 16 <= x_last; x += 16) {
+		__m256i values[3];
+
+		bayer_malvar_avx2(values, bayer_8_load_avx2(r2 + x),
+				  _mm256_add_epi16(bayer_8_load_avx2(r2 + x - 1),
+						   bayer_8_load_avx2(r2 + x + 1)),
+				  _mm256_add_epi16(bayer_8_load_avx2(r2 + x - 2),
+						   bayer_8_load_avx2(r2 + x + 2)),
+				  _mm256_add_epi16(bayer_8_load_avx2(r1 + x),
+						   bayer_8_load_avx2(r3 + x)),
+				  _mm256_add_epi16(bayer_8_load_avx2(r0 + x),
+						   bayer_8_load_avx2(r4 + x)),
+				  _mm256_add_epi16(_mm256_add_epi16(bayer_8_load_avx2(r1 + x - 1),
+								    bayer_8_load_avx2(r1 + x + 1)),
+						   _mm256_add_epi16(bayer_8_load_avx2(r3 + x - 1),
+								    bayer_8_load_avx2(r3 + x + 1))),
+				  mask);
+
+		for (i = 0; i < 3; i++)
+			values[i] = _mm256_min_epi16(_mm256_max_epi16(values[i],
+								      zero),
+						     max);
+
+		bayer_malvar_store_avx2(pixels + x, values, red, zero);
+	}
+
+	bayer_8_malvar_row_span(pixels, rows, width, x, x_end, phase, red);
+}
+
+avx2_inline __m256i bayer_16_load_avx2(uint16_t *samples)
+{
+	return _mm256_loadu_si256((__m256i *)samples);
+}
+
+avx2_inline void bayer_16_malvar_row_avx2(uint32_t *pixels, uint16_t **rows,
+					  unsigned int width,
+					  unsigned int x_start,
+					  unsigned int x_end,
+					  unsigned int phase, bool red,
+					  unsigned int bits)
+{
+	uint16_t *r0 = rows[0], *r1 = rows[1], *r2 = rows[2];
+	uint16_t *r3 = rows[3], *r4 = rows[4];
+	__m256i mask = _mm256_set1_epi32(phase ? 0xffff0000 : 0x0000ffff);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i max = _mm256_set1_epi16((1 << bits) - 1);
+	__m256i alpha = _mm256_set1_epi16(0xff00);
+	unsigned int x = x_start > 2 ? x_start : 2;
+	unsigned int x_last = x_end < width - 2 ? x_end : width - 2;
+	unsigned int i;
+
+	bayer_16_malvar_row_span(pixels, rows, width, x_start, x, phase, red,
+				 bits);
+
+	for (; x + 16 <= x_last; x += 16) {
+		__m256i values[3];
+
+		bayer_malvar_avx2(values, bayer_16_load_avx2(r2 + x),
+				  _mm256_add_epi16(bayer_16_load_avx2(r2 + x - 1),
+						   bayer_16_load_avx2(r2 + x + 1)),
+				  _mm256_add_epi16(bayer_16_load_avx2(r2 + x - 2),
+						   bayer_16_load_avx2(r2 + x + 2)),
+				  _mm256_add_epi16(bayer_16_load_avx2(r1 + x),
+						   bayer_16_load_avx2(r3 + x)),
+				  _mm256_add_epi16(bayer_16_load_avx2(r0 + x),
+						   bayer_16_load_avx2(r4 + x)),
+				  _mm256_add_epi16(_mm256_add_epi16(bayer_16_load_avx2(r1 + x - 1),
+								    bayer_16_load_avx2(r1 + x + 1)),
+						   _mm256_add_epi16(bayer_16_load_avx2(r3 + x - 1),
+								    bayer_16_load_avx2(r3 + x + 1))),
+				  mask);
+
+		for (i = 0; i < 3; i++) {
+			values[i] = _mm256_min_epi16(_mm256_max_epi16(values[i],
+								      zero),
+						     max);
+			values[i] = bayer_16_scale_avx2(values[i], bits);
+		}
+
+		bayer_malvar_store_avx2(pixels + x, values, red, alpha);
+	}
+
+	bayer_16_malvar_row_span(pixels, rows, width, x, x_end, phase, red,
+				 bits);
+}
+
+avx2_inline __m256i bayer_correct_avx2(__m256i v, __m256i offset,
+				       __m256i gain, __m256i max)
+{
+	__m256i lo, hi, r, fits;
+
+	v = _mm256_subs_epu16(v, offset);
+	lo = _mm256_mullo_epi16(v, gain);
+	hi = _mm256_mulhi_epu16(v, gain);
+
+	r = _mm256_or_si256(_mm256_slli_epi16(hi, 8),
+			    _mm256_srli_epi16(lo, 8));
+	fits = _mm256_cmpeq_epi16(_mm256_srli_epi16(hi, 8),
+				  _mm256_setzero_si256());
+	r = _mm256_or_si256(r, _mm256_andnot_si256(fits,
+						   _mm256_set1_epi16(-1)));
+
+	return _mm256_min_epu16(r, max);
+}
+
+avx2_inline void bayer_8_correct_avx2(uint8_t *line, uint8_t *samples,
+				      unsigned int width, uint16_t *offsets,
+				      uint16_t *gains, unsigned int bits)
+{
+	__m256i offset = _mm256_set1_epi32(offsets[0] | (offsets[1] << 16));
+	__m256i gain = _mm256_set1_epi32(gains[0] | (gains[1] << 16));
+	__m256i max = _mm256_set1_epi16(255);
+	__m256i zero = _mm256_setzero_si256();
+	unsigned int x;
+
+	/* Unpacking and packing within lanes keep the byte order. */
+	for (x = 0; x + 32 <= width; x += 32) {
+		__m256i v = _mm256_loadu_si256((__m256i *)(samples + x));
+		__m256i lo = _mm256_unpacklo_epi8(v, zero);
+		__m256i hi = _mm256_unpackhi_epi8(v, zero);
+
+		lo = bayer_correct_avx2(lo, offset, gain, max);
+		hi = bayer_correct_avx2(hi, offset, gain, max);
+
+		_mm256_storeu_si256((__m256i *)(line + x),
+				    _mm256_packus_epi16(lo, hi));
+	}
+
+	bayer_8_correct_span(line, samples, x, width, offsets, gains);
+}
+
+avx2_inline void bayer_16_correct_avx2(uint16_t *line, uint16_t *samples,
+				       unsigned int width, uint16_t *offsets,
+				       uint16_t *gains, unsigned int bits)
+{
+	__m256i offset = _mm256_set1_epi32(offsets[0] | (offsets[1] << 16));
+	__m256i gain = _mm256_set1_epi32(gains[0] | (gains[1] << 16));
+	__m256i max = _mm256_set1_epi16((1 << bits) - 1);
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i v = _mm256_loadu_si256((__m256i *)(samples + x));
+
+		_mm256_storeu_si256((__m256i *)(line + x),
+				    bayer_correct_avx2(v, offset, gain, max));
+	}
+
+	bayer_16_correct_span(line, samples, x, width, offsets, gains, bits);
+}
+
+BAYER_CONVERTERS(avx2, __attribute__((target("avx2"))))
+#endif
+
+#if defined(__ARM_NEON)
+bayer_inline void bayer_8_row_neon(uint32_t *pixels, uint8_t *up, uint8_t *row,
+				   uint8_t *down, unsigned int width,
+				   unsigned int phase, bool red,
+				   unsigned int bits)
+{
+	uint8x16_t one = vdupq_n_u8(1);
+	uint8x16_t mask = vreinterpretq_u8_u16(vdupq_n_u16(phase ? 0xff00 :
+								   0x00ff));
+	unsigned int x;
+
+	bayer_8_row_span(pixels, up, row, down, width, 0, 2, phase, red);
+
+	for (x = 2; x + 16 < width; x += 16) {
+		uint8x16_t l, c, r, u, d, ul, ur, dl, dr;
+		uint8x16_t hn, vn, gq, di, h1, h2, carry;
+		uint8x16_t vc, vg, vo;
+		uint8x16x4_t bgrx;
+
+		l = vld1q_u8(row + x - 1);
+		c = vld1q_u8(row + x);
+		r = vld1q_u8(row + x + 1);
+		u = vld1q_u8(up + x);
+		d = vld1q_u8(down + x);
+		ul = vld1q_u8(up + x - 1);
+		ur = vld1q_u8(up + x + 1);
+		dl = vld1q_u8(down + x - 1);
+		dr = vld1q_u8(down + x + 1);
+
+		hn = vhaddq_u8(l, r);
+		vn = vhaddq_u8(u, d);
+		gq = vhaddq_u8(hn, vn);
+
+		h1 = vhaddq_u8(ul, ur);
+		h2 = vhaddq_u8(dl, dr);
+		carry = vandq_u8(veorq_u8(ul, ur), veorq_u8(dl, dr));
+		carry = vandq_u8(carry, one);
+		di = vbslq_u8(vceqq_u8(carry, one), vrhaddq_u8(h1, h2),
+			      vhaddq_u8(h1, h2));
+
+		vc = vbslq_u8(mask, c, hn);
+		vg = vbslq_u8(mask, gq, c);
+		vo = vbslq_u8(mask, di, vn);
+
+		bgrx.val[0] = red ? vo : vc;
+		bgrx.val[1] = vg;
+		bgrx.val[2] = red ? vc : vo;
+		bgrx.val[3] = vdupq_n_u8(0);
+
+		vst4q_u8((uint8_t *)(pixels + x), bgrx);
+	}
+
+	bayer_8_row_span(pixels, up, row, down, width, x, width, phase, red);
+}
+
+bayer_inline uint16x8_t bayer_16_avg4_neon(uint16x8_t a, uint16x8_t b,
+					   uint16x8_t c, uint16x8_t d,
+					   uint16x8_t one)
+{
+	uint16x8_t h1 = vhaddq_u16(a, b);
+	uint16x8_t h2 = vhaddq_u16(c, d);
+	uint16x8_t carry = vandq_u16(vandq_u16(veorq_u16(a, b),
+					       veorq_u16(c, d)), one);
+
+	return vbslq_u16(vceqq_u16(carry, one), vrhaddq_u16(h1, h2),
+			 vhaddq_u16(h1, h2));
+}
+
+bayer_inline uint8x8_t bayer_16_scale_neon(uint16x8_t v, unsigned int bits)
+{
+	uint16x4_t scale = vdup_n_u16(bayer_16_scale(bits));
+	int32x4_t shift = vdupq_n_s32(-(int)(bits + 8));
+	uint32x4_t lo = vmull_u16(vget_low_u16(v), scale);
+	uint32x4_t hi = vmull_u16(vget_high_u16(v), scale);
+
+	lo = vshlq_u32(lo, shift);
+	hi = vshlq_u32(hi, shift);
+
+	return vmovn_u16(vcombine_u16(vmovn_u32(lo), vmovn_u32(hi)));
+}
+
+bayer_inline void bayer_16_row_neon(uint32_t *pixels, uint16_t *up,
+				    uint16_t *row, uint16_t *down,
+				    unsigned int width, unsigned int phase,
+				    bool red, unsigned int bits)
+{
+	uint16x8_t one = vdupq_n_u16(1);
+	uint16x8_t mask = vreinterpretq_u16_u32(vdupq_n_u32(phase ?
+							     0xffff0000 :
+							     0x0000ffff));
+	unsigned int x;
+
+	bayer_16_row_span(pixels, up, row, down, width, 0, 2, phase, red,
+			  bits);
+
+	for (x = 2; x + 8 < width; x += 8) {
+		uint16x8_t l, c, r, u, d, ul, ur, dl, dr;
+		uint16x8_t hn, vn, gq, di;
+		uint16x8_t vc, vg, vo;
+		uint8x8_t c8, o8;
+		uint8x8x4_t bgrx;
+
+		l = vld1q_u16(row + x - 1);
+		c = vld1q_u16(row + x);
+		r = vld1q_u16(row + x + 1);
+		u = vld1q_u16(up + x);
+		d = vld1q_u16(down + x);
+		ul = vld1q_u16(up + x - 1);
+		ur = vld1q_u16(up + x + 1);
+		dl = vld1q_u16(down + x - 1);
+		dr = vld1q_u16(down + x + 1);
+
+		hn = vhaddq_u16(l, r);
+		vn = vhaddq_u16(u, d);
+		gq = bayer_16_avg4_neon(l, r, u, d, one);
+		di = bayer_16_avg4_neon(ul, ur, dl, dr, one);
+
+		vc = vbslq_u16(mask, c, hn);
+		vg = vbslq_u16(mask, gq, c);
+		vo = vbslq_u16(mask, di, vn);
+
+		c8 = bayer_16_scale_neon(vc, bits);
+		o8 = bayer_16_scale_neon(vo, bits);
+
+		bgrx.val[0] = red ? o8 : c8;
+		bgrx.val[1] = bayer_16_scale_neon(vg, bits);
+		bgrx.val[2] = red ? c8 : o8;
+		bgrx.val[3] = vdup_n_u8(255);
+
+		vst4_u8((uint8_t *)(pixels + x), bgrx);
+	}
+
+	bayer_16_row_span(pixels, up, row, down, width, x, width, phase, red,
+			  bits);
+}
+
+/* Packed groups are spread with table lookups, eight pixels at a time. */
+bayer_inline void bayer_mipi_unpack_neon(uint16_t *line, uint8_t *packed,
+					 unsigned int width, unsigned int bits)
+{
+	static const uint8_t tables[2][2][8] = {
+		{
+			{ 0, 1, 2, 3, 5, 6, 7, 8 },
+			{ 4, 4, 4, 4, 9, 9, 9, 9 },
+		}, {
+			{ 0, 1, 3, 4, 6, 7, 9, 10 },
+			{ 2, 2, 5, 5, 8, 8, 11, 11 },
+		},
+	};
+	static const int16_t shifts[2][8] = {
+		{ 0, -2, -4, -6, 0, -2, -4, -6 },
+		{ 0, -4, 0, -4, 0, -4, 0, -4 },
+	};
+	unsigned int stride = bayer_mipi_stride(width, bits);
+	unsigned int index = bits == 10 ? 0 : 1;
+	unsigned int group = bits == 10 ? 10 : 12;
+	uint8x8_t high = vld1_u8(tables[index][0]);
+	uint8x8_t low = vld1_u8(tables[index][1]);
+	int16x8_t shift = vld1q_s16(shifts[index]);
+	uint16x8_t mask = vdupq_n_u16((1 << (bits - 8)) - 1);
+	unsigned int offset = 0;
+	unsigned int x = 0;
+
+	for (; offset + 16 <= stride; x += 8, offset += group) {
+		uint8x8x2_t v;
+		uint16x8_t h, l;
+
+		v.val[0] = vld1_u8(packed + offset);
+		v.val[1] = vld1_u8(packed + offset + 8);
+
+		if (bits == 10)
+			h = vshll_n_u8(vtbl2_u8(v, high), 2);
+		else
+			h = vshll_n_u8(vtbl2_u8(v, high), 4);
+
+		l = vshlq_u16(vmovl_u8(vtbl2_u8(v, low)), shift);
+		l = vandq_u16(l, mask);
+
+		vst1q_u16(line + x, vorrq_u16(h, l));
+	}
+
+	bayer_mipi_unpack_scalar(line + x, packed + offset, width - x, bits);
+}
+
+/* Even and odd samples are split by structure loads. */
+bayer_inline void bayer_8_bin_row_neon(uint32_t *pixels, uint8_t *row,
+				       uint8_t *next, unsigned int width,
+				       unsigned int phase, bool red,
+				       unsigned int bits)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x16x2_t q0 = vld2q_u8(row + 2 * x);
+		uint8x16x2_t q1 = vld2q_u8(next + 2 * x);
+		uint8x16_t c0 = q0.val[phase];
+		uint8x16_t c1 = q1.val[!phase];
+		uint8x16x4_t bgrx;
+
+		bgrx.val[0] = red ? c1 : c0;
+		bgrx.val[1] = vhaddq_u8(q0.val[!phase], q1.val[phase]);
+		bgrx.val[2] = red ? c0 : c1;
+		bgrx.val[3] = vdupq_n_u8(0);
+
+		vst4q_u8((uint8_t *)(pixels + x), bgrx);
+	}
+
+	bayer_8_bin_row_span(pixels, row, next, x, width, phase, red);
+}
+
+bayer_inline void bayer_16_bin_row_neon(uint32_t *pixels, uint16_t *row,
+					uint16_t *next, unsigned int width,
+					unsigned int phase, bool red,
+					unsigned int bits)
+{
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		uint16x8x2_t q0 = vld2q_u16(row + 2 * x);
+		uint16x8x2_t q1 = vld2q_u16(next + 2 * x);
+		uint8x8_t c0 = bayer_16_scale_neon(q0.val[phase], bits);
+		uint8x8_t c1 = bayer_16_scale_neon(q1.val[!phase], bits);
+		uint16x8_t g = vhaddq_u16(q0.val[!phase], q1.val[phase]);
+		uint8x8x4_t bgrx;
+
+		bgrx.val[0] = red ? c1 : c0;
+		bgrx.val[1] = bayer_16_scale_neon(g, bits);
+		bgrx.val[2] = red ? c0 : c1;
+		bgrx.val[3] = vdup_n_u8(255);
+
+		vst4_u8((uint8_t *)(pixels + x), bgrx);
+	}
+
+	bayer_16_bin_row_span(pixels, row, next, x, width, phase, red, bits);
+}
+
+bayer_inline void bayer_malvar_neon(int16x8_t *values, int16x8_t c,
+				    int16x8_t h1, int16x8_t h2, int16x8_t v1,
+				    int16x8_t v2, int16x8_t di, uint16x8_t mask)
+{
+	int16x8_t c16 = vshlq_n_s16(c, 4);
+	int16x8_t c10 = vmulq_n_s16(c, 10);
+	int16x8_t x2 = vaddq_s16(h2, v2);
+	int16x8_t gq, dq, hq, vq;
+	unsigned int i;
+
+	gq = vmlaq_n_s16(vshlq_n_s16(c, 3), vaddq_s16(h1, v1), 4);
+	gq = vmlaq_n_s16(gq, x2, -2);
+
+	dq = vmlaq_n_s16(vmulq_n_s16(c, 12), di, 4);
+	dq = vmlaq_n_s16(dq, x2, -3);
+
+	hq = vmlaq_n_s16(vaddq_s16(c10, v2), h1, 8);
+	hq = vmlaq_n_s16(hq, vaddq_s16(h2, di), -2);
+
+	vq = vmlaq_n_s16(vaddq_s16(c10, h2), v1, 8);
+	vq = vmlaq_n_s16(vq, vaddq_s16(v2, di), -2);
+
+	values[0] = vbslq_s16(mask, c16, hq);
+	values[1] = vbslq_s16(mask, gq, c16);
+	values[2] = vbslq_s16(mask, dq, vq);
+
+	for (i = 0; i < 3; i++)
+		values[i] = vrshrq_n_s16(values[i], 4);
+}
+
+bayer_inline int16x8_t bayer_8_load_neon(uint8_t *samples)
+{
+	return vreinterpretq_s16_u16(vmovl_u8(vld1_u8(samples)));
+}
+
+bayer_inline void bayer_8_malvar_row_neon(uint32_t *pixels, uint8_t **rows,
+					  unsigned int width,
+					  unsigned int x_start,
+					  unsigned int x_end,
+					  unsigned int phase, bool red,
+					  unsigned int bits)
+{
+	uint8_t *r0 = rows[0], *r1 = rows[1], *r2 = rows[2];
+	uint8_t *r3 = rows[3], *r4 = rows[4];
+	uint16x8_t mask = vreinterpretq_u16_u32(vdupq_n_u32(phase ?
+							     0xffff0000 :
+							     0x0000ffff));
+	unsigned int x = x_start > 2 ? x_start : 2;
+	unsigned int x_last = x_end < width - 2 ? x_end : width - 2;
+
+	bayer_8_malvar_row_span(pixels, rows, width, x_start, x, phase, red);
+
+	for (; x + 8 <= x_last; x += 8) {
+		int16x8_t values[3];
+		uint8x8_t c8, o8;
+		uint8x8x4_t bgrx;
+
+		bayer_malvar_neon(values, bayer_8_load_neon(r2 + x),
+				  vaddq_s16(bayer_8_load_neon(r2 + x - 1),
+					    bayer_8_load_neon(r2 + x + 1)),
+				  vaddq_s16(bayer_8_load_neon(r2 + x - 2),
+					    bayer_8_load_neon(r2 + x + 2)),
+				  vaddq_s16(bayer_8_load_neon(r1 + x),
+					    bayer_8_load_neon(r3 + x)),
+				  vaddq_s16(bayer_8_load_neon(r0 + x),
+					    bayer_8_load_neon(r4 + x)),
+				  vaddq_s16(vaddq_s16(bayer_8_load_neon(r1 + x - 1),
+						      bayer_8_load_neon(r1 + x + 1)),
+					    vaddq_s16(bayer_8_load_neon(r3 + x - 1),
+						      bayer_8_load_neon(r3 + x + 1))),
+				  mask);
+
+		c8 = vqmovun_s16(values[0]);
+		o8 = vqmovun_s16(values[2]);
+
+		bgrx.val[0] = red ? o8 : c8;
+		bgrx.val[1] = vqmovun_s16(values[1]);
+		bgrx.val[2] = red ? c8 : o8;
+		bgrx.val[3] = vdup_n_u8(0);
+
+		vst4_u8((uint8_t *)(pixels + x), bgrx);
+	}
+
+	bayer_8_malvar_row_span(pixels, rows, width, x, x_end, phase, red);
+}
+
+bayer_inline int16x8_t bayer_16_load_neon(uint16_t *samples)
+{
+	return vreinterpretq_s16_u16(vld1q_u16(samples));
+}
+
+bayer_inline void bayer_16_malvar_row_neon(uint32_t *pixels, uint16_t **rows,
+					   unsigned int width,
+					   unsigned int x_start,
+					   unsigned int x_end,
+					   unsigned int phase, bool red,
+					   unsigned int bits)
+{
+	uint16_t *r0 = rows[0], *r1 = rows[1], *r2 = rows[2];
+	uint16_t *r3 = rows[3], *r4 = rows[4];
+	uint16x8_t mask = vreinterpretq_u16_u32(vdupq_n_u32(phase ?
+							     0xffff0000 :
+							     0x0000ffff));
+	int16x8_t zero = vdupq_n_s16(0);
+	int16x8_t max = vdupq_n_s16((1 << bits) - 1);
+	unsigned int x = x_start > 2 ? x_start : 2;
+	unsigned int x_last = x_end < width - 2 ? x_end : width - 2;
+
+	bayer_16_malvar_row_span(pixels, rows, width, x_start, x, phase, red,
+				 bits);
+
+	for (; x + 8 <= x_last; x += 8) {
+		int16x8_t values[3];
+		uint8x8_t c8, o8;
+		uint8x8x4_t bgrx;
+		unsigned int i;
+
+		bayer_malvar_neon(values, bayer_16_load_neon(r2 + x),
+				  vaddq_s16(bayer_16_load_neon(r2 + x - 1),
+					    bayer_16_load_neon(r2 + x + 1)),
+				  vaddq_s16(bayer_16_load_neon(r2 + x - 2),
+					    bayer_16_load_neon(r2 + x + 2)),
+				  vaddq_s16(bayer_16_load_neon(r1 + x),
+					    bayer_16_load_neon(r3 + x)),
+				  vaddq_s16(bayer_16_load_neon(r0 + x),
+					    bayer_16_load_neon(r4 + x)),
+				  vaddq_s16(vaddq_s16(bayer_16_load_neon(r1 + x - 1),
+						      bayer_16_load_neon(r1 + x + 1)),
+					    vaddq_s16(bayer_16_load_neon(r3 + x - 1),
+						      bayer_16_load_neon(r3 + x + 1))),
+				  mask);
+
+		for (i = 0; i < 3; i++)
+			values[i] = vminq_s16(vmaxq_s16(values[i], zero), max);
+
+		c8 = bayer_16_scale_neon(vreinterpretq_u16_s16(values[0]),
+					 bits);
+		o8 = bayer_16_scale_neon(vreinterpretq_u16_s16(values[2]),
+					 bits);
+
+		bgrx.val[0] = red ? o8 : c8;
+		bgrx.val[1] = bayer_16_scale_neon(vreinterpretq_u16_s16(values[1]),
+						  bits);
+		bgrx.val[2] = red ? c8 : o8;
+		bgrx.val[3] = vdup_n_u8(255);
+
+		vst4_u8((uint8_t *)(pixels + x), bgrx);
+	}
+
+	bayer_16_malvar_row_span(pixels, rows, width, x, x_end, phase, red,
+				 bits);
+}
+
+/* Products are narrowed back with saturation, then clamped. */
+bayer_inline uint16x8_t bayer_correct_neon(uint16x8_t v, uint16x8_t offset,
+					   uint16x8_t gain, uint16x8_t max)
+{
+	uint32x4_t lo, hi;
+
+	v = vqsubq_u16(v, offset);
+	lo = vmull_u16(vget_low_u16(v), vget_low_u16(gain));
+	hi = vmull_u16(vget_high_u16(v), vget_high_u16(gain));
+	v = vcombine_u16(vqshrn_n_u32(lo, 8), vqshrn_n_u32(hi, 8));
+
+	return vminq_u16(v, max);
+}
+
+bayer_inline void bayer_8_correct_neon(uint8_t *line, uint8_t *samples,
+				       unsigned int width, uint16_t *offsets,
+				       uint16_t *gains, unsigned int bits)
+{
+	uint16x8_t offset = vreinterpretq_u16_u32(vdupq_n_u32(offsets[0] |
+							      (offsets[1] << 16)));
+	uint16x8_t gain = vreinterpretq_u16_u32(vdupq_n_u32(gains[0] |
+							    (gains[1] << 16)));
+	uint16x8_t max = vdupq_n_u16(255);
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		uint16x8_t v = vmovl_u8(vld1_u8(samples + x));
+
+		v = bayer_correct_neon(v, offset, gain, max);
+		vst1_u8(line + x, vmovn_u16(v));
+	}
+
+	bayer_8_correct_span(line, samples, x, width, offsets, gains);
+}
+
+bayer_inline void bayer_16_correct_neon(uint16_t *line, uint16_t *samples,
+					unsigned int width, uint16_t *offsets,
+					uint16_t *gains, unsigned int bits)
+{
+	uint16x8_t offset = vreinterpretq_u16_u32(vdupq_n_u32(offsets[0] |
+							      (offsets[1] << 16)));
+	uint16x8_t gain = vreinterpretq_u16_u32(vdupq_n_u32(gains[0] |
+							    (gains[1] << 16)));
+	uint16x8_t max = vdupq_n_u16((1 << bits) - 1);
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		uint16x8_t v = vld1q_u16(samples + x);
+
+		vst1q_u16(line + x, bayer_correct_neon(v, offset, gain, max));
+	}
+
+	bayer_16_correct_span(line, samples, x, width, offsets, gains, bits);
+}
+
+BAYER_CONVERTERS(neon, )
+#endif
+
+/*
+ * YUV to RGB conversion, with BT.601 coefficients in 9-bit fixed-point:
+ *
+ * R = Y + 1.13983 * (V - 128)
+ * G = Y - 0.39466 * (U - 128) - 0.58060 * (V - 128)
+ * B = Y + 2.03211 * (U - 128)
+ *
+ * Chroma terms are computed once per chroma sample and shared by the two
+ * horizontal pixels that it covers. Vertical upsampling is done by sharing
+ * the same chroma line between two lines, for 4:2:0 formats.
+ *
+ * Semi-planar formats (NV12, NV21, NV16, NV61) hold interleaved chroma pairs,
+ * with V first for NV21 and NV61. Planar formats (YUV420, YVU420, YUV422P)
+ * hold U and V in separate planes, with V first for YVU420.
+ */
+
+#define YUV_COEF_SHIFT	9
+#define YUV_COEF_RV	584
+#define YUV_COEF_GU	202
+#define YUV_COEF_GV	297
+#define YUV_COEF_BU	1040
+
+static inline uint8_t byte_range(int v)
+{
+	if (v < 0)
+		return 0;
+	else if (v > 255)
+		return 255;
+	else
+		return (uint8_t)v;
+}
+
+static inline void yuv_pixels_pack(uint32_t *pixels, uint8_t *luma,
+				   unsigned int count, uint8_t u, uint8_t v)
+{
+	int du = (int)u - 128;
+	int dv = (int)v - 128;
+	int rt, gt, bt;
+	unsigned int i;
+
+	rt = (YUV_COEF_RV * dv) >> YUV_COEF_SHIFT;
+	gt = (-YUV_COEF_GU * du - YUV_COEF_GV * dv) >> YUV_COEF_SHIFT;
+	bt = (YUV_COEF_BU * du) >> YUV_COEF_SHIFT;
+
+	for (i = 0; i < count; i++)
+		pixels[i] = pixel_pack(byte_range(luma[i] + rt),
+				       byte_range(luma[i] + gt),
+				       byte_range(luma[i] + bt), 0);
+}
+
+static void nv12_row_span(uint32_t *pixels, uint8_t *luma, uint8_t *chroma,
+			  unsigned int x_start, unsigned int width, bool swap)
+{
+	unsigned int x;
+
+	for (x = x_start; x < width; x += 2) {
+		unsigned int count = (width - x) > 1 ? 2 : 1;
+
+		yuv_pixels_pack(pixels + x, luma + x, count, chroma[x + swap],
+				chroma[x + !swap]);
+	}
+}
+
+static void nv12_row_convert_scalar(uint32_t *pixels, uint8_t *luma,
+				    uint8_t *chroma, unsigned int width,
+				    bool swap)
+{
+	nv12_row_span(pixels, luma, chroma, 0, width, swap);
+}
+
+static void yuv420_row_span(uint32_t *pixels, uint8_t *luma, uint8_t *u,
+			    uint8_t *v, unsigned int x_start,
+			    unsigned int width)
+{
+	unsigned int x;
+
+	for (x = x_start; x < width; x += 2) {
+		unsigned int count = (width - x) > 1 ? 2 : 1;
+
+		yuv_pixels_pack(pixels + x, luma + x, count, u[x / 2],
+				v[x / 2]);
+	}
+}
+
+static void yuv420_row_convert_scalar(uint32_t *pixels, uint8_t *luma,
+				      uint8_t *u, uint8_t *v,
+				      unsigned int width)
+{
+	yuv420_row_span(pixels, luma, u, v, 0, width);
+}
+
+static void yuyv_row_span(uint32_t *pixels, uint8_t *packed,
+			  unsigned int x_start, unsigned int width, bool uyvy)
+{
+	unsigned int x;
+
+	for (x = x_start; x < width; x += 2) {
+		uint8_t *block = packed + x * 2;
+		unsigned int count = (width - x) > 1 ? 2 : 1;
+		uint8_t luma[2];
+
+		if (uyvy) {
+			luma[0] = block[1];
+			luma[1] = block[3];
+			yuv_pixels_pack(pixels + x, luma, count, block[0],
+					block[2]);
+		} else {
+			luma[0] = block[0];
+			luma[1] = block[2];
+			yuv_pixels_pack(pixels + x, luma, count, block[1],
+					block[3]);
+		}
+	}
+}
+
+static void yuyv_row_convert_scalar(uint32_t *pixels, uint8_t *packed,
+				    unsigned int width, bool uyvy)
+{
+	yuyv_row_span(pixels, packed, 0, width, uyvy);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Chroma is handled as interleaved signed U/V pairs, so that pmaddwd yields
+ * one 32-bit term per chroma sample. Each term is then duplicated to the
+ * two 16-bit pixel lanes it covers.
+ */
+
+__attribute__((target("sse2")))
+static inline __m128i yuv_term_sse2(__m128i uv, __m128i coefs)
+{
+	__m128i term = _mm_srai_epi32(_mm_madd_epi16(uv, coefs),
+				      YUV_COEF_SHIFT);
+
+	return _mm_or_si128(_mm_and_si128(term, _mm_set1_epi32(0xffff)),
+			    _mm_slli_epi32(term, 16));
+}
+
+__attribute__((target("sse2")))
+static inline void yuv_pixels_pack_sse2(uint32_t *pixels, __m128i y,
+					__m128i uv)
+{
+	__m128i coefs_r = _mm_set1_epi32(YUV_COEF_RV << 16);
+	__m128i coefs_g = _mm_set1_epi32(((uint32_t)-YUV_COEF_GV << 16) |
+					 ((uint32_t)-YUV_COEF_GU & 0xffff));
+	__m128i coefs_b = _mm_set1_epi32(YUV_COEF_BU);
+	__m128i zero = _mm_setzero_si128();
+	__m128i max = _mm_set1_epi16(255);
+	__m128i r, g, b, bg;
+
+	uv = _mm_sub_epi16(uv, _mm_set1_epi16(128));
+
+	r = _mm_add_epi16(y, yuv_term_sse2(uv, coefs_r));
+	g = _mm_add_epi16(y, yuv_term_sse2(uv, coefs_g));
+	b = _mm_add_epi16(y, yuv_term_sse2(uv, coefs_b));
+
+	r = _mm_min_epi16(_mm_max_epi16(r, zero), max);
+	g = _mm_min_epi16(_mm_max_epi16(g, zero), max);
+	b = _mm_min_epi16(_mm_max_epi16(b, zero), max);
+
+	bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+	_mm_storeu_si128((__m128i *)pixels, _mm_unpacklo_epi16(bg, r));
+	_mm_storeu_si128((__m128i *)(pixels + 4), _mm_unpackhi_epi16(bg, r));
+}
+
+__attribute__((target("sse2")))
+static void nv12_row_convert_sse2(uint32_t *pixels, uint8_t *luma,
+				  uint8_t *chroma, unsigned int width,
+				  bool swap)
+{
+	__m128i zero = _mm_setzero_si128();
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i y = _mm_loadl_epi64((__m128i *)(luma + x));
+		__m128i uv = _mm_loadl_epi64((__m128i *)(chroma + x));
+
+		uv = _mm_unpacklo_epi8(uv, zero);
+		if (swap)
+			uv = _mm_or_si128(_mm_slli_epi32(uv, 16),
+					  _mm_srli_epi32(uv, 16));
+
+		yuv_pixels_pack_sse2(pixels + x, _mm_unpacklo_epi8(y, zero),
+				     uv);
+	}
+
+	nv12_row_span(pixels, luma, chroma, x, width, swap);
+}
+
+__attribute__((target("sse2")))
+static void yuv420_row_convert_sse2(uint32_t *pixels, uint8_t *luma,
+				    uint8_t *u, uint8_t *v,
+				    unsigned int width)
+{
+	__m128i zero = _mm_setzero_si128();
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i y = _mm_loadu_si128((__m128i *)(luma + x));
+		__m128i cu = _mm_loadl_epi64((__m128i *)(u + x / 2));
+		__m128i cv = _mm_loadl_epi64((__m128i *)(v + x / 2));
+		__m128i uv = _mm_unpacklo_epi8(cu, cv);
+
+		yuv_pixels_pack_sse2(pixels + x, _mm_unpacklo_epi8(y, zero),
+				     _mm_unpacklo_epi8(uv, zero));
+		yuv_pixels_pack_sse2(pixels + x + 8,
+				     _mm_unpackhi_epi8(y, zero),
+				     _mm_unpackhi_epi8(uv, zero));
+	}
+
+	yuv420_row_span(pixels, luma, u, v, x, width);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_row_convert_sse2(uint32_t *pixels, uint8_t *packed,
+				  unsigned int width, bool uyvy)
+{
+	__m128i mask = _mm_set1_epi16(0x00ff);
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i block = _mm_loadu_si128((__m128i *)(packed + x * 2));
+		__m128i y, uv;
+
+		if (uyvy) {
+			y = _mm_srli_epi16(block, 8);
+			uv = _mm_and_si128(block, mask);
+		} else {
+			y = _mm_and_si128(block, mask);
+			uv = _mm_srli_epi16(block, 8);
+		}
+
+		yuv_pixels_pack_sse2(pixels + x, y, uv);
+	}
+
+	yuyv_row_span(pixels, packed, x, width, uyvy);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i yuv_term_avx2(__m256i uv, __m256i coefs)
+{
+	__m256i term = _mm256_srai_epi32(_mm256_madd_epi16(uv, coefs),
+					 YUV_COEF_SHIFT);
+
+	return _mm256_or_si256(_mm256_and_si256(term,
+						_mm256_set1_epi32(0xffff)),
+			       _mm256_slli_epi32(term, 16));
+}
+
+__attribute__((target("avx2")))
+static inline void yuv_pixels_pack_avx2(uint32_t *pixels, __m256i y,
+					__m256i uv)
+{
+	__m256i coefs_r = _mm256_set1_epi32(YUV_COEF_RV << 16);
+	__m256i coefs_g = _mm256_set1_epi32(((uint32_t)-YUV_COEF_GV << 16) |
+					    ((uint32_t)-YUV_COEF_GU & 0xffff));
+	__m256i coefs_b = _mm256_set1_epi32(YUV_COEF_BU);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i max = _mm256_set1_epi16(255);
+	__m256i r, g, b, bg, p0, p1;
+
+	uv = _mm256_sub_epi16(uv, _mm256_set1_epi16(128));
+
+	r = _mm256_add_epi16(y, yuv_term_avx2(uv, coefs_r));
+	g = _mm256_add_epi16(y, yuv_term_avx2(uv, coefs_g));
+	b = _mm256_add_epi16(y, yuv_term_avx2(uv, coefs_b));
+
+	r = _mm256_min_epi16(_mm256_max_epi16(r, zero), max);
+	g = _mm256_min_epi16(_mm256_max_epi16(g, zero), max);
+	b = _mm256_min_epi16(_mm256_max_epi16(b, zero), max);
+
+	bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+
+	/* Unpacking works within 128-bit lanes, reorder on store. */
+	p0 = _mm256_unpacklo_epi16(bg, r);
+	p1 = _mm256_unpackhi_epi16(bg, r);
+
+	_mm256_storeu_si256((__m256i *)pixels,
+			    _mm256_permute2x128_si256(p0, p1, 0x20));
+	_mm256_storeu_si256((__m256i *)(pixels + 8),
+			    _mm256_permute2x128_si256(p0, p1, 0x31));
+}
+
+__attribute__((target("avx2")))
+static void nv12_row_convert_avx2(uint32_t *pixels, uint8_t *luma,
+				  uint8_t *chroma, unsigned int width,
+				  bool swap)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i y = _mm_loadu_si128((__m128i *)(luma + x));
+		__m128i c = _mm_loadu_si128((__m128i *)(chroma + x));
+		__m256i uv = _mm256_cvtepu8_epi16(c);
+
+		if (swap)
+			uv = _mm256_or_si256(_mm256_slli_epi32(uv, 16),
+					     _mm256_srli_epi32(uv, 16));
+
+		yuv_pixels_pack_avx2(pixels + x, _mm256_cvtepu8_epi16(y), uv);
+	}
+
+	nv12_row_span(pixels, luma, chroma, x, width, swap);
+}
+
+__attribute__((target("avx2")))
+static void yuv420_row_convert_avx2(uint32_t *pixels, uint8_t *luma,
+				    uint8_t *u, uint8_t *v,
+				    unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x + 32 <= width; x += 32) {
+		__m128i y0 = _mm_loadu_si128((__m128i *)(luma + x));
+		__m128i y1 = _mm_loadu_si128((__m128i *)(luma + x + 16));
+		__m128i cu = _mm_loadu_si128((__m128i *)(u + x / 2));
+		__m128i cv = _mm_loadu_si128((__m128i *)(v + x / 2));
+		__m256i uv0 = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(cu, cv));
+		__m256i uv1 = _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(cu, cv));
+
+		yuv_pixels_pack_avx2(pixels + x, _mm256_cvtepu8_epi16(y0),
+				     uv0);
+		yuv_pixels_pack_avx2(pixels + x + 16, _mm256_cvtepu8_epi16(y1),
+				     uv1);
+	}
+
+	yuv420_row_span(pixels, luma, u, v, x, width);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_row_convert_avx2(uint32_t *pixels, uint8_t *packed,
+				  unsigned int width, bool uyvy)
+{
+	__m256i mask = _mm256_set1_epi16(0x00ff);
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i block = _mm256_loadu_si256((__m256i *)(packed + x * 2));
+		__m256i y, uv;
+
+		if (uyvy) {
+			y = _mm256_srli_epi16(block, 8);
+			uv = _mm256_and_si256(block, mask);
+		} else {
+			y = _mm256_and_si256(block, mask);
+			uv = _mm256_srli_epi16(block, 8);
+		}
+
+		yuv_pixels_pack_avx2(pixels + x, y, uv);
+	}
+
+	yuyv_row_span(pixels, packed, x, width, uyvy);
+}
+#endif
+
+#if defined(__ARM_NEON)
+/* Even and odd pixels are converted separately and zipped on store. */
+static inline void yuv_pixels_pack_neon(uint32_t *pixels, uint8x8_t y0,
+					uint8x8_t y1, uint8x8_t u,
+					uint8x8_t v)
+{
+	int16x8_t du = vreinterpretq_s16_u16(vsubl_u8(u, vdup_n_u8(128)));
+	int16x8_t dv = vreinterpretq_s16_u16(vsubl_u8(v, vdup_n_u8(128)));
+	int16x8_t l0 = vreinterpretq_s16_u16(vmovl_u8(y0));
+	int16x8_t l1 = vreinterpretq_s16_u16(vmovl_u8(y1));
+	int16x8_t rt, gt, bt;
+	int32x4_t lo, hi;
+	uint8x8x2_t r, g, b;
+	uint8x8x4_t bgrx;
+
+	lo = vmull_n_s16(vget_low_s16(dv), YUV_COEF_RV);
+	hi = vmull_n_s16(vget_high_s16(dv), YUV_COEF_RV);
+	rt = vcombine_s16(vshrn_n_s32(lo, YUV_COEF_SHIFT),
+			  vshrn_n_s32(hi, YUV_COEF_SHIFT));
+
+	lo = vmull_n_s16(vget_low_s16(du), -YUV_COEF_GU);
+	hi = vmull_n_s16(vget_high_s16(du), -YUV_COEF_GU);
+	lo = vmlal_n_s16(lo, vget_low_s16(dv), -YUV_COEF_GV);
+	hi = vmlal_n_s16(hi, vget_high_s16(dv), -YUV_COEF_GV);
+	gt = vcombine_s16(vshrn_n_s32(lo, YUV_COEF_SHIFT),
+			  vshrn_n_s32(hi, YUV_COEF_SHIFT));
+
+	lo = vmull_n_s16(vget_low_s16(du), YUV_COEF_BU);
+	hi = vmull_n_s16(vget_high_s16(du), YUV_COEF_BU);
+	bt = vcombine_s16(vshrn_n_s32(lo, YUV_COEF_SHIFT),
+			  vshrn_n_s32(hi, YUV_COEF_SHIFT));
+
+	r = vzip_u8(vqmovun_s16(vaddq_s16(l0, rt)),
+		    vqmovun_s16(vaddq_s16(l1, rt)));
+	g = vzip_u8(vqmovun_s16(vaddq_s16(l0, gt)),
+		    vqmovun_s16(vaddq_s16(l1, gt)));
+	b = vzip_u8(vqmovun_s16(vaddq_s16(l0, bt)),
+		    vqmovun_s16(vaddq_s16(l1, bt)));
+
+	bgrx.val[3] = vdup_n_u8(0);
+
+	bgrx.val[0] = b.val[0];
+	bgrx.val[1] = g.val[0];
+	bgrx.val[2] = r.val[0];
+	vst4_u8((uint8_t *)pixels, bgrx);
+
+	bgrx.val[0] = b.val[1];
+	bgrx.val[1] = g.val[1];
+	bgrx.val[2] = r.val[1];
+	vst4_u8((uint8_t *)(pixels + 8), bgrx);
+}
+
+static void nv12_row_convert_neon(uint32_t *pixels, uint8_t *luma,
+				  uint8_t *chroma, unsigned int width,
+				  bool swap)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x8x2_t y = vld2_u8(luma + x);
+		uint8x8x2_t uv = vld2_u8(chroma + x);
+
+		yuv_pixels_pack_neon(pixels + x, y.val[0], y.val[1],
+				     uv.val[swap], uv.val[!swap]);
+	}
+
+	nv12_row_span(pixels, luma, chroma, x, width, swap);
+}
+
+static void yuv420_row_convert_neon(uint32_t *pixels, uint8_t *luma,
+				    uint8_t *u, uint8_t *v,
+				    unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x8x2_t y = vld2_u8(luma + x);
+
+		yuv_pixels_pack_neon(pixels + x, y.val[0], y.val[1],
+				     vld1_u8(u + x / 2), vld1_u8(v + x / 2));
+	}
+
+	yuv420_row_span(pixels, luma, u, v, x, width);
+}
+
+static void yuyv_row_convert_neon(uint32_t *pixels, uint8_t *packed,
+				  unsigned int width, bool uyvy)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x8x4_t block = vld4_u8(packed + x * 2);
+
+		if (uyvy)
+			yuv_pixels_pack_neon(pixels + x, block.val[1],
+					     block.val[3], block.val[0],
+					     block.val[2]);
+		else
+			yuv_pixels_pack_neon(pixels + x, block.val[0],
+					     block.val[2], block.val[1],
+					     block.val[3]);
+	}
+
+	yuyv_row_span(pixels, packed, x, width, uyvy);
+}
+#endif
+
+static bool yuv_format_420(unsigned int format)
+{
+	switch (format) {
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Converters are instantiated per instruction set, each calling its own row
+ * kernels, and registered along the Bayer ones.
+ */
+
+struct yuv_converters {
+	image_convert_t nv12;
+	image_convert_t yuv420;
+	image_convert_t yuyv;
+};
+
+#define YUV_CONVERTERS(isa)						\
+static void nv12_convert_##isa(struct image_convert_job *job,		\
+			       unsigned int y_start, unsigned int y_end) \
+{									\
+	uint32_t line[IMAGE_CONVERT_LINE_MAX];				\
+	unsigned int width = job->width;				\
+	uint8_t *luma = job->src;					\
+	uint8_t *chroma = job->src + width * job->height;		\
+	unsigned int shift = yuv_format_420(job->format) ? 1 : 0;	\
+	bool swap = job->format == V4L2_PIX_FMT_NV21 ||			\
+		    job->format == V4L2_PIX_FMT_NV61;			\
+	unsigned int y;							\
+									\
+	for (y = y_start; y < y_end; y++) {				\
+		uint32_t *pixels = image_convert_line(job, line, y, width); \
+									\
+		nv12_row_convert_##isa(pixels, luma + y * width,	\
+				       chroma + (y >> shift) * width,	\
+				       width, swap);			\
+		image_convert_line_store(job, pixels, y, width, 0, width); \
+	}								\
+}									\
+									\
+static void yuv420_convert_##isa(struct image_convert_job *job,	\
+				 unsigned int y_start,			\
+				 unsigned int y_end)			\
+{									\
+	uint32_t line[IMAGE_CONVERT_LINE_MAX];				\
+	unsigned int width = job->width;				\
+	unsigned int height = job->height;				\
+	unsigned int shift = yuv_format_420(job->format) ? 1 : 0;	\
+	unsigned int chroma_width = (width + 1) / 2;			\
+	unsigned int chroma_height = (height + shift) >> shift;		\
+	uint8_t *luma = job->src;					\
+	uint8_t *u = job->src + width * height;				\
+	uint8_t *v = u + chroma_width * chroma_height;			\
+	unsigned int y;							\
+									\
+	if (job->format == V4L2_PIX_FMT_YVU420) {			\
+		uint8_t *plane = u;					\
+									\
+		u = v;							\
+		v = plane;						\
+	}								\
+									\
+	for (y = y_start; y < y_end; y++) {				\
+		uint32_t *pixels = image_convert_line(job, line, y, width); \
+		unsigned int offset = (y >> shift) * chroma_width;	\
+									\
+		yuv420_row_convert_##isa(pixels, luma + y * width,	\
+					 u + offset, v + offset, width); \
+		image_convert_line_store(job, pixels, y, width, 0, width); \
+	}								\
+}									\
+									\
+static void yuyv_convert_##isa(struct image_convert_job *job,		\
+			       unsigned int y_start, unsigned int y_end) \
+{									\
+	uint32_t line[IMAGE_CONVERT_LINE_MAX];				\
+	unsigned int width = job->width;				\
+	bool uyvy = job->format == V4L2_PIX_FMT_UYVY;			\
+	unsigned int y;							\
+									\
+	for (y = y_start; y < y_end; y++) {				\
+		uint32_t *pixels = image_convert_line(job, line, y, width); \
+									\
+		yuyv_row_convert_##isa(pixels, job->src + y * width * 2, \
+				       width, uyvy);			\
+		image_convert_line_store(job, pixels, y, width, 0, width); \
+	}								\
+}									\
+									\
+static const struct yuv_converters yuv_converters_##isa = {		\
+	.nv12 = nv12_convert_##isa,					\
+	.yuv420 = yuv420_convert_##isa,					\
+	.yuyv = yuyv_convert_##isa,					\
+};
+
+YUV_CONVERTERS(scalar)
+#if defined(__x86_64__) || defined(__i386__)
+YUV_CONVERTERS(sse2)
+YUV_CONVERTERS(avx2)
+#elif defined(__ARM_NEON)
+YUV_CONVERTERS(neon)
+#endif
+
+/*
+ * Colour matrix, over XRGB32 lines. Each output channel is the rounded sum
+ * of the weighted input channels, clamped to 8 bits, with alpha preserved.
+ */
+
+static void image_ccm_row_span(uint32_t *pixels, unsigned int x_start,
+			       unsigned int width, const int16_t (*ccm)[3])
+{
+	unsigned int x, i;
+
+	for (x = x_start; x < width; x++) {
+		int32_t r = (pixels[x] >> 16) & 0xff;
+		int32_t g = (pixels[x] >> 8) & 0xff;
+		int32_t b = pixels[x] & 0xff;
+		uint32_t p = pixels[x] & 0xff000000;
+
+		for (i = 0; i < 3; i++) {
+			int32_t v = (ccm[i][0] * r + ccm[i][1] * g +
+				     ccm[i][2] * b + 128) >> 8;
+
+			p |= (uint32_t)byte_range(v) << (16 - 8 * i);
+		}
+
+		pixels[x] = p;
+	}
+}
+
+static void image_ccm_row_scalar(uint32_t *pixels, unsigned int width,
+				 const int16_t (*ccm)[3])
+{
+	image_ccm_row_span(pixels, 0, width, ccm);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Pixels are split into red and green, then blue and a rounding constant
+ * in 16-bit pairs, so that each channel takes two multiply-adds.
+ */
+
+__attribute__((target("sse2")))
+static inline __m128i image_ccm_sse2(__m128i rg, __m128i b1,
+				     const int16_t *coefs)
+{
+	__m128i c01 = _mm_unpacklo_epi16(_mm_set1_epi16(coefs[0]),
+					 _mm_set1_epi16(coefs[1]));
+	__m128i c21 = _mm_unpacklo_epi16(_mm_set1_epi16(coefs[2]),
+					 _mm_set1_epi16(1));
+
+	return _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(rg, c01),
+					    _mm_madd_epi16(b1, c21)), 8);
+}
+
+__attribute__((target("sse2")))
+static void image_ccm_row_sse2(uint32_t *pixels, unsigned int width,
+			       const int16_t (*ccm)[3])
+{
+	__m128i mask = _mm_set1_epi32(0xff);
+	__m128i green = _mm_set1_epi32(0xff0000);
+	__m128i round = _mm_set1_epi32(128 << 16);
+	unsigned int x, i;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i p[2], rg[2], b1[2], c[3], br, ga;
+
+		p[0] = _mm_loadu_si128((__m128i *)(pixels + x));
+		p[1] = _mm_loadu_si128((__m128i *)(pixels + x + 4));
+
+		for (i = 0; i < 2; i++) {
+			rg[i] = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p[i], 16),
+							   mask),
+					     _mm_and_si128(_mm_slli_epi32(p[i], 8),
+							   green));
+			b1[i] = _mm_or_si128(_mm_and_si128(p[i], mask), round);
+		}
+
+		for (i = 0; i < 3; i++)
+			c[i] = _mm_packs_epi32(image_ccm_sse2(rg[0], b1[0],
+							      ccm[i]),
+					       image_ccm_sse2(rg[1], b1[1],
+							      ccm[i]));
+
+		br = _mm_packus_epi16(c[2], c[0]);
+		ga = _mm_packus_epi16(c[1],
+				      _mm_packs_epi32(_mm_srli_epi32(p[0], 24),
+						      _mm_srli_epi32(p[1], 24)));
+
+		p[0] = _mm_unpacklo_epi8(br, ga);
+		p[1] = _mm_unpackhi_epi8(br, ga);
+
+		_mm_storeu_si128((__m128i *)(pixels + x),
+				 _mm_unpacklo_epi16(p[0], p[1]));
+		_mm_storeu_si128((__m128i *)(pixels + x + 4),
+				 _mm_unpackhi_epi16(p[0], p[1]));
+	}
+
+	image_ccm_row_span(pixels, x, width, ccm);
+}
+
+/* Packs stay within 128-bit lanes, which unpacks then undo. */
+
+__attribute__((target("avx2")))
+static inline __m256i image_ccm_avx2(__m256i rg, __m256i b1,
+				     const int16_t *coefs)
+{
+	__m256i c01 = _mm256_unpacklo_epi16(_mm256_set1_epi16(coefs[0]),
+					    _mm256_set1_epi16(coefs[1]));
+	__m256i c21 = _mm256_unpacklo_epi16(_mm256_set1_epi16(coefs[2]),
+					    _mm256_set1_epi16(1));
+
+	return _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg, c01),
+						  _mm256_madd_epi16(b1, c21)),
+				 8);
+}
+
+__attribute__((target("avx2")))
+static void image_ccm_row_avx2(uint32_t *pixels, unsigned int width,
+			       const int16_t (*ccm)[3])
+{
+	__m256i mask = _mm256_set1_epi32(0xff);
+	__m256i green = _mm256_set1_epi32(0xff0000);
+	__m256i round = _mm256_set1_epi32(128 << 16);
+	unsigned int x, i;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i p[2], rg[2], b1[2], c[3], br, ga;
+
+		p[0] = _mm256_loadu_si256((__m256i *)(pixels + x));
+		p[1] = _mm256_loadu_si256((__m256i *)(pixels + x + 8));
+
+		for (i = 0; i < 2; i++) {
+			rg[i] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(p[i], 16),
+								 mask),
+						_mm256_and_si256(_mm256_slli_epi32(p[i], 8),
+								 green));
+			b1[i] = _mm256_or_si256(_mm256_and_si256(p[i], mask),
+						round);
+		}
+
+		for (i = 0; i < 3; i++)
+			c[i] = _mm256_packs_epi32(image_ccm_avx2(rg[0], b1[0],
+								 ccm[i]),
+						  image_ccm_avx2(rg[1], b1[1],
+								 ccm[i]));
+
+		br = _mm256_packus_epi16(c[2], c[0]);
+		ga = _mm256_packus_epi16(c[1],
+					 _mm256_packs_epi32(_mm256_srli_epi32(p[0], 24),
+							    _mm256_srli_epi32(p[1], 24)));
+
+		p[0] = _mm256_unpacklo_epi8(br, ga);
+		p[1] = _mm256_unpackhi_epi8(br, ga);
+
+		_mm256_storeu_si256((__m256i *)(pixels + x),
+				    _mm256_unpacklo_epi16(p[0], p[1]));
+		_mm256_storeu_si256((__m256i *)(pixels + x + 8),
+				    _mm256_unpackhi_epi16(p[0], p[1]));
+	}
+
+	image_ccm_row_span(pixels, x, width, ccm);
+}
+#elif defined(__ARM_NEON)
+static inline uint8x8_t image_ccm_neon(int16x8_t r, int16x8_t g, int16x8_t b,
+				       const int16_t *coefs)
+{
+	int32x4_t low, high;
+
+	low = vmull_n_s16(vget_low_s16(r), coefs[0]);
+	low = vmlal_n_s16(low, vget_low_s16(g), coefs[1]);
+	low = vmlal_n_s16(low, vget_low_s16(b), coefs[2]);
+	high = vmull_n_s16(vget_high_s16(r), coefs[0]);
+	high = vmlal_n_s16(high, vget_high_s16(g), coefs[1]);
+	high = vmlal_n_s16(high, vget_high_s16(b), coefs[2]);
+
+	return vqmovun_s16(vcombine_s16(vqrshrn_n_s32(low, 8),
+					vqrshrn_n_s32(high, 8)));
+}
+
+static void image_ccm_row_neon(uint32_t *pixels, unsigned int width,
+			       const int16_t (*ccm)[3])
+{
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		uint8x8x4_t bgrx = vld4_u8((uint8_t *)(pixels + x));
+		int16x8_t b = vreinterpretq_s16_u16(vmovl_u8(bgrx.val[0]));
+		int16x8_t g = vreinterpretq_s16_u16(vmovl_u8(bgrx.val[1]));
+		int16x8_t r = vreinterpretq_s16_u16(vmovl_u8(bgrx.val[2]));
+
+		bgrx.val[2] = image_ccm_neon(r, g, b, ccm[0]);
+		bgrx.val[1] = image_ccm_neon(r, g, b, ccm[1]);
+		bgrx.val[0] = image_ccm_neon(r, g, b, ccm[2]);
+
+		vst4_u8((uint8_t *)(pixels + x), bgrx);
+	}
+
+	image_ccm_row_span(pixels, x, width, ccm);
+}
+#endif
+
+/*
+ * Output stores, from XRGB32 lines to other layouts. The 8-bit values of
+ * RGB48 from XRGB32 lines are scaled to 16 bits by replicating them.
+ */
+
+static void rgb24_row_store_span(uint8_t *dst, uint32_t *pixels,
+				 unsigned int x_start, unsigned int width)
+{
+	unsigned int x;
+
+	for (x = x_start; x < width; x++) {
+		dst[3 * x] = pixels[x] >> 16;
+		dst[3 * x + 1] = pixels[x] >> 8;
+		dst[3 * x + 2] = pixels[x];
+	}
+}
+
+static void rgb24_row_store_scalar(uint8_t *dst, uint32_t *pixels,
+				   unsigned int width)
+{
+	rgb24_row_store_span(dst, pixels, 0, width);
+}
+
+static void bgr24_row_store_span(uint8_t *dst, uint32_t *pixels,
+				 unsigned int x_start, unsigned int width)
+{
+	unsigned int x;
+
+	for (x = x_start; x < width; x++) {
+		dst[3 * x] = pixels[x];
+		dst[3 * x + 1] = pixels[x] >> 8;
+		dst[3 * x + 2] = pixels[x] >> 16;
+	}
+}
+
+static void bgr24_row_store_scalar(uint8_t *dst, uint32_t *pixels,
+				   unsigned int width)
+{
+	bgr24_row_store_span(dst, pixels, 0, width);
+}
 
-	color |= b << 0;
-	color |= g << 8;
-	color |= r << 16;
-	color |= a << 24;
+static void rgb565_row_store_span(uint8_t *dst, uint32_t *pixels,
+				  unsigned int x_start, unsigned int width)
+{
+	uint16_t *words = (uint16_t *)dst;
+	unsigned int x;
 
-	return color;
+	for (x = x_start; x < width; x++)
+		words[x] = ((pixels[x] >> 8) & 0xf800) |
+			   ((pixels[x] >> 5) & 0x07e0) |
+			   ((pixels[x] >> 3) & 0x001f);
 }
 
-static inline uint8_t clip(float v)
+static void rgb565_row_store_scalar(uint8_t *dst, uint32_t *pixels,
+				    unsigned int width)
 {
-	if (v > 255.)
-		return 255;
-	else
-		return (uint8_t)v;
+	rgb565_row_store_span(dst, pixels, 0, width);
 }
 
-static uint8_t interpol_r(void *raw_data, unsigned int width,
-			  unsigned int height, unsigned int x, unsigned int y)
+static void rgb48_row_store_span(uint8_t *dst, uint32_t *pixels,
+				 unsigned int x_start, unsigned int width)
 {
-	uint16_t *samples = raw_data;
-	float value;
-	float range_max = (1 << 10) - 1;
-	unsigned int xp, yp;
-	unsigned int xn, yn;
+	uint16_t *words = (uint16_t *)dst;
+	unsigned int x;
 
-	if ((x % 2 == 1) && (y % 2 == 1)) {
-		value = samples[y * width + x];
-		goto ret;
+	for (x = x_start; x < width; x++) {
+		words[3 * x] = ((pixels[x] >> 16) & 0xff) * 257;
+		words[3 * x + 1] = ((pixels[x] >> 8) & 0xff) * 257;
+		words[3 * x + 2] = (pixels[x] & 0xff) * 257;
 	}
+}
 
-	if (x < 2 || x >= (width - 1))
-		return 0;
-	if (y < 2 || y >= (height - 1))
-		return 0;
+static void rgb48_row_store_scalar(uint8_t *dst, uint32_t *pixels,
+				   unsigned int width)
+{
+	rgb48_row_store_span(dst, pixels, 0, width);
+}
 
-	xp = (x - 2) | 1;
-	yp = (y - 2) | 1;
+static const image_store_t image_stores_scalar[IMAGE_CONVERT_OUTPUT_COUNT] = {
+	[IMAGE_CONVERT_OUTPUT_RGB24] = rgb24_row_store_scalar,
+	[IMAGE_CONVERT_OUTPUT_BGR24] = bgr24_row_store_scalar,
+	[IMAGE_CONVERT_OUTPUT_RGB565] = rgb565_row_store_scalar,
+	[IMAGE_CONVERT_OUTPUT_RGB48] = rgb48_row_store_scalar,
+};
 
-	xn = x | 1;
-	yn = y | 1;
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * RGB565 words are sign-extended from 32-bit lanes so that the signed
+ * saturating pack keeps them as they are.
+ */
 
-//	value = (samples[yp * width + xp] + samples[yn * width + xn]) / 2.;
-	value = samples[yp * width + xp];
+__attribute__((target("sse2")))
+static inline __m128i rgb565_pack_sse2(__m128i p)
+{
+	__m128i r = _mm_and_si128(_mm_srli_epi32(p, 8),
+				  _mm_set1_epi32(0xf800));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(p, 5),
+				  _mm_set1_epi32(0x07e0));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(p, 3),
+				  _mm_set1_epi32(0x001f));
+	__m128i v = _mm_or_si128(_mm_or_si128(r, g), b);
 
-ret:
-	return clip(255. * value / range_max);
+	return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
 }
 
-static uint8_t interpol_g(void *raw_data, unsigned int width,
-			  unsigned int height, unsigned int x, unsigned int y)
+__attribute__((target("sse2")))
+static void rgb565_row_store_sse2(uint8_t *dst, uint32_t *pixels,
+				  unsigned int width)
 {
-	uint16_t *samples = raw_data;
-	float value;
-	float range_max = (1 << 10) - 1;
-	unsigned int xp, yp;
-	unsigned int xn, yn;
+	unsigned int x;
 
-	if (((x % 2 == 1) && (y % 2 == 0)) || ((x % 2) == 0 && (y % 2 == 1))) {
-		value = samples[y * width + x];
-		goto ret;
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i p0 = _mm_loadu_si128((__m128i *)(pixels + x));
+		__m128i p1 = _mm_loadu_si128((__m128i *)(pixels + x + 4));
+
+		_mm_storeu_si128((__m128i *)(dst + 2 * x),
+				 _mm_packs_epi32(rgb565_pack_sse2(p0),
+						 rgb565_pack_sse2(p1)));
 	}
 
-	if (x < 2 || x >= (width - 1))
-		return 0;
-	if (y < 2 || y >= (height - 1))
-		return 0;
+	rgb565_row_store_span(dst, pixels, x, width);
+}
+
+/* Byte shuffles are not available with SSE2 alone. */
+static const image_store_t image_stores_sse2[IMAGE_CONVERT_OUTPUT_COUNT] = {
+	[IMAGE_CONVERT_OUTPUT_RGB24] = rgb24_row_store_scalar,
+	[IMAGE_CONVERT_OUTPUT_BGR24] = bgr24_row_store_scalar,
+	[IMAGE_CONVERT_OUTPUT_RGB565] = rgb565_row_store_sse2,
+	[IMAGE_CONVERT_OUTPUT_RGB48] = rgb48_row_store_scalar,
+};
+
+/*
+ * Packed 24-bit pixels are gathered to the low 12 bytes of each 128-bit
+ * lane. The second lane is stored over the 4 spare bytes of the first one
+ * and writes 4 bytes past the 8 pixels, which the next ones overwrite.
+ */
+
+__attribute__((target("avx2")))
+static inline void rgb24_store_avx2(uint8_t *dst, uint32_t *pixels,
+				    __m256i shuffle)
+{
+	__m256i p = _mm256_loadu_si256((__m256i *)pixels);
+
+	p = _mm256_shuffle_epi8(p, shuffle);
+
+	_mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(p));
+	_mm_storeu_si128((__m128i *)(dst + 12),
+			 _mm256_extracti128_si256(p, 1));
+}
+
+__attribute__((target("avx2")))
+static void rgb24_row_store_avx2(uint8_t *dst, uint32_t *pixels,
+				 unsigned int width)
+{
+	__m256i shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+					   14, 13, 12, -1, -1, -1, -1,
+					   2, 1, 0, 6, 5, 4, 10, 9, 8,
+					   14, 13, 12, -1, -1, -1, -1);
+	unsigned int x;
 
-	xp = x - 1;
-	yp = y;
+	for (x = 0; x + 10 <= width; x += 8)
+		rgb24_store_avx2(dst + 3 * x, pixels + x, shuffle);
 
-	xn = x + 1;
-	yn = y;
+	rgb24_row_store_span(dst, pixels, x, width);
+}
+
+__attribute__((target("avx2")))
+static void bgr24_row_store_avx2(uint8_t *dst, uint32_t *pixels,
+				 unsigned int width)
+{
+	__m256i shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10,
+					   12, 13, 14, -1, -1, -1, -1,
+					   0, 1, 2, 4, 5, 6, 8, 9, 10,
+					   12, 13, 14, -1, -1, -1, -1);
+	unsigned int x;
+
+	for (x = 0; x + 10 <= width; x += 8)
+		rgb24_store_avx2(dst + 3 * x, pixels + x, shuffle);
 
-//	value = (samples[yp * width + xp] + samples[yn * width + xn]) / 2.;
-	value = samples[yp * width + xp];
+	bgr24_row_store_span(dst, pixels, x, width);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rgb565_pack_avx2(__m256i p)
+{
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 8),
+				     _mm256_set1_epi32(0xf800));
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 5),
+				     _mm256_set1_epi32(0x07e0));
+	__m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 3),
+				     _mm256_set1_epi32(0x001f));
+	__m256i v = _mm256_or_si256(_mm256_or_si256(r, g), b);
 
-ret:
-	return clip(255. * value / range_max);
+	return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
 }
 
-static uint8_t interpol_b(void *raw_data, unsigned int width,
-			  unsigned int height, unsigned int x, unsigned int y)
+__attribute__((target("avx2")))
+static void rgb565_row_store_avx2(uint8_t *dst, uint32_t *pixels,
+				  unsigned int width)
 {
-	uint16_t *samples = raw_data;
-	float value;
-	float range_max = (1 << 10) - 1;
-	unsigned int xp, yp;
-	unsigned int xn, yn;
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i p0 = _mm256_loadu_si256((__m256i *)(pixels + x));
+		__m256i p1 = _mm256_loadu_si256((__m256i *)(pixels + x + 8));
+		__m256i v = _mm256_packs_epi32(rgb565_pack_avx2(p0),
+					       rgb565_pack_avx2(p1));
 
-	if (x % 2 == 0 && y % 2 == 0) {
-		value = samples[y * width + x];
-		goto ret;
+		/* Packing works within 128-bit lanes, reorder on store. */
+		_mm256_storeu_si256((__m256i *)(dst + 2 * x),
+				    _mm256_permute4x64_epi64(v, 0xd8));
 	}
 
-	if (x < 2 || x >= (width - 1))
-		return 0;
-	if (y < 2 || y >= (height - 1))
-		return 0;
+	rgb565_row_store_span(dst, pixels, x, width);
+}
+
+/* 8-bit values are replicated to 16 bits by interleaving them with self. */
+__attribute__((target("avx2")))
+static void rgb48_row_store_avx2(uint8_t *dst, uint32_t *pixels,
+				 unsigned int width)
+{
+	__m256i shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+					   14, 13, 12, -1, -1, -1, -1,
+					   2, 1, 0, 6, 5, 4, 10, 9, 8,
+					   14, 13, 12, -1, -1, -1, -1);
+	unsigned int x;
 
-	xp = x & ~1;
-	yp = y & ~1;
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m256i p = _mm256_loadu_si256((__m256i *)(pixels + x));
+		__m256i lo, hi;
 
-	xn = x & ~1;
-	yn = y & ~1;
+		/* RGB bytes of 4 pixels in each lane, then 16-bit words. */
+		p = _mm256_shuffle_epi8(p, shuffle);
+		lo = _mm256_unpacklo_epi8(p, p);
+		hi = _mm256_unpackhi_epi8(p, p);
 
-//	value = (samples[yp * width + xp] + samples[yn * width + xn]) / 2.;
-	value = samples[yp * width + xp];
+		_mm_storeu_si128((__m128i *)(dst + 6 * x),
+				 _mm256_castsi256_si128(lo));
+		_mm_storel_epi64((__m128i *)(dst + 6 * x + 16),
+				 _mm256_castsi256_si128(hi));
+		_mm_storeu_si128((__m128i *)(dst + 6 * x + 24),
+				 _mm256_extracti128_si256(lo, 1));
+		_mm_storel_epi64((__m128i *)(dst + 6 * x + 40),
+				 _mm256_extracti128_si256(hi, 1));
+	}
 
-ret:
-	return clip(255. * value / range_max);
+	rgb48_row_store_span(dst, pixels, x, width);
 }
 
-int bayer_10_convert(void *rgb_data, void *raw_data, unsigned int length,
-		     unsigned int width, unsigned int height)
+static const image_store_t image_stores_avx2[IMAGE_CONVERT_OUTPUT_COUNT] = {
+	[IMAGE_CONVERT_OUTPUT_RGB24] = rgb24_row_store_avx2,
+	[IMAGE_CONVERT_OUTPUT_BGR24] = bgr24_row_store_avx2,
+	[IMAGE_CONVERT_OUTPUT_RGB565] = rgb565_row_store_avx2,
+	[IMAGE_CONVERT_OUTPUT_RGB48] = rgb48_row_store_avx2,
+};
+#endif
+
+#if defined(__ARM_NEON)
+static void rgb24_row_store_neon(uint8_t *dst, uint32_t *pixels,
+				 unsigned int width)
 {
-	unsigned int x, y;
-	uint16_t *samples = raw_data;
-	uint32_t *pixels = rgb_data;
-	float range_max = (1 << 10) - 1;
-	uint8_t r = 0, g = 0, b = 0;
-	// BGGR
+	unsigned int x;
 
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			float sample_range;
-			uint8_t v;
-/*
-			// average B-G-G-R
-			accumulator = (samples[0] + (samples[1] + samples[2]) / 2 + samples[3]) / 3;
-*/
-			//sample_range = 255. * samples[0] / range_max;
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x16x4_t bgrx = vld4q_u8((uint8_t *)(pixels + x));
+		uint8x16x3_t rgb;
 
-//			r = 255;
-//			g = 120;
-//			b = 255;
+		rgb.val[0] = bgrx.val[2];
+		rgb.val[1] = bgrx.val[1];
+		rgb.val[2] = bgrx.val[0];
 
+		vst3q_u8(dst + 3 * x, rgb);
+	}
 
-			r = interpol_r(raw_data, width, height, x, y);
-			g = interpol_g(raw_data, width, height, x, y);
-			b = interpol_b(raw_data, width, height, x, y);
+	rgb24_row_store_span(dst, pixels, x, width);
+}
 
-/*
-			// correct bayer cfa
-			if (x % 2 == 0) {
-				if (y % 2 == 0)
-					b = clip(sample_range);
-				else
-					g = clip(sample_range);
-			} else {
-				if (y % 2 == 0)
-					g = clip(sample_range);
-				else
-					r = clip(sample_range);
-			}
-*/
+static void bgr24_row_store_neon(uint8_t *dst, uint32_t *pixels,
+				 unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x16x4_t bgrx = vld4q_u8((uint8_t *)(pixels + x));
+		uint8x16x3_t bgr;
+
+		bgr.val[0] = bgrx.val[0];
+		bgr.val[1] = bgrx.val[1];
+		bgr.val[2] = bgrx.val[2];
+
+		vst3q_u8(dst + 3 * x, bgr);
+	}
+
+	bgr24_row_store_span(dst, pixels, x, width);
+}
+
+/* Channels are moved to the top of 16-bit lanes and inserted right. */
+static void rgb565_row_store_neon(uint8_t *dst, uint32_t *pixels,
+				  unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		uint8x8x4_t bgrx = vld4_u8((uint8_t *)(pixels + x));
+		uint16x8_t v = vshll_n_u8(bgrx.val[2], 8);
+
+		v = vsriq_n_u16(v, vshll_n_u8(bgrx.val[1], 8), 5);
+		v = vsriq_n_u16(v, vshll_n_u8(bgrx.val[0], 8), 11);
+
+		vst1q_u16((uint16_t *)(dst + 2 * x), v);
+	}
+
+	rgb565_row_store_span(dst, pixels, x, width);
+}
+
+static void rgb48_row_store_neon(uint8_t *dst, uint32_t *pixels,
+				 unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		uint8x8x4_t bgrx = vld4_u8((uint8_t *)(pixels + x));
+		uint16x8x3_t rgb;
+		unsigned int i;
+
+		for (i = 0; i < 3; i++)
+			rgb.val[i] = vorrq_u16(vshll_n_u8(bgrx.val[2 - i], 8),
+					       vmovl_u8(bgrx.val[2 - i]));
+
+		vst3q_u16((uint16_t *)(dst + 6 * x), rgb);
+	}
+
+	rgb48_row_store_span(dst, pixels, x, width);
+}
 
+static const image_store_t image_stores_neon[IMAGE_CONVERT_OUTPUT_COUNT] = {
+	[IMAGE_CONVERT_OUTPUT_RGB24] = rgb24_row_store_neon,
+	[IMAGE_CONVERT_OUTPUT_BGR24] = bgr24_row_store_neon,
+	[IMAGE_CONVERT_OUTPUT_RGB565] = rgb565_row_store_neon,
+	[IMAGE_CONVERT_OUTPUT_RGB48] = rgb48_row_store_neon,
+};
+#endif
 
 /*
-			if (index % 4 == 0)
-				b = clip(sample_range);
-			else if (index % 4 == 1)
-				g = clip(sample_range);
-			else if (index % 4 == 2)
-				g = clip(sample_range);
-			else if (index % 4 == 3)
-				r = clip(sample_range);
-*/
-
-//			printf("%3u/%3u/%3u\n", r, g, b);
-			*pixels++ = pixel_pack(r, g, b, 255);
-
-			samples++;
-		}
+ * Kernel registry: the converter used for each source format, output and
+ * algorithm, with the instruction set it was built for. Kernels are
+ * registered once, from the slowest to the fastest instruction set that the
+ * running CPU supports, so that each entry ends up with the fastest one.
+ * Bayer formats are indexed as in bayer_formats, followed by YUV formats.
+ */
+
+static const unsigned int yuv_formats[] = {
+	V4L2_PIX_FMT_NV12,
+	V4L2_PIX_FMT_NV21,
+	V4L2_PIX_FMT_NV16,
+	V4L2_PIX_FMT_NV61,
+	V4L2_PIX_FMT_YUV420,
+	V4L2_PIX_FMT_YVU420,
+	V4L2_PIX_FMT_YUV422P,
+	V4L2_PIX_FMT_UYVY,
+	V4L2_PIX_FMT_YUYV,
+};
+
+#define BAYER_FORMATS_COUNT \
+	(sizeof(bayer_formats) / sizeof(bayer_formats[0]))
+#define YUV_FORMATS_COUNT \
+	(sizeof(yuv_formats) / sizeof(yuv_formats[0]))
+#define IMAGE_CONVERT_FORMATS_COUNT \
+	(BAYER_FORMATS_COUNT + YUV_FORMATS_COUNT)
+
+struct image_convert_kernel {
+	image_convert_t convert;
+	const char *isa;
+};
+
+static struct image_convert_kernel
+image_convert_kernels[IMAGE_CONVERT_FORMATS_COUNT][IMAGE_CONVERT_OUTPUT_COUNT]
+		     [IMAGE_CONVERT_ALGORITHM_COUNT];
+
+static pthread_once_t image_convert_kernels_once = PTHREAD_ONCE_INIT;
+
+static int image_convert_format_index(unsigned int format)
+{
+	unsigned int i;
+
+	for (i = 0; i < BAYER_FORMATS_COUNT; i++)
+		if (bayer_formats[i].format == format)
+			return i;
+
+	for (i = 0; i < YUV_FORMATS_COUNT; i++)
+		if (yuv_formats[i] == format)
+			return BAYER_FORMATS_COUNT + i;
+
+	return -EINVAL;
+}
+
+static image_convert_t yuv_converter(const struct yuv_converters *converters,
+				     unsigned int format)
+{
+	switch (format) {
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+	case V4L2_PIX_FMT_YUV422P:
+		return converters->yuv420;
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_YUYV:
+		return converters->yuyv;
+	default:
+		return converters->nv12;
 	}
 }
 
-int bayer_8_convert(uint8_t *dst, uint8_t *img, uint32_t length, uint32_t w,
-		    uint32_t h, unsigned int format)
-{
-	uint32_t x = 0, y = 0;
-	uint32_t i = w * h;
-	
-	if(length < i) return(-1);
-	
-	/* SBGGR8 bayer pattern:
-	 * 
-	 * BGBGBGBGBG
-	 * GRGRGRGRGR
-	 * BGBGBGBGBG
-	 * GRGRGRGRGR
-	 * 
-	 * SGBRG8 bayer pattern:
-	 * 
-	 * GBGBGBGBGB
-	 * RGRGRGRGRG
-	 * GBGBGBGBGB
-	 * RGRGRGRGRG
-	 *
-	 * SGRBG8 bayer pattern:
-	 *
-	 * GRGRGRGRGR
-	 * BGBGBGBGBG
-	 * GRGRGRGRGR
-	 * BGBGBGBGBG
-	*/
-	
-	while(i-- > 0)
-	{
-		uint8_t *p[8];
-		uint8_t hn, vn, di;
-		uint8_t r, g, b;
-		int mode;
-		
-		/* Setup pointers to this pixel's neighbours. */
-		p[0] = img - w - 1;
-		p[1] = img - w;
-		p[2] = img - w + 1;
-		p[3] = img - 1;
-		p[4] = img + 1;
-		p[5] = img + w - 1;
-		p[6] = img + w;
-		p[7] = img + w + 1;
-		
-		/* Juggle pointers if they are out of bounds. */
-		if(!y)              { p[0]=p[5]; p[1]=p[6]; p[2]=p[7]; }
-		else if(y == h - 1) { p[5]=p[0]; p[6]=p[1]; p[7]=p[2]; }
-		if(!x)              { p[0]=p[2]; p[3]=p[4]; p[5]=p[7]; }
-		else if(x == w - 1) { p[2]=p[0]; p[4]=p[3]; p[7]=p[5]; }
-		
-		/* Average matching neighbours. */
-		hn = (*p[3] + *p[4]) / 2;
-		vn = (*p[1] + *p[6]) / 2;
-		di = (*p[0] + *p[2] + *p[5] + *p[7]) / 4;
-		
-		/* Calculate RGB */
-		if(format == V4L2_PIX_FMT_SBGGR8 ||
-		   format == V4L2_PIX_FMT_SRGGB8) {
-			mode = (x + y) & 0x01;
-		} else {
-			mode = ~(x + y) & 0x01;
-		}
-		
-		if(mode)
-		{
-			g = *img;
-			if(y & 0x01) { r = hn; b = vn; }
-			else         { r = vn; b = hn; }
+static void image_convert_kernels_register(const char *isa,
+					   const bayer_converters_t *converters,
+					   const struct yuv_converters *yuv)
+{
+	struct image_convert_kernel *kernel;
+	unsigned int i, output, algorithm;
+
+	for (i = 0; i < BAYER_FORMATS_COUNT; i++) {
+		const struct bayer_format *bayer = &bayer_formats[i];
+
+		for (output = 0; output < IMAGE_CONVERT_OUTPUT_COUNT; output++) {
+			for (algorithm = 0;
+			     algorithm < IMAGE_CONVERT_ALGORITHM_COUNT;
+			     algorithm++) {
+				image_convert_t convert;
+
+				kernel = &image_convert_kernels[i][output]
+							       [algorithm];
+				convert = converters[algorithm][bayer->packing]
+						    [bayer->depth][bayer->cfa];
+				if (!convert)
+					continue;
+
+				/* Deep RGB48 output only has a scalar kernel. */
+				if (output == IMAGE_CONVERT_OUTPUT_RGB48 &&
+				    bayer->depth != BAYER_DEPTH_8) {
+					kernel->convert = bayer_wide_convert;
+					kernel->isa = "scalar";
+					continue;
+				}
+
+				kernel->convert = convert;
+				kernel->isa = isa;
+			}
 		}
-		else if(y & 0x01) { r = *img; g = (vn + hn) / 2; b = di; }
-		else              { b = *img; g = (vn + hn) / 2; r = di; }
-		
-		if(format == V4L2_PIX_FMT_SGRBG8 ||
-		   format == V4L2_PIX_FMT_SRGGB8)
-		{
-			uint8_t t = r;
-			r = b;
-			b = t;
+	}
+
+	for (i = 0; i < YUV_FORMATS_COUNT; i++) {
+		for (output = 0; output < IMAGE_CONVERT_OUTPUT_COUNT; output++) {
+			kernel = &image_convert_kernels[BAYER_FORMATS_COUNT + i]
+						       [output]
+						       [IMAGE_CONVERT_BILINEAR];
+			kernel->convert = yuv_converter(yuv, yuv_formats[i]);
+			kernel->isa = isa;
 		}
-		
-		*(dst++) += b;
-		*(dst++) += g;
-		*(dst++) += r;
-		*(dst++) += 0;
-		
-		/* Move to the next pixel (or line) */
-		if(++x == w) { x = 0; y++; }
-		img++;
 	}
-	
-	return(0);
 }
 
-static inline uint8_t byte_range(float v)
+static void image_convert_cpu_setup(void)
 {
-	if (v < 0.)
-		return 0;
-	else if (v > 255.)
-		return 255;
-	else
-		return (uint8_t)v;
+	image_stores = image_stores_scalar;
+	image_ccm_row = image_ccm_row_scalar;
+	image_convert_kernels_register("scalar", bayer_converters_scalar,
+				       &yuv_converters_scalar);
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		image_stores = image_stores_sse2;
+		image_ccm_row = image_ccm_row_sse2;
+		image_convert_kernels_register("sse2", bayer_converters_sse2,
+					       &yuv_converters_sse2);
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		image_stores = image_stores_avx2;
+		image_ccm_row = image_ccm_row_avx2;
+		image_convert_kernels_register("avx2", bayer_converters_avx2,
+					       &yuv_converters_avx2);
+	}
+#elif defined(__ARM_NEON)
+	image_stores = image_stores_neon;
+	image_ccm_row = image_ccm_row_neon;
+	image_convert_kernels_register("neon", bayer_converters_neon,
+				       &yuv_converters_neon);
+#endif
 }
 
-int nv12_convert(void *luma, void *chroma, void *rgb, unsigned int width, unsigned int height, unsigned int stride)
+static const struct image_convert_kernel *
+image_convert_kernel_find(unsigned int format,
+			  enum image_convert_algorithm algorithm,
+			  enum image_convert_output output)
 {
-	unsigned int x, y;
+	int index;
+
+	if (algorithm >= IMAGE_CONVERT_ALGORITHM_COUNT ||
+	    output >= IMAGE_CONVERT_OUTPUT_COUNT)
+		return NULL;
 
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			unsigned int xc, yc;
-			unsigned int ol, oc;
-			uint32_t *rgbx;
-			float value;
-			uint8_t vy, vu, vv;
-			uint8_t vr, vg, vb;
+	index = image_convert_format_index(format);
+	if (index < 0)
+		return NULL;
 
-			rgbx = (uint32_t *)((uint8_t *)rgb + stride * y + x * 4);
+	pthread_once(&image_convert_kernels_once, image_convert_cpu_setup);
 
-			ol = y * width + x;
-			vy = *((uint8_t *)luma + ol);
+	if (!image_convert_kernels[index][output][algorithm].convert)
+		return NULL;
 
-			xc = x / 2;
-			yc = y / 2;
-			oc = yc * width + xc * 2;
-			vu = *((uint8_t *)chroma + oc);
-			vv = *((uint8_t *)chroma + oc + 1);
+	return &image_convert_kernels[index][output][algorithm];
+}
+
+/* Instruction set of the kernel used for a conversion, NULL if unsupported. */
+const char *image_convert_kernel_name(unsigned int format,
+				      enum image_convert_algorithm algorithm,
+				      enum image_convert_output output)
+{
+	const struct image_convert_kernel *kernel;
 
-			value = (float)vy + 1.13983 * ((float)vv - 128.0);
-			vr = byte_range(value);
-			value = (float)vy - 0.39466 * ((float)vu - 128.0) - 0.58060 * ((float)vv - 128.0);
-			vg = byte_range(value);
-			value = (float)vy + 2.03211 * ((float)vu - 128.0);
-			vb = byte_range(value);
+	kernel = image_convert_kernel_find(format, algorithm, output);
+	if (!kernel)
+		return NULL;
 
-			*rgbx = vb | (vg << 8) | (vr << 16) | (0 << 24);
-		}
+	return kernel->isa;
+}
+
+bool image_convert_format_bayer(unsigned int format)
+{
+	return bayer_format_find(format) != NULL;
+}
+
+/*
+ * Banded conversion: the frame is split into horizontal bands that are
+ * converted concurrently. Bands only write their own lines, while the
+ * neighbouring (halo) lines they need are read from the shared source.
+ */
+
+#define IMAGE_CONVERT_BAND_LINES_MIN	16
+
+struct image_convert_pool {
+	pthread_t *threads;
+	unsigned int threads_count;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	struct image_convert_job *job;
+	unsigned int y_start;
+	unsigned int y_end;
+	unsigned int generation;
+	unsigned int bands_count;
+	unsigned int band_next;
+	unsigned int bands_done;
+	bool exit;
+};
+
+static struct image_convert_pool image_convert_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void image_convert_bands_run(struct image_convert_pool *pool)
+{
+	struct image_convert_job *job = pool->job;
+	unsigned int bands_count = pool->bands_count;
+
+	unsigned int lines = pool->y_end - pool->y_start;
+
+	while (pool->band_next < bands_count) {
+		unsigned int band = pool->band_next++;
+		unsigned int y_start, y_end;
+
+		y_start = pool->y_start + lines * band / bands_count;
+		y_end = pool->y_start + lines * (band + 1) / bands_count;
+
+		pthread_mutex_unlock(&pool->mutex);
+		job->convert(job, y_start, y_end);
+		pthread_mutex_lock(&pool->mutex);
+
+		pool->bands_done++;
+		if (pool->bands_done == bands_count)
+			pthread_cond_broadcast(&pool->done_cond);
 	}
+}
 
-	return 0;
+static void *image_convert_thread(void *data)
+{
+	struct image_convert_pool *pool = data;
+	unsigned int generation = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (1) {
+		while (!pool->exit && pool->generation == generation)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+
+		if (pool->exit)
+			break;
+
+		generation = pool->generation;
+		image_convert_bands_run(pool);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
 }
 
-/* offsets: Y0 Y1 U V */
-int yuyv_convert(void *packed, void *rgb, unsigned int width, unsigned int height, unsigned int stride, unsigned int *offsets)
+static void image_convert_job_run(struct image_convert_job *job,
+				  unsigned int y_start, unsigned int y_end)
 {
-	unsigned int x, y;
+	struct image_convert_pool *pool = &image_convert_pool;
+	unsigned int bands_count = pool->threads_count + 1;
+	unsigned int lines = y_end - y_start;
 
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			unsigned int xc, yc;
-			unsigned int o, oy, ou, ov;
-			uint32_t *rgbx;
-			float value;
-			uint8_t vy, vu, vv;
-			uint8_t vr, vg, vb;
-			unsigned int xa, xf;
+	if (bands_count > lines / IMAGE_CONVERT_BAND_LINES_MIN)
+		bands_count = lines / IMAGE_CONVERT_BAND_LINES_MIN;
 
-			rgbx = (uint32_t *)((uint8_t *)rgb + stride * y + x * 4);
+	if (bands_count <= 1) {
+		job->convert(job, y_start, y_end);
+		return;
+	}
 
-			xa = x / 2;
+	pthread_mutex_lock(&pool->mutex);
 
-			o = y * width * 2 + xa * 4;
+	pool->job = job;
+	pool->y_start = y_start;
+	pool->y_end = y_end;
+	pool->bands_count = bands_count;
+	pool->band_next = 0;
+	pool->bands_done = 0;
+	pool->generation++;
 
-			if (x & 1)
-				oy = o + offsets[1];
-			else
-				oy = o + offsets[0];
+	pthread_cond_broadcast(&pool->work_cond);
+
+	/* The calling thread takes its share of bands too. */
+	image_convert_bands_run(pool);
+
+	while (pool->bands_done < bands_count)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	pool->job = NULL;
+
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void image_convert_threads_teardown(void)
+{
+	struct image_convert_pool *pool = &image_convert_pool;
+	unsigned int i;
+
+	if (!pool->threads)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->exit = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->threads_count; i++)
+		pthread_join(pool->threads[i], NULL);
 
-			ou = o + offsets[2];
-			ov = o + offsets[3];
+	free(pool->threads);
+	pool->threads = NULL;
+	pool->threads_count = 0;
+	pool->exit = false;
+}
+
+/* The calling thread always takes part, so count - 1 workers are spawned. */
+int image_convert_threads_setup(unsigned int count)
+{
+	struct image_convert_pool *pool = &image_convert_pool;
+	unsigned int i;
+	int ret;
+
+	if (!count)
+		return -EINVAL;
+
+	image_convert_threads_teardown();
 
-			vy = *((uint8_t *)packed + oy);
-			vu = *((uint8_t *)packed + ou);
-			vv = *((uint8_t *)packed + ov);
+	if (count == 1)
+		return 0;
 
-			value = (float)vy + 1.13983 * ((float)vv - 128.0);
-			vr = byte_range(value);
-			value = (float)vy - 0.39466 * ((float)vu - 128.0) - 0.58060 * ((float)vv - 128.0);
-			vg = byte_range(value);
-			value = (float)vy + 2.03211 * ((float)vu - 128.0);
-			vb = byte_range(value);
+	pool->threads = calloc(count - 1, sizeof(*pool->threads));
+	if (!pool->threads)
+		return -ENOMEM;
 
-			*rgbx = vb | (vg << 8) | (vr << 16) | (0 << 24);
+	for (i = 0; i < count - 1; i++) {
+		ret = pthread_create(&pool->threads[i], NULL,
+				     image_convert_thread, pool);
+		if (ret) {
+			image_convert_threads_teardown();
+			return -ret;
 		}
+
+		pool->threads_count++;
 	}
 
 	return 0;
 }
 
-int image_convert(uint8_t *dst, uint8_t *img, uint32_t length, uint32_t w,
-		  uint32_t h, unsigned int format)
+/*
+ * Bayer offsets and gains are laid out by line and column parity for the
+ * CFA order, with offsets scaled from 12 bits to the sample depth.
+ */
+static void image_convert_isp_bayer_setup(struct image_convert_job *job,
+					  const struct bayer_format *bayer)
+{
+	const struct sun6i_isp_params_config_bayer *config = &job->isp->bayer;
+	uint16_t offsets[IMAGE_CONVERT_CHANNEL_COUNT] = {
+		config->offset_r, config->offset_gr,
+		config->offset_gb, config->offset_b,
+	};
+	uint16_t gains[IMAGE_CONVERT_CHANNEL_COUNT] = {
+		config->gain_r, config->gain_gr,
+		config->gain_gb, config->gain_b,
+	};
+	unsigned int bits = bayer_bits(bayer);
+	unsigned int i, j;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			unsigned int channel = bayer_channels[bayer->cfa][i][j];
+			uint32_t offset = offsets[channel];
+
+			if (bits < 12)
+				offset >>= 12 - bits;
+			else
+				offset <<= bits - 12;
+
+			job->isp_offsets[i][j] = offset;
+			job->isp_gains[i][j] = gains[channel];
+		}
+	}
+
+	job->isp_bayer = true;
+}
+
+static int image_convert_job_setup(struct image_convert_job *job,
+				   uint32_t length)
 {
-	int offsets_uyvy[] = { 1, 3, 0, 2 };
-	int offsets_yuyv[] = { 0, 2, 1, 3 };
+	unsigned int w = job->width;
+	unsigned int h = job->height;
+	unsigned int format = job->format;
+	enum image_convert_algorithm algorithm = job->algorithm;
+	const struct image_convert_kernel *kernel;
+	const struct bayer_format *bayer;
+	unsigned int length_min;
+
+	kernel = image_convert_kernel_find(format, algorithm, job->output);
+	if (!kernel)
+		return -EINVAL;
+
+	if (job->output != IMAGE_CONVERT_OUTPUT_XRGB32 &&
+	    w > IMAGE_CONVERT_LINE_MAX)
+		return -EINVAL;
+
+	bayer = bayer_format_find(format);
+	if (!bayer && algorithm != IMAGE_CONVERT_BILINEAR)
+		return -EINVAL;
+
+	job->isp_bayer = false;
+
+	if (job->isp && (job->isp->modules_used & IMAGE_CONVERT_ISP_BAYER)) {
+		/* Corrected source lines are kept on the stack. */
+		if (!bayer || w > IMAGE_CONVERT_LINE_MAX)
+			return -EINVAL;
+
+		image_convert_isp_bayer_setup(job, bayer);
+	}
 
 	switch (format) {
-	case V4L2_PIX_FMT_SBGGR8:
-	case V4L2_PIX_FMT_SRGGB8:
-		return bayer_8_convert(dst, img, length, w, h, format);
-	case V4L2_PIX_FMT_SBGGR10:
-	case V4L2_PIX_FMT_SRGGB10:
-		return bayer_10_convert(dst, img, length, w, h);
 	case V4L2_PIX_FMT_NV12:
 	case V4L2_PIX_FMT_NV21:
-		return nv12_convert(img, img + w*h, dst, w, h, w*4);
+		length_min = w * h * 3 / 2;
+		break;
+	case V4L2_PIX_FMT_NV16:
+	case V4L2_PIX_FMT_NV61:
+		length_min = w * h * 2;
+		break;
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		length_min = w * h + 2 * ((w + 1) / 2) * ((h + 1) / 2);
+		break;
+	case V4L2_PIX_FMT_YUV422P:
+		length_min = w * h + 2 * ((w + 1) / 2) * h;
+		break;
 	case V4L2_PIX_FMT_UYVY:
-		return yuyv_convert(img, dst, w, h, w * 4, offsets_uyvy);
 	case V4L2_PIX_FMT_YUYV:
-		return yuyv_convert(img, dst, w, h, w * 4, offsets_yuyv);
+		length_min = w * h * 2;
+		break;
 	default:
+		if (!bayer)
+			return -EINVAL;
+
+		if (bayer->packing == BAYER_PACKING_MIPI) {
+			unsigned int bits = bayer->depth == BAYER_DEPTH_10 ?
+					    10 : 12;
+
+			/* Packed lines must end on a complete group. */
+			if ((w * bits) % 8 || w > IMAGE_CONVERT_LINE_MAX)
+				return -EINVAL;
+		}
+
+		/* Mirrored 5x5 neighbourhoods need at least 3 samples. */
+		if (algorithm == IMAGE_CONVERT_MALVAR && (w < 3 || h < 3))
+			return -EINVAL;
+
+		length_min = bayer_stride(bayer, w) * h;
+		break;
+	}
+
+	job->convert = kernel->convert;
+
+	/* The gamma table only covers 8-bit values. */
+	if (job->convert == bayer_wide_convert && job->isp &&
+	    (job->isp->modules_used & IMAGE_CONVERT_ISP_GAMMA))
+		return -EINVAL;
+
+	if (job->stats) {
+		struct image_convert_stats *stats = job->stats;
+
+		if (!bayer)
+			return -EINVAL;
+
+		if (!stats->step)
+			stats->step = IMAGE_CONVERT_STATS_STEP;
+
+		memset(stats->histograms, 0, sizeof(stats->histograms));
+		memset(stats->sums, 0, sizeof(stats->sums));
+		memset(stats->counts, 0, sizeof(stats->counts));
+		memset(stats->clipped, 0, sizeof(stats->clipped));
+		memset(stats->means, 0, sizeof(stats->means));
+
+		job->stats_convert = job->convert;
+		job->convert = bayer_stats_convert;
+	}
+
+	if (length < length_min || w < 2 || h < 2)
 		return -EINVAL;
+
+	return 0;
+}
+
+static void image_convert_job_complete(struct image_convert_job *job)
+{
+	struct image_convert_stats *stats = job->stats;
+	unsigned int c;
+
+	if (!stats)
+		return;
+
+	for (c = 0; c < IMAGE_CONVERT_CHANNEL_COUNT; c++)
+		if (stats->counts[c])
+			stats->means[c] = stats->sums[c] / stats->counts[c];
+}
+
+/* Number of lines that can be converted from the first bytes of a frame. */
+static unsigned int image_convert_job_lines(struct image_convert_job *job,
+					    uint32_t length)
+{
+	unsigned int width = job->width;
+	unsigned int height = job->height;
+	unsigned int chroma_width = (width + 1) / 2;
+	unsigned int offset = width * height;
+	const struct bayer_format *bayer;
+	unsigned int lines;
+
+	/* Chroma comes last, so lines are ready with their chroma line. */
+	switch (job->format) {
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+		lines = length > offset ? (length - offset) / width * 2 : 0;
+		break;
+	case V4L2_PIX_FMT_NV16:
+	case V4L2_PIX_FMT_NV61:
+		lines = length > offset ? (length - offset) / width : 0;
+		break;
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		offset += chroma_width * ((height + 1) / 2);
+		lines = length > offset ?
+			(length - offset) / chroma_width * 2 : 0;
+		break;
+	case V4L2_PIX_FMT_YUV422P:
+		offset += chroma_width * height;
+		lines = length > offset ? (length - offset) / chroma_width : 0;
+		break;
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_YUYV:
+		lines = length / (width * 2);
+		break;
+	default:
+		bayer = bayer_format_find(job->format);
+		lines = length / bayer_stride(bayer, width);
+		if (lines >= height)
+			break;
+
+		/*
+		 * Interpolation needs the next line, or the next two with
+		 * Malvar-He-Cutler, binning whole quads.
+		 */
+		if (job->algorithm == IMAGE_CONVERT_BINNING)
+			lines &= ~1;
+		else if (job->algorithm == IMAGE_CONVERT_MALVAR)
+			lines = lines > 2 ? lines - 2 : 0;
+		else if (lines > 0)
+			lines--;
+		break;
 	}
+
+	return lines < height ? lines : height;
+}
+
+int image_convert(uint8_t *dst, uint8_t *img, uint32_t length, uint32_t w,
+		  uint32_t h, unsigned int format,
+		  enum image_convert_algorithm algorithm,
+		  enum image_convert_output output,
+		  const struct image_convert_isp *isp,
+		  struct image_convert_stats *stats)
+{
+	struct image_convert_job job = {
+		.dst = dst,
+		.src = img,
+		.width = w,
+		.height = h,
+		.format = format,
+		.algorithm = algorithm,
+		.output = output,
+		.isp = isp,
+		.stats = stats,
+	};
+	int ret;
+
+	ret = image_convert_job_setup(&job, length);
+	if (ret)
+		return ret;
+
+	image_convert_job_run(&job, 0, h);
+	image_convert_job_complete(&job);
+
+	return 0;
+}
+
+/*
+ * Streaming conversion: the source is filled in order while lines that have
+ * all the data they need are converted, so that only the last few lines are
+ * left to convert once the whole frame is there.
+ */
+
+int image_convert_stream_start(struct image_convert_stream *stream,
+			       uint8_t *dst, uint8_t *img, uint32_t length,
+			       uint32_t w, uint32_t h, unsigned int format,
+			       enum image_convert_algorithm algorithm,
+			       enum image_convert_output output,
+			       const struct image_convert_isp *isp,
+			       struct image_convert_stats *stats)
+{
+	struct image_convert_job *job = &stream->job;
+
+	job->dst = dst;
+	job->src = img;
+	job->width = w;
+	job->height = h;
+	job->format = format;
+	job->algorithm = algorithm;
+	job->output = output;
+	job->isp = isp;
+	job->stats = stats;
+
+	stream->length = length;
+	stream->lines = 0;
+
+	return image_convert_job_setup(job, length);
+}
+
+/* Streams are restarted with the same setup for each following frame. */
+int image_convert_stream_restart(struct image_convert_stream *stream)
+{
+	stream->lines = 0;
+
+	return image_convert_job_setup(&stream->job, stream->length);
+}
+
+/* Convert the lines made available by the first received bytes. */
+void image_convert_stream_update(struct image_convert_stream *stream,
+				 uint32_t received)
+{
+	struct image_convert_job *job = &stream->job;
+	unsigned int lines;
+
+	if (received > stream->length)
+		received = stream->length;
+
+	lines = image_convert_job_lines(job, received);
+	if (lines <= stream->lines)
+		return;
+
+	image_convert_job_run(job, stream->lines, lines);
+	stream->lines = lines;
+}
+
+void image_convert_stream_finish(struct image_convert_stream *stream)
+{
+	struct image_convert_job *job = &stream->job;
+
+	if (stream->lines < job->height)
+		image_convert_job_run(job, stream->lines, job->height);
+
+	stream->lines = job->height;
+
+	image_convert_job_complete(job);
 }
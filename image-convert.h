@@ -0,0 +1,143 @@
+#ifndef _IMAGE_CONVERT_H_
+#define _IMAGE_CONVERT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sun6i-isp-config.h>
+
+/*
+ * Binning collapses each 2x2 Bayer quad to one pixel, halving both sizes.
+ * Malvar-He-Cutler interpolation is only available for 8-bit and 10-bit
+ * unpacked Bayer.
+ */
+enum image_convert_algorithm {
+	IMAGE_CONVERT_BILINEAR,
+	IMAGE_CONVERT_BINNING,
+	IMAGE_CONVERT_MALVAR,
+	IMAGE_CONVERT_ALGORITHM_COUNT,
+};
+
+/*
+ * Output layouts, in memory order: XRGB32 is B, G, R, X bytes, RGB24 and
+ * BGR24 are three bytes per pixel, RGB565 is a 16-bit word per pixel and
+ * RGB48 is R, G, B 16-bit words keeping the full precision of deep samples.
+ */
+enum image_convert_output {
+	IMAGE_CONVERT_OUTPUT_XRGB32,
+	IMAGE_CONVERT_OUTPUT_RGB24,
+	IMAGE_CONVERT_OUTPUT_BGR24,
+	IMAGE_CONVERT_OUTPUT_RGB565,
+	IMAGE_CONVERT_OUTPUT_RGB48,
+	IMAGE_CONVERT_OUTPUT_COUNT,
+};
+
+/*
+ * Software ISP stages, applied in the conversion loop. Bayer offsets and
+ * gains apply to samples by CFA channel, with the semantics of the sun6i
+ * ISP: offsets are on a 12-bit scale and gains have 8 fractional bits.
+ * The colour matrix (rows for R, G and B, 8 fractional bits) and the gamma
+ * table then apply to 8-bit RGB values.
+ */
+#define IMAGE_CONVERT_ISP_BAYER		(1U << 0)
+#define IMAGE_CONVERT_ISP_CCM		(1U << 1)
+#define IMAGE_CONVERT_ISP_GAMMA		(1U << 2)
+
+struct image_convert_isp {
+	uint32_t modules_used;
+
+	struct sun6i_isp_params_config_bayer bayer;
+	int16_t ccm[3][3];
+	uint8_t gamma[256];
+};
+
+/* Bayer channels, in the order of the sun6i ISP parameters. */
+enum image_convert_channel {
+	IMAGE_CONVERT_CHANNEL_R,
+	IMAGE_CONVERT_CHANNEL_GR,
+	IMAGE_CONVERT_CHANNEL_GB,
+	IMAGE_CONVERT_CHANNEL_B,
+	IMAGE_CONVERT_CHANNEL_COUNT,
+};
+
+/*
+ * Per-frame statistics of Bayer source samples, before ISP correction,
+ * gathered on a grid of one quad every step quads on both axes. Histogram
+ * bins hold the top 8 bits of samples, clipped samples are at the largest
+ * value of the depth and means are on the sample scale.
+ */
+#define IMAGE_CONVERT_STATS_STEP	4
+
+struct image_convert_stats {
+	/* Grid step in quads, IMAGE_CONVERT_STATS_STEP when zero. */
+	unsigned int step;
+
+	uint32_t histograms[IMAGE_CONVERT_CHANNEL_COUNT][256];
+	uint64_t sums[IMAGE_CONVERT_CHANNEL_COUNT];
+	uint32_t counts[IMAGE_CONVERT_CHANNEL_COUNT];
+	uint32_t clipped[IMAGE_CONVERT_CHANNEL_COUNT];
+	uint32_t means[IMAGE_CONVERT_CHANNEL_COUNT];
+};
+
+struct image_convert_job;
+
+typedef void (*image_convert_t)(struct image_convert_job *job,
+				unsigned int y_start, unsigned int y_end);
+
+struct image_convert_job {
+	uint8_t *dst;
+	uint8_t *src;
+	unsigned int width;
+	unsigned int height;
+	unsigned int format;
+	enum image_convert_algorithm algorithm;
+	enum image_convert_output output;
+	const struct image_convert_isp *isp;
+
+	/* Bayer offsets and gains by line and column parity. */
+	bool isp_bayer;
+	uint16_t isp_offsets[2][2];
+	uint16_t isp_gains[2][2];
+
+	/* Statistics wrap the converter, which is then kept aside. */
+	struct image_convert_stats *stats;
+	image_convert_t stats_convert;
+
+	image_convert_t convert;
+};
+
+struct image_convert_stream {
+	struct image_convert_job job;
+	uint32_t length;
+	unsigned int lines;
+};
+
+void image_convert_isp_gamma(struct image_convert_isp *isp, double gamma);
+bool image_convert_format_bayer(unsigned int format);
+const char *image_convert_kernel_name(unsigned int format,
+				      enum image_convert_algorithm algorithm,
+				      enum image_convert_output output);
+
+void image_convert_threads_teardown(void);
+int image_convert_threads_setup(unsigned int count);
+
+int image_convert(uint8_t *dst, uint8_t *img, uint32_t length, uint32_t w,
+		  uint32_t h, unsigned int format,
+		  enum image_convert_algorithm algorithm,
+		  enum image_convert_output output,
+		  const struct image_convert_isp *isp,
+		  struct image_convert_stats *stats);
+
+int image_convert_stream_start(struct image_convert_stream *stream,
+			       uint8_t *dst, uint8_t *img, uint32_t length,
+			       uint32_t w, uint32_t h, unsigned int format,
+			       enum image_convert_algorithm algorithm,
+			       enum image_convert_output output,
+			       const struct image_convert_isp *isp,
+			       struct image_convert_stats *stats);
+int image_convert_stream_restart(struct image_convert_stream *stream);
+void image_convert_stream_update(struct image_convert_stream *stream,
+				 uint32_t received);
+void image_convert_stream_finish(struct image_convert_stream *stream);
+
+#endif
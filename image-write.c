@@ -0,0 +1,798 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/uio.h>
+
+#include <linux/videodev2.h>
+
+#include <zlib.h>
+
+#include <image-write.h>
+
+/* Names are also used as file extensions. */
+static const char *image_write_names[] = {
+	[IMAGE_WRITE_PNG] = "png",
+	[IMAGE_WRITE_PPM] = "ppm",
+	[IMAGE_WRITE_PAM] = "pam",
+	[IMAGE_WRITE_QOI] = "qoi",
+	[IMAGE_WRITE_DNG] = "dng",
+};
+
+int image_write_format_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < IMAGE_WRITE_FORMAT_COUNT; i++)
+		if (!strcmp(name, image_write_names[i]))
+			return i;
+
+	return -EINVAL;
+}
+
+const char *image_write_extension(enum image_write_format format)
+{
+	if (format >= IMAGE_WRITE_FORMAT_COUNT)
+		return NULL;
+
+	return image_write_names[format];
+}
+
+static inline void image_write_be32(uint8_t *data, uint32_t value)
+{
+	data[0] = value >> 24;
+	data[1] = value >> 16;
+	data[2] = value >> 8;
+	data[3] = value;
+}
+
+/* Linux limit on the number of vectors of a single call. */
+#define IMAGE_WRITE_VECTORS_MAX	1024
+
+/* Write all vectors, resuming after partial writes. */
+static int image_write_vectors(int fd, struct iovec *iov, unsigned int count)
+{
+	ssize_t length;
+
+	while (count) {
+		length = writev(fd, iov, count < IMAGE_WRITE_VECTORS_MAX ?
+				count : IMAGE_WRITE_VECTORS_MAX);
+		if (length < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		while (count && (size_t)length >= iov->iov_len) {
+			length -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count) {
+			iov->iov_base = (uint8_t *)iov->iov_base + length;
+			iov->iov_len -= length;
+		}
+	}
+
+	return 0;
+}
+
+static void image_write_rgb_row(uint8_t *rgb, const uint32_t *pixels,
+				unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x < width; x++) {
+		rgb[3 * x] = pixels[x] >> 16;
+		rgb[3 * x + 1] = pixels[x] >> 8;
+		rgb[3 * x + 2] = pixels[x];
+	}
+}
+
+/*
+ * PNG: each stripe of rows is compressed to a raw deflate stream of its own,
+ * ended with a sync flush to a byte boundary except for the last one, so
+ * that stripes concatenate to a single zlib stream. Rows are filtered from
+ * the whole frame, so the first row of a stripe still refers to the row
+ * above. Each stripe goes to its own IDAT chunk, between chunks for the
+ * zlib header and the combined adler32 checksum.
+ */
+
+#define IMAGE_WRITE_PNG_STRIPE_LINES	64
+
+struct image_write_png_stripe {
+	pthread_t thread;
+	bool threaded;
+
+	const uint32_t *pixels;
+	unsigned int width;
+	unsigned int y_start;
+	unsigned int y_end;
+	int level;
+	bool last;
+
+	uint8_t *data;
+	size_t length;
+	uint32_t adler;
+	uint32_t crc;
+	int ret;
+
+	/* IDAT length and type, then CRC. */
+	uint8_t chunk[12];
+};
+
+static inline uint8_t image_write_paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	else if (pb <= pc)
+		return b;
+	else
+		return c;
+}
+
+/*
+ * Faster levels use the sub filter, with run-length matches only that are
+ * faster to find and compress filtered rows about as well, stronger ones
+ * the paeth filter.
+ */
+static void image_write_png_filter(uint8_t *filtered, const uint8_t *row,
+				   const uint8_t *up, unsigned int size,
+				   int level)
+{
+	unsigned int i;
+
+	if (!level) {
+		filtered[0] = 0;
+		memcpy(filtered + 1, row, size);
+	} else if (level < 4) {
+		filtered[0] = 1;
+		for (i = 0; i < 3; i++)
+			filtered[1 + i] = row[i];
+		for (; i < size; i++)
+			filtered[1 + i] = row[i] - row[i - 3];
+	} else {
+		filtered[0] = 4;
+		for (i = 0; i < 3; i++)
+			filtered[1 + i] = row[i] - image_write_paeth(0, up[i], 0);
+		for (; i < size; i++)
+			filtered[1 + i] = row[i] -
+					  image_write_paeth(row[i - 3], up[i],
+							    up[i - 3]);
+	}
+}
+
+static void *image_write_png_stripe(void *data)
+{
+	struct image_write_png_stripe *stripe = data;
+	unsigned int size = stripe->width * 3;
+	uint8_t *rows[2] = { NULL, NULL };
+	uint8_t *filtered = NULL;
+	z_stream stream = { 0 };
+	unsigned int y;
+	uLong bound;
+	int ret;
+
+	rows[0] = calloc(2, size);
+	filtered = malloc(size + 1);
+	if (!rows[0] || !filtered) {
+		stripe->ret = -ENOMEM;
+		goto complete;
+	}
+
+	rows[1] = rows[0] + size;
+
+	ret = deflateInit2(&stream, stripe->level, Z_DEFLATED, -15, 8,
+			   stripe->level < 4 ? Z_RLE : Z_DEFAULT_STRATEGY);
+	if (ret != Z_OK) {
+		stripe->ret = -ENOMEM;
+		goto complete;
+	}
+
+	/* Sync flushes add an empty stored block. */
+	bound = deflateBound(&stream, (uLong)(size + 1) *
+				      (stripe->y_end - stripe->y_start)) + 16;
+
+	stripe->data = malloc(bound);
+	if (!stripe->data) {
+		stripe->ret = -ENOMEM;
+		goto error;
+	}
+
+	stream.next_out = stripe->data;
+	stream.avail_out = bound;
+
+	stripe->adler = adler32(0, NULL, 0);
+
+	if (stripe->y_start > 0)
+		image_write_rgb_row(rows[(stripe->y_start - 1) & 1],
+				    stripe->pixels +
+				    (stripe->y_start - 1) * stripe->width,
+				    stripe->width);
+
+	for (y = stripe->y_start; y < stripe->y_end; y++) {
+		uint8_t *row = rows[y & 1];
+		uint8_t *up = rows[!(y & 1)];
+		int flush = Z_NO_FLUSH;
+
+		if (y == stripe->y_end - 1)
+			flush = stripe->last ? Z_FINISH : Z_SYNC_FLUSH;
+
+		image_write_rgb_row(row, stripe->pixels + y * stripe->width,
+				    stripe->width);
+		image_write_png_filter(filtered, row, up, size, stripe->level);
+
+		stripe->adler = adler32(stripe->adler, filtered, size + 1);
+
+		stream.next_in = filtered;
+		stream.avail_in = size + 1;
+
+		ret = deflate(&stream, flush);
+		if (ret == Z_STREAM_ERROR || stream.avail_in) {
+			stripe->ret = -EIO;
+			goto error;
+		}
+	}
+
+	stripe->length = bound - stream.avail_out;
+	stripe->crc = crc32(crc32(0, (const Bytef *)"IDAT", 4), stripe->data,
+			    stripe->length);
+
+error:
+	deflateEnd(&stream);
+
+complete:
+	free(rows[0]);
+	free(filtered);
+
+	return NULL;
+}
+
+static int image_write_png(int fd, const uint32_t *pixels, unsigned int width,
+			   unsigned int height, int level,
+			   unsigned int threads)
+{
+	struct image_write_png_stripe *stripes;
+	unsigned int stripes_count = threads;
+	uint8_t header[8 + 25 + 14] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+	};
+	uint8_t trailer[16 + 12];
+	uint8_t *ihdr = header + 8;
+	uint8_t *idat = header + 8 + 25;
+	uint8_t *iend = trailer + 16;
+	struct iovec *iov;
+	uint32_t adler;
+	unsigned int count = 0;
+	unsigned int i;
+	int ret;
+
+	if (level == Z_DEFAULT_COMPRESSION)
+		level = 6;
+	else if (level < 0 || level > 9)
+		return -EINVAL;
+
+	if (stripes_count > height / IMAGE_WRITE_PNG_STRIPE_LINES)
+		stripes_count = height / IMAGE_WRITE_PNG_STRIPE_LINES;
+	if (!stripes_count)
+		stripes_count = 1;
+
+	stripes = calloc(stripes_count, sizeof(*stripes));
+	iov = calloc(2 + 3 * stripes_count, sizeof(*iov));
+	if (!stripes || !iov) {
+		ret = -ENOMEM;
+		goto complete;
+	}
+
+	for (i = 0; i < stripes_count; i++) {
+		struct image_write_png_stripe *stripe = &stripes[i];
+
+		stripe->pixels = pixels;
+		stripe->width = width;
+		stripe->y_start = height * i / stripes_count;
+		stripe->y_end = height * (i + 1) / stripes_count;
+		stripe->level = level;
+		stripe->last = i == stripes_count - 1;
+	}
+
+	/* The calling thread takes the first stripe, or any left behind. */
+	for (i = 1; i < stripes_count; i++)
+		stripes[i].threaded = !pthread_create(&stripes[i].thread, NULL,
+						      image_write_png_stripe,
+						      &stripes[i]);
+
+	for (i = 0; i < stripes_count; i++) {
+		if (stripes[i].threaded)
+			pthread_join(stripes[i].thread, NULL);
+		else
+			image_write_png_stripe(&stripes[i]);
+	}
+
+	for (i = 0; i < stripes_count; i++) {
+		ret = stripes[i].ret;
+		if (ret)
+			goto complete;
+	}
+
+	image_write_be32(ihdr, 13);
+	memcpy(ihdr + 4, "IHDR", 4);
+	image_write_be32(ihdr + 8, width);
+	image_write_be32(ihdr + 12, height);
+	ihdr[16] = 8;
+	ihdr[17] = 2;
+	ihdr[18] = 0;
+	ihdr[19] = 0;
+	ihdr[20] = 0;
+	image_write_be32(ihdr + 21, crc32(0, ihdr + 4, 17));
+
+	image_write_be32(idat, 2);
+	memcpy(idat + 4, "IDAT", 4);
+	idat[8] = 0x78;
+	idat[9] = 0x01;
+	image_write_be32(idat + 10, crc32(0, idat + 4, 6));
+
+	iov[count].iov_base = header;
+	iov[count++].iov_len = sizeof(header);
+
+	adler = adler32(0, NULL, 0);
+
+	for (i = 0; i < stripes_count; i++) {
+		struct image_write_png_stripe *stripe = &stripes[i];
+
+		adler = adler32_combine(adler, stripe->adler,
+					(z_off_t)(width * 3 + 1) *
+					(stripe->y_end - stripe->y_start));
+
+		image_write_be32(stripe->chunk, stripe->length);
+		memcpy(stripe->chunk + 4, "IDAT", 4);
+		image_write_be32(stripe->chunk + 8, stripe->crc);
+
+		iov[count].iov_base = stripe->chunk;
+		iov[count++].iov_len = 8;
+		iov[count].iov_base = stripe->data;
+		iov[count++].iov_len = stripe->length;
+		iov[count].iov_base = stripe->chunk + 8;
+		iov[count++].iov_len = 4;
+	}
+
+	image_write_be32(trailer, 4);
+	memcpy(trailer + 4, "IDAT", 4);
+	image_write_be32(trailer + 8, adler);
+	image_write_be32(trailer + 12, crc32(0, trailer + 4, 8));
+
+	image_write_be32(iend, 0);
+	memcpy(iend + 4, "IEND", 4);
+	image_write_be32(iend + 8, crc32(0, iend + 4, 4));
+
+	iov[count].iov_base = trailer;
+	iov[count++].iov_len = sizeof(trailer);
+
+	ret = image_write_vectors(fd, iov, count);
+
+complete:
+	if (stripes)
+		for (i = 0; i < stripes_count; i++)
+			free(stripes[i].data);
+
+	free(stripes);
+	free(iov);
+
+	return ret;
+}
+
+/* PPM and PAM hold RGB samples as they are, after a text header. */
+
+#define IMAGE_WRITE_RAW_LINES	64
+
+static int image_write_raw(int fd, const uint32_t *pixels, unsigned int width,
+			   unsigned int height, enum image_write_format format)
+{
+	char header[128];
+	struct iovec iov;
+	uint8_t *rgb;
+	unsigned int size = width * 3;
+	unsigned int y, i;
+	int length;
+	int ret;
+
+	if (format == IMAGE_WRITE_PAM)
+		length = snprintf(header, sizeof(header),
+				  "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 3\nMAXVAL 255\n"
+				  "TUPLTYPE RGB\nENDHDR\n", width, height);
+	else
+		length = snprintf(header, sizeof(header), "P6\n%u %u\n255\n",
+				  width, height);
+
+	iov.iov_base = header;
+	iov.iov_len = length;
+
+	ret = image_write_vectors(fd, &iov, 1);
+	if (ret)
+		return ret;
+
+	rgb = malloc(size * IMAGE_WRITE_RAW_LINES);
+	if (!rgb)
+		return -ENOMEM;
+
+	for (y = 0; y < height; y += i) {
+		for (i = 0; i < IMAGE_WRITE_RAW_LINES && y + i < height; i++)
+			image_write_rgb_row(rgb + i * size,
+					    pixels + (y + i) * width, width);
+
+		iov.iov_base = rgb;
+		iov.iov_len = i * size;
+
+		ret = image_write_vectors(fd, &iov, 1);
+		if (ret)
+			break;
+	}
+
+	free(rgb);
+
+	return ret;
+}
+
+/*
+ * QOI: pixels are coded as runs, references to a table of recently seen
+ * pixels indexed by hash, small differences to the previous pixel or as
+ * they are. Alpha is always opaque.
+ */
+
+#define QOI_OP_INDEX	0x00
+#define QOI_OP_DIFF	0x40
+#define QOI_OP_LUMA	0x80
+#define QOI_OP_RUN	0xc0
+#define QOI_OP_RGB	0xfe
+
+#define IMAGE_WRITE_QOI_LINES	64
+
+static int image_write_qoi(int fd, const uint32_t *pixels, unsigned int width,
+			   unsigned int height)
+{
+	static const uint8_t padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	uint32_t table[64] = { 0 };
+	uint32_t previous = 0xff000000;
+	unsigned int run = 0;
+	unsigned int count = width * height;
+	unsigned int size = width * 4 * IMAGE_WRITE_QOI_LINES;
+	struct iovec iov;
+	uint8_t *data, *p;
+	unsigned int i;
+	int ret = 0;
+
+	/* Each pixel takes at most 4 bytes, leaving room for the header. */
+	data = malloc(size + 14);
+	if (!data)
+		return -ENOMEM;
+
+	p = data;
+	memcpy(p, "qoif", 4);
+	image_write_be32(p + 4, width);
+	image_write_be32(p + 8, height);
+	p[12] = 3;
+	p[13] = 0;
+	p += 14;
+
+	for (i = 0; i < count; i++) {
+		uint32_t pixel = pixels[i] | 0xff000000;
+		uint8_t r = pixel >> 16, g = pixel >> 8, b = pixel;
+
+		if (pixel == previous) {
+			run++;
+			if (run == 62 || i == count - 1) {
+				*p++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+		} else {
+			unsigned int index = (r * 3 + g * 5 + b * 7 +
+					      255 * 11) % 64;
+
+			if (run) {
+				*p++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+
+			if (table[index] == pixel) {
+				*p++ = QOI_OP_INDEX | index;
+			} else {
+				int8_t dr = r - (uint8_t)(previous >> 16);
+				int8_t dg = g - (uint8_t)(previous >> 8);
+				int8_t db = b - (uint8_t)previous;
+				int8_t dr_dg = dr - dg;
+				int8_t db_dg = db - dg;
+
+				table[index] = pixel;
+
+				if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 &&
+				    db >= -2 && db <= 1) {
+					*p++ = QOI_OP_DIFF | (dr + 2) << 4 |
+					       (dg + 2) << 2 | (db + 2);
+				} else if (dg >= -32 && dg <= 31 &&
+					   dr_dg >= -8 && dr_dg <= 7 &&
+					   db_dg >= -8 && db_dg <= 7) {
+					*p++ = QOI_OP_LUMA | (dg + 32);
+					*p++ = (dr_dg + 8) << 4 | (db_dg + 8);
+				} else {
+					*p++ = QOI_OP_RGB;
+					*p++ = r;
+					*p++ = g;
+					*p++ = b;
+				}
+			}
+
+			previous = pixel;
+		}
+
+		/* Flush once the buffer may not hold another batch. */
+		if ((unsigned int)(p - data) > size - 4 || i == count - 1) {
+			iov.iov_base = data;
+			iov.iov_len = p - data;
+
+			ret = image_write_vectors(fd, &iov, 1);
+			if (ret)
+				goto complete;
+
+			p = data;
+		}
+	}
+
+	iov.iov_base = (void *)padding;
+	iov.iov_len = sizeof(padding);
+
+	ret = image_write_vectors(fd, &iov, 1);
+
+complete:
+	free(data);
+
+	return ret;
+}
+
+/*
+ * Write an XRGB32 frame, with the zlib level (0 to 9, or the zlib default)
+ * for PNG compressed in as many stripes as threads.
+ */
+int image_write(const char *path, const uint32_t *pixels, unsigned int width,
+		unsigned int height, enum image_write_format format, int level,
+		unsigned int threads)
+{
+	int fd;
+	int ret;
+
+	if (!path || !pixels || !width || !height || !threads)
+		return -EINVAL;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	switch (format) {
+	case IMAGE_WRITE_PNG:
+		ret = image_write_png(fd, pixels, width, height, level,
+				      threads);
+		break;
+	case IMAGE_WRITE_PPM:
+	case IMAGE_WRITE_PAM:
+		ret = image_write_raw(fd, pixels, width, height, format);
+		break;
+	case IMAGE_WRITE_QOI:
+		ret = image_write_qoi(fd, pixels, width, height);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * DNG: a little-endian TIFF with a single uncompressed CFA strip, which is
+ * the raw buffer as it is: 16-bit containers are already in TIFF byte order.
+ * MIPI-packed samples have no DNG equivalent and are not supported.
+ */
+
+struct image_write_dng_format {
+	unsigned int format;
+	uint8_t pattern[4];
+	unsigned int bits;
+};
+
+/* CFA pattern colours: 0 is red, 1 is green and 2 is blue. */
+static const struct image_write_dng_format image_write_dng_formats[] = {
+	{ V4L2_PIX_FMT_SBGGR8,	{ 2, 1, 1, 0 },	8 },
+	{ V4L2_PIX_FMT_SGBRG8,	{ 1, 2, 0, 1 },	8 },
+	{ V4L2_PIX_FMT_SGRBG8,	{ 1, 0, 2, 1 },	8 },
+	{ V4L2_PIX_FMT_SRGGB8,	{ 0, 1, 1, 2 },	8 },
+	{ V4L2_PIX_FMT_SBGGR10,	{ 2, 1, 1, 0 },	10 },
+	{ V4L2_PIX_FMT_SGBRG10,	{ 1, 2, 0, 1 },	10 },
+	{ V4L2_PIX_FMT_SGRBG10,	{ 1, 0, 2, 1 },	10 },
+	{ V4L2_PIX_FMT_SRGGB10,	{ 0, 1, 1, 2 },	10 },
+	{ V4L2_PIX_FMT_SBGGR12,	{ 2, 1, 1, 0 },	12 },
+	{ V4L2_PIX_FMT_SGBRG12,	{ 1, 2, 0, 1 },	12 },
+	{ V4L2_PIX_FMT_SGRBG12,	{ 1, 0, 2, 1 },	12 },
+	{ V4L2_PIX_FMT_SRGGB12,	{ 0, 1, 1, 2 },	12 },
+	{ V4L2_PIX_FMT_SBGGR16,	{ 2, 1, 1, 0 },	16 },
+	{ V4L2_PIX_FMT_SGBRG16,	{ 1, 2, 0, 1 },	16 },
+	{ V4L2_PIX_FMT_SGRBG16,	{ 1, 0, 2, 1 },	16 },
+	{ V4L2_PIX_FMT_SRGGB16,	{ 0, 1, 1, 2 },	16 },
+};
+
+#define TIFF_SHORT	3
+#define TIFF_LONG	4
+#define TIFF_BYTE	1
+#define TIFF_ASCII	2
+#define TIFF_SRATIONAL	10
+
+#define IMAGE_WRITE_DNG_ENTRIES	20
+#define IMAGE_WRITE_DNG_MODEL	"v4l2-bayer"
+
+/* Linear sRGB from XYZ, standing in for an uncalibrated sensor. */
+static const int32_t image_write_dng_matrix[9] = {
+	32406, -15372, -4986,
+	-9689, 18758, 415,
+	557, -2040, 10570,
+};
+
+struct image_write_dng_header {
+	uint8_t tiff[8];
+	uint8_t count[2];
+	uint8_t entries[IMAGE_WRITE_DNG_ENTRIES][12];
+	uint8_t next[4];
+	uint8_t matrix[9][8];
+	/* Padded so that 16-bit samples start on an even offset. */
+	char model[12];
+} __attribute__((packed));
+
+static inline void image_write_le16(uint8_t *data, uint16_t value)
+{
+	data[0] = value;
+	data[1] = value >> 8;
+}
+
+static inline void image_write_le32(uint8_t *data, uint32_t value)
+{
+	data[0] = value;
+	data[1] = value >> 8;
+	data[2] = value >> 16;
+	data[3] = value >> 24;
+}
+
+/* Entries must come in increasing tag order. */
+static uint8_t *image_write_dng_entry(uint8_t *entry, uint16_t tag,
+				      uint16_t type, uint32_t count,
+				      uint32_t value)
+{
+	image_write_le16(entry, tag);
+	image_write_le16(entry + 2, type);
+	image_write_le32(entry + 4, count);
+
+	/* Values fitting in 4 bytes are stored in place, left-justified. */
+	if (type == TIFF_SHORT && count == 1)
+		image_write_le16(entry + 8, value);
+	else
+		image_write_le32(entry + 8, value);
+
+	return entry + 12;
+}
+
+/*
+ * Write a raw Bayer frame, with the black level given on a 12-bit scale as
+ * for ISP offsets.
+ */
+int image_write_dng(const char *path, const void *raw, unsigned int length,
+		    unsigned int width, unsigned int height, unsigned int format,
+		    unsigned int black_level)
+{
+	const struct image_write_dng_format *dng_format = NULL;
+	struct image_write_dng_header header = { 0 };
+	struct iovec iov[2];
+	unsigned int depth, size, offset;
+	uint8_t *entry;
+	unsigned int i;
+	int fd;
+	int ret;
+
+	if (!path || !raw || !width || !height)
+		return -EINVAL;
+
+	for (i = 0; i < sizeof(image_write_dng_formats) /
+	     sizeof(image_write_dng_formats[0]); i++) {
+		if (image_write_dng_formats[i].format == format) {
+			dng_format = &image_write_dng_formats[i];
+			break;
+		}
+	}
+
+	if (!dng_format)
+		return -EINVAL;
+
+	depth = dng_format->bits > 8 ? 16 : 8;
+	size = width * height * depth / 8;
+	if (length < size)
+		return -EINVAL;
+
+	memcpy(header.tiff, "II*\0", 4);
+	image_write_le32(header.tiff + 4, offsetof(struct image_write_dng_header,
+						   count));
+	image_write_le16(header.count, IMAGE_WRITE_DNG_ENTRIES);
+
+	for (i = 0; i < 9; i++) {
+		image_write_le32(header.matrix[i],
+				 (uint32_t)image_write_dng_matrix[i]);
+		image_write_le32(header.matrix[i] + 4, 10000);
+	}
+
+	memcpy(header.model, IMAGE_WRITE_DNG_MODEL,
+	       sizeof(IMAGE_WRITE_DNG_MODEL));
+
+	entry = &header.entries[0][0];
+	entry = image_write_dng_entry(entry, 254, TIFF_LONG, 1, 0);
+	entry = image_write_dng_entry(entry, 256, TIFF_LONG, 1, width);
+	entry = image_write_dng_entry(entry, 257, TIFF_LONG, 1, height);
+	entry = image_write_dng_entry(entry, 258, TIFF_SHORT, 1, depth);
+	/* No compression, CFA photometric interpretation. */
+	entry = image_write_dng_entry(entry, 259, TIFF_SHORT, 1, 1);
+	entry = image_write_dng_entry(entry, 262, TIFF_SHORT, 1, 32803);
+	entry = image_write_dng_entry(entry, 273, TIFF_LONG, 1, sizeof(header));
+	entry = image_write_dng_entry(entry, 274, TIFF_SHORT, 1, 1);
+	entry = image_write_dng_entry(entry, 277, TIFF_SHORT, 1, 1);
+	entry = image_write_dng_entry(entry, 278, TIFF_LONG, 1, height);
+	entry = image_write_dng_entry(entry, 279, TIFF_LONG, 1, size);
+	entry = image_write_dng_entry(entry, 284, TIFF_SHORT, 1, 1);
+	/* 2x2 CFA repeat pattern dimensions. */
+	entry = image_write_dng_entry(entry, 33421, TIFF_SHORT, 2,
+				      2 | (2 << 16));
+	entry = image_write_dng_entry(entry, 33422, TIFF_BYTE, 4, 0);
+	memcpy(entry - 4, dng_format->pattern, 4);
+	/* DNG version 1.4.0.0, backward version 1.1.0.0. */
+	entry = image_write_dng_entry(entry, 50706, TIFF_BYTE, 4, 0x00000401);
+	entry = image_write_dng_entry(entry, 50707, TIFF_BYTE, 4, 0x00000101);
+
+	offset = offsetof(struct image_write_dng_header, model);
+	entry = image_write_dng_entry(entry, 50708, TIFF_ASCII,
+				      sizeof(IMAGE_WRITE_DNG_MODEL), offset);
+
+	if (dng_format->bits > 12)
+		black_level <<= dng_format->bits - 12;
+	else
+		black_level >>= 12 - dng_format->bits;
+
+	entry = image_write_dng_entry(entry, 50714, TIFF_LONG, 1, black_level);
+	entry = image_write_dng_entry(entry, 50717, TIFF_LONG, 1,
+				      (1U << dng_format->bits) - 1);
+
+	offset = offsetof(struct image_write_dng_header, matrix);
+	entry = image_write_dng_entry(entry, 50721, TIFF_SRATIONAL, 9, offset);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	/* The raw plane is written from where it is, after the header. */
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = (void *)raw;
+	iov[1].iov_len = size;
+
+	ret = image_write_vectors(fd, iov, 2);
+
+	close(fd);
+
+	return ret;
+}
@@ -0,0 +1,34 @@
+#ifndef _IMAGE_WRITE_H_
+#define _IMAGE_WRITE_H_
+
+#include <stdint.h>
+
+/* Compression levels are zlib levels, such as Z_BEST_SPEED. */
+#include <zlib.h>
+
+/*
+ * Image writers, from XRGB32 frames as produced by image_convert(). PNG
+ * frames are filtered and compressed in parallel stripes, PPM and PAM are
+ * written as they are and QOI is a fast lossless format. DNG frames are
+ * written from the raw Bayer buffer instead, without demosaic.
+ */
+
+enum image_write_format {
+	IMAGE_WRITE_PNG,
+	IMAGE_WRITE_PPM,
+	IMAGE_WRITE_PAM,
+	IMAGE_WRITE_QOI,
+	IMAGE_WRITE_DNG,
+	IMAGE_WRITE_FORMAT_COUNT,
+};
+
+int image_write_format_find(const char *name);
+const char *image_write_extension(enum image_write_format format);
+int image_write(const char *path, const uint32_t *pixels, unsigned int width,
+		unsigned int height, enum image_write_format format, int level,
+		unsigned int threads);
+int image_write_dng(const char *path, const void *raw, unsigned int length,
+		    unsigned int width, unsigned int height, unsigned int format,
+		    unsigned int black_level);
+
+#endif
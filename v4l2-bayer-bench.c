@@ -0,0 +1,704 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <linux/perf_event.h>
+
+#include <linux/videodev2.h>
+
+#include <cairo.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <image-convert.h>
+#include <image-write.h>
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+struct v4l2_bayer_bench_size {
+	char *name;
+	unsigned int width;
+	unsigned int height;
+};
+
+struct v4l2_bayer_bench_format {
+	char *name;
+	unsigned int format;
+	int (*reference)(uint8_t *dst, uint8_t *src, unsigned int width,
+			 unsigned int height);
+};
+
+static inline uint8_t float_range(float v)
+{
+	if (v < 0.)
+		return 0;
+	else if (v > 255.)
+		return 255;
+	else
+		return (uint8_t)v;
+}
+
+static inline uint32_t float_pixel(uint8_t vy, uint8_t vu, uint8_t vv)
+{
+	uint8_t vr, vg, vb;
+	float value;
+
+	value = (float)vy + 1.13983 * ((float)vv - 128.0);
+	vr = float_range(value);
+	value = (float)vy - 0.39466 * ((float)vu - 128.0) - 0.58060 * ((float)vv - 128.0);
+	vg = float_range(value);
+	value = (float)vy + 2.03211 * ((float)vu - 128.0);
+	vb = float_range(value);
+
+	return vb | (vg << 8) | (vr << 16) | (0 << 24);
+}
+
+/* Floating-point per-pixel converters, as found before fixed-point. */
+
+static int nv12_reference(uint8_t *dst, uint8_t *src, unsigned int width,
+			  unsigned int height)
+{
+	uint32_t *pixels = (uint32_t *)dst;
+	uint8_t *chroma = src + width * height;
+	unsigned int x, y;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			unsigned int oc = (y / 2) * width + (x / 2) * 2;
+
+			pixels[y * width + x] =
+				float_pixel(src[y * width + x], chroma[oc],
+					    chroma[oc + 1]);
+		}
+	}
+
+	return 0;
+}
+
+static int yuyv_reference(uint8_t *dst, uint8_t *src, unsigned int width,
+			  unsigned int height)
+{
+	uint32_t *pixels = (uint32_t *)dst;
+	unsigned int x, y;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			uint8_t *block = src + y * width * 2 + (x / 2) * 4;
+
+			pixels[y * width + x] =
+				float_pixel(block[(x & 1) * 2], block[1],
+					    block[3]);
+		}
+	}
+
+	return 0;
+}
+
+static double bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_run(struct v4l2_bayer_bench_format *format,
+			uint8_t *dst, uint8_t *src, unsigned int length,
+			unsigned int width, unsigned int height,
+			unsigned int iterations, bool reference)
+{
+	double start;
+	unsigned int i;
+
+	start = bench_time();
+
+	for (i = 0; i < iterations; i++) {
+		if (reference)
+			format->reference(dst, src, width, height);
+		else
+			image_convert(dst, src, length, width, height,
+				      format->format, IMAGE_CONVERT_BILINEAR,
+				      IMAGE_CONVERT_OUTPUT_XRGB32, NULL, NULL);
+	}
+
+	return (bench_time() - start) / iterations;
+}
+
+struct v4l2_bayer_bench_writer {
+	char *name;
+	enum image_write_format format;
+	int level;
+	bool reference;
+};
+
+/* The cairo PNG writer, as used before the built-in writers. */
+static int cairo_reference(const char *path, uint32_t *pixels,
+			    unsigned int width, unsigned int height)
+{
+	cairo_surface_t *surface;
+	cairo_status_t status;
+
+	surface = cairo_image_surface_create_for_data((unsigned char *)pixels,
+						      CAIRO_FORMAT_RGB24, width,
+						      height, width * 4);
+	if (!surface)
+		return -ENOMEM;
+
+	status = cairo_surface_write_to_png(surface, path);
+
+	cairo_surface_destroy(surface);
+
+	return status == CAIRO_STATUS_SUCCESS ? 0 : -EIO;
+}
+
+static int bench_write(struct v4l2_bayer_bench_writer *writer,
+		       uint32_t *pixels, unsigned int width,
+		       unsigned int height, unsigned int iterations,
+		       unsigned int threads)
+{
+	enum image_write_format format = writer->format;
+	struct stat path_stat;
+	char path[32];
+	double start, duration;
+	unsigned int i;
+	int ret;
+
+	snprintf(path, sizeof(path), "bench.%s",
+		 image_write_extension(format));
+
+	start = bench_time();
+
+	for (i = 0; i < iterations; i++) {
+		if (writer->reference)
+			ret = cairo_reference(path, pixels, width, height);
+		else
+			ret = image_write(path, pixels, width, height, format,
+					  writer->level, threads);
+		if (ret)
+			return ret;
+	}
+
+	duration = (bench_time() - start) / iterations;
+
+	ret = stat(path, &path_stat);
+	if (ret)
+		return -errno;
+
+	printf("%-10s %8.2f ms %8.1f MPix/s %10lld bytes\n", writer->name,
+	       duration * 1e3, width * height / duration / 1e6,
+	       (long long)path_stat.st_size);
+
+	unlink(path);
+
+	return 0;
+}
+
+struct v4l2_bayer_bench_writer writers[] = {
+	{ "cairo",	IMAGE_WRITE_PNG,	6,	true },
+	{ "png-1",	IMAGE_WRITE_PNG,	1,	false },
+	{ "png-3",	IMAGE_WRITE_PNG,	3,	false },
+	{ "png-6",	IMAGE_WRITE_PNG,	6,	false },
+	{ "ppm",	IMAGE_WRITE_PPM,	0,	false },
+	{ "pam",	IMAGE_WRITE_PAM,	0,	false },
+	{ "qoi",	IMAGE_WRITE_QOI,	0,	false },
+};
+
+/*
+ * Writers are compared on a real frame, as dumped by the client, which is
+ * converted first.
+ */
+static int bench_writers(char *path, unsigned int width, unsigned int height,
+			 unsigned int format, unsigned int iterations,
+			 unsigned int threads)
+{
+	uint8_t *src = NULL;
+	uint32_t *pixels = NULL;
+	struct stat path_stat;
+	unsigned int i;
+	int fd = -1;
+	int ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	ret = fstat(fd, &path_stat);
+	if (ret) {
+		ret = -errno;
+		goto complete;
+	}
+
+	src = malloc(path_stat.st_size);
+	pixels = malloc(width * height * 4);
+	if (!src || !pixels) {
+		ret = -ENOMEM;
+		goto complete;
+	}
+
+	if (read(fd, src, path_stat.st_size) != path_stat.st_size) {
+		ret = -EIO;
+		goto complete;
+	}
+
+	ret = image_convert((uint8_t *)pixels, src, path_stat.st_size, width,
+			    height, format, IMAGE_CONVERT_BILINEAR,
+			    IMAGE_CONVERT_OUTPUT_XRGB32, NULL, NULL);
+	if (ret)
+		goto complete;
+
+	for (i = 0; i < ARRAY_SIZE(writers); i++) {
+		ret = bench_write(&writers[i], pixels, width, height,
+				  iterations, threads);
+		if (ret)
+			goto complete;
+	}
+
+complete:
+	free(src);
+	free(pixels);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Converter suite: every kernel of the registry is run on synthetic frames
+ * at each size and thread count. Rates are given in source pixels, so that
+ * binning compares with interpolation on the same frames.
+ *
+ * Cycles are counted by the CPU cycles counter, summed over all conversion
+ * threads, or estimated from the elapsed time stamp counter times the number
+ * of threads when the counter is not available.
+ */
+
+struct v4l2_bayer_bench_source {
+	char *name;
+	unsigned int format;
+	/* Sample bits of unpacked deep Bayer, zero for byte samples. */
+	unsigned int bits;
+};
+
+struct v4l2_bayer_bench_source sources[] = {
+	{ "bggr8",	V4L2_PIX_FMT_SBGGR8,	0 },
+	{ "rggb8",	V4L2_PIX_FMT_SRGGB8,	0 },
+	{ "gbrg8",	V4L2_PIX_FMT_SGBRG8,	0 },
+	{ "grbg8",	V4L2_PIX_FMT_SGRBG8,	0 },
+	{ "bggr10",	V4L2_PIX_FMT_SBGGR10,	10 },
+	{ "rggb10",	V4L2_PIX_FMT_SRGGB10,	10 },
+	{ "gbrg10",	V4L2_PIX_FMT_SGBRG10,	10 },
+	{ "grbg10",	V4L2_PIX_FMT_SGRBG10,	10 },
+	{ "bggr12",	V4L2_PIX_FMT_SBGGR12,	12 },
+	{ "rggb12",	V4L2_PIX_FMT_SRGGB12,	12 },
+	{ "gbrg12",	V4L2_PIX_FMT_SGBRG12,	12 },
+	{ "grbg12",	V4L2_PIX_FMT_SGRBG12,	12 },
+	{ "bggr16",	V4L2_PIX_FMT_SBGGR16,	16 },
+	{ "rggb16",	V4L2_PIX_FMT_SRGGB16,	16 },
+	{ "gbrg16",	V4L2_PIX_FMT_SGBRG16,	16 },
+	{ "grbg16",	V4L2_PIX_FMT_SGRBG16,	16 },
+	{ "bggr10p",	V4L2_PIX_FMT_SBGGR10P,	0 },
+	{ "rggb10p",	V4L2_PIX_FMT_SRGGB10P,	0 },
+	{ "gbrg10p",	V4L2_PIX_FMT_SGBRG10P,	0 },
+	{ "grbg10p",	V4L2_PIX_FMT_SGRBG10P,	0 },
+	{ "bggr12p",	V4L2_PIX_FMT_SBGGR12P,	0 },
+	{ "rggb12p",	V4L2_PIX_FMT_SRGGB12P,	0 },
+	{ "gbrg12p",	V4L2_PIX_FMT_SGBRG12P,	0 },
+	{ "grbg12p",	V4L2_PIX_FMT_SGRBG12P,	0 },
+	{ "nv12",	V4L2_PIX_FMT_NV12,	0 },
+	{ "nv21",	V4L2_PIX_FMT_NV21,	0 },
+	{ "nv16",	V4L2_PIX_FMT_NV16,	0 },
+	{ "nv61",	V4L2_PIX_FMT_NV61,	0 },
+	{ "yuv420",	V4L2_PIX_FMT_YUV420,	0 },
+	{ "yvu420",	V4L2_PIX_FMT_YVU420,	0 },
+	{ "yuv422p",	V4L2_PIX_FMT_YUV422P,	0 },
+	{ "uyvy",	V4L2_PIX_FMT_UYVY,	0 },
+	{ "yuyv",	V4L2_PIX_FMT_YUYV,	0 },
+};
+
+static const char *algorithm_names[] = {
+	[IMAGE_CONVERT_BILINEAR] = "bilinear",
+	[IMAGE_CONVERT_BINNING] = "binning",
+	[IMAGE_CONVERT_MALVAR] = "malvar",
+};
+
+static const char *output_names[] = {
+	[IMAGE_CONVERT_OUTPUT_XRGB32] = "xrgb32",
+	[IMAGE_CONVERT_OUTPUT_RGB24] = "rgb24",
+	[IMAGE_CONVERT_OUTPUT_BGR24] = "bgr24",
+	[IMAGE_CONVERT_OUTPUT_RGB565] = "rgb565",
+	[IMAGE_CONVERT_OUTPUT_RGB48] = "rgb48",
+};
+
+struct v4l2_bayer_bench_size suite_sizes[] = {
+	{ "vga",	640,	480 },
+	{ "1080p",	1920,	1080 },
+	{ "5mp",	2592,	1944 },
+};
+
+static int bench_cycles_open(void)
+{
+	struct perf_event_attr attr = { 0 };
+
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	/* Conversion threads are created afterwards and counted along. */
+	attr.inherit = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Cycles since an arbitrary origin, or zero when they cannot be counted. */
+static uint64_t bench_cycles(int cycles_fd, unsigned int threads)
+{
+	uint64_t count;
+
+	if (cycles_fd >= 0) {
+		if (read(cycles_fd, &count, sizeof(count)) == sizeof(count))
+			return count;
+
+		return 0;
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc() * threads;
+#else
+	return 0;
+#endif
+}
+
+/* Synthetic frames are noise, with deep samples kept within their depth. */
+static void bench_source_fill(struct v4l2_bayer_bench_source *source,
+			      uint8_t *src, unsigned int length)
+{
+	uint16_t *samples = (uint16_t *)src;
+	unsigned int i;
+
+	srand(0);
+
+	if (!source->bits) {
+		for (i = 0; i < length; i++)
+			src[i] = rand();
+		return;
+	}
+
+	for (i = 0; i < length / 2; i++)
+		samples[i] = rand() & ((1 << source->bits) - 1);
+}
+
+static int bench_kernel(struct v4l2_bayer_bench_size *size,
+			struct v4l2_bayer_bench_source *source,
+			enum image_convert_algorithm algorithm,
+			enum image_convert_output output, uint8_t *dst,
+			uint8_t *src, unsigned int length,
+			unsigned int iterations, unsigned int threads,
+			int cycles_fd, FILE *csv)
+{
+	unsigned int width = size->width;
+	unsigned int height = size->height;
+	const char *isa;
+	double start, duration, ns_pixel, cycles_pixel = 0;
+	uint64_t cycles_start, cycles;
+	unsigned int i;
+	int ret;
+
+	isa = image_convert_kernel_name(source->format, algorithm, output);
+	if (!isa)
+		return 0;
+
+	/* Warm up caches and the thread pool. */
+	ret = image_convert(dst, src, length, width, height, source->format,
+			    algorithm, output, NULL, NULL);
+	if (ret)
+		return ret;
+
+	cycles_start = bench_cycles(cycles_fd, threads);
+	start = bench_time();
+
+	for (i = 0; i < iterations; i++)
+		image_convert(dst, src, length, width, height, source->format,
+			      algorithm, output, NULL, NULL);
+
+	duration = (bench_time() - start) / iterations;
+	cycles = bench_cycles(cycles_fd, threads);
+
+	ns_pixel = duration * 1e9 / (width * height);
+	if (cycles && cycles_start)
+		cycles_pixel = (double)(cycles - cycles_start) / iterations /
+			       (width * height);
+
+	printf("%-6s %-8s %-9s %-7s %-6s %2u threads %8.2f ms %8.1f MPix/s "
+	       "%7.3f ns/px ", size->name, source->name,
+	       algorithm_names[algorithm], output_names[output], isa, threads,
+	       duration * 1e3, width * height / duration / 1e6, ns_pixel);
+
+	if (cycles_pixel)
+		printf("%7.2f cycles/px\n", cycles_pixel);
+	else
+		printf("%7s cycles/px\n", "-");
+
+	if (!csv)
+		return 0;
+
+	fprintf(csv, "%s,%u,%u,%s,%s,%s,%s,%u,%.4f,%.2f,%.4f,", size->name,
+		width, height, source->name, algorithm_names[algorithm],
+		output_names[output], isa, threads, duration * 1e3,
+		width * height / duration / 1e6, ns_pixel);
+
+	if (cycles_pixel)
+		fprintf(csv, "%.3f\n", cycles_pixel);
+	else
+		fprintf(csv, "\n");
+
+	return 0;
+}
+
+/* Thread counts are powers of two up to the given count, which comes last. */
+static int bench_suite(enum image_convert_output output,
+		       unsigned int iterations, unsigned int threads_max,
+		       const char *csv_path)
+{
+	unsigned int threads_counts[32];
+	unsigned int threads_count = 0;
+	uint8_t *src = NULL, *dst = NULL;
+	unsigned int i, j, k, t, threads;
+	FILE *csv = NULL;
+	int cycles_fd;
+	int ret = 0;
+
+	for (t = 1; t < threads_max && threads_count < 31; t *= 2)
+		threads_counts[threads_count++] = t;
+
+	threads_counts[threads_count++] = threads_max;
+
+	if (csv_path) {
+		csv = fopen(csv_path, "w");
+		if (!csv)
+			return -errno;
+
+		fprintf(csv, "size,width,height,format,algorithm,output,isa,"
+			"threads,ms,mpix_per_s,ns_per_pixel,cycles_per_pixel\n");
+	}
+
+	cycles_fd = bench_cycles_open();
+
+	for (i = 0; i < ARRAY_SIZE(suite_sizes); i++) {
+		struct v4l2_bayer_bench_size *size = &suite_sizes[i];
+		/* Sources hold up to two bytes per pixel. */
+		unsigned int length = size->width * size->height * 2;
+
+		src = malloc(length);
+		dst = malloc(size->width * size->height * 6);
+		if (!src || !dst) {
+			ret = -ENOMEM;
+			goto complete;
+		}
+
+		for (j = 0; j < ARRAY_SIZE(sources); j++) {
+			bench_source_fill(&sources[j], src, length);
+
+			for (t = 0; t < threads_count; t++) {
+				threads = threads_counts[t];
+
+				ret = image_convert_threads_setup(threads);
+				if (ret)
+					goto complete;
+
+				for (k = 0; k < IMAGE_CONVERT_ALGORITHM_COUNT;
+				     k++) {
+					ret = bench_kernel(size, &sources[j], k,
+							   output, dst, src,
+							   length, iterations,
+							   threads, cycles_fd,
+							   csv);
+					if (ret)
+						goto complete;
+				}
+			}
+		}
+
+		free(src);
+		free(dst);
+		src = NULL;
+		dst = NULL;
+	}
+
+complete:
+	free(src);
+	free(dst);
+
+	if (cycles_fd >= 0)
+		close(cycles_fd);
+
+	if (csv)
+		fclose(csv);
+
+	return ret;
+}
+
+struct v4l2_bayer_bench_size sizes[] = {
+	{ "1080p",	1920,	1080 },
+	{ "5mp",	2592,	1944 },
+};
+
+struct v4l2_bayer_bench_format formats[] = {
+	{ "nv12",	V4L2_PIX_FMT_NV12,	nv12_reference },
+	{ "yuyv",	V4L2_PIX_FMT_YUYV,	yuyv_reference },
+};
+
+/* The floating-point references are compared with the current converters. */
+static int bench_references(unsigned int iterations)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		unsigned int width = sizes[i].width;
+		unsigned int height = sizes[i].height;
+		unsigned int length = width * height * 2;
+		uint8_t *src, *dst;
+
+		src = malloc(length);
+		dst = malloc(width * height * 4);
+		if (!src || !dst) {
+			free(src);
+			free(dst);
+			return -ENOMEM;
+		}
+
+		srand(0);
+
+		for (j = 0; j < length; j++)
+			src[j] = rand();
+
+		for (j = 0; j < ARRAY_SIZE(formats); j++) {
+			double reference, current;
+
+			reference = bench_run(&formats[j], dst, src, length,
+					      width, height, iterations, true);
+			current = bench_run(&formats[j], dst, src, length,
+					    width, height, iterations, false);
+
+			printf("%-6s %-6s reference %8.2f ms %8.1f MPix/s, "
+			       "current %8.2f ms %8.1f MPix/s, speedup %.1fx\n",
+			       sizes[i].name, formats[j].name,
+			       reference * 1e3, width * height / reference / 1e6,
+			       current * 1e3, width * height / current / 1e6,
+			       reference / current);
+		}
+
+		free(src);
+		free(dst);
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	enum image_convert_output output = IMAGE_CONVERT_OUTPUT_XRGB32;
+	unsigned int iterations = 20;
+	unsigned int threads = 0;
+	unsigned int width = 2592, height = 1944;
+	unsigned int format = V4L2_PIX_FMT_SBGGR8;
+	char *write_path = NULL;
+	char *csv_path = NULL;
+	bool references = false;
+	unsigned int i;
+	int option = 0;
+	int ret;
+
+	while (option != -1) {
+		option = getopt(argc, argv, "n:j:r:w:h:f:o:c:R");
+		if (option < 0)
+			break;
+
+		switch (option) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'r':
+			write_path = optarg;
+			break;
+		case 'w':
+			width = atoi(optarg);
+			break;
+		case 'h':
+			height = atoi(optarg);
+			break;
+		case 'f':
+			if (strlen(optarg) != 4)
+				goto error;
+
+			format = v4l2_fourcc(optarg[0], optarg[1], optarg[2],
+					     optarg[3]);
+			break;
+		case 'o':
+			for (i = 0; i < IMAGE_CONVERT_OUTPUT_COUNT; i++)
+				if (!strcmp(optarg, output_names[i]))
+					break;
+
+			if (i == IMAGE_CONVERT_OUTPUT_COUNT)
+				goto error;
+
+			output = i;
+			break;
+		case 'c':
+			csv_path = optarg;
+			break;
+		case 'R':
+			references = true;
+			break;
+		}
+	}
+
+	if (!iterations)
+		goto error;
+
+	/* The suite goes up to all processors, other runs use one thread. */
+	if (!threads && !write_path && !references) {
+		long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = count > 0 ? count : 1;
+	} else if (!threads) {
+		threads = 1;
+	}
+
+	ret = image_convert_threads_setup(threads);
+	if (ret)
+		goto error;
+
+	if (write_path)
+		ret = bench_writers(write_path, width, height, format,
+				    iterations, threads);
+	else if (references)
+		ret = bench_references(iterations);
+	else
+		ret = bench_suite(output, iterations, threads, csv_path);
+
+	image_convert_threads_teardown();
+
+	if (ret)
+		goto error;
+
+	return 0;
+
+error:
+	return 1;
+}
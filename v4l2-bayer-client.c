@@ -1,9 +1,12 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 
 #include <netinet/in.h>
 #include <netdb.h>
@@ -14,12 +17,20 @@
 
 #include <linux/videodev2.h>
 
-#include <cairo.h>
-
 #include <v4l2-bayer-protocol.h>
+#include <v4l2-bayer-codec.h>
+
+#include <image-convert.h>
+#include <image-write.h>
 
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
 
+/*
+ * Fragments are large enough to keep calls few, while lines are still
+ * converted as fragments are received.
+ */
+#define FRAGMENT_SIZE	(256 * 1024)
+
 struct v4l2_bayer_client {
 	int fd;
 
@@ -30,6 +41,25 @@ struct v4l2_bayer_client {
 	void *rgb_buffer;
 	unsigned int rgb_length;
 
+	unsigned int compression;
+	struct v4l2_bayer_codec_decoder decoder;
+	unsigned char *codec_buffer;
+	unsigned int codec_length;
+	unsigned int codec_size;
+
+	struct image_convert_stream convert;
+	bool convert_used;
+
+	bool unchanged;
+
+	/* Frame in reception, as announced by the server. */
+	struct v4l2_bayer_capture_request request;
+	struct v4l2_bayer_frame_begin frame;
+	unsigned int frame_received;
+	bool frame_begun;
+
+	bool stream_stopped;
+
 	int dump_fd;
 };
 
@@ -41,6 +71,7 @@ struct v4l2_bayer_format {
 int v4l2_bayer_client_open(struct v4l2_bayer_client *client, char *host_name)
 {
 	struct sockaddr_in server_addr = { 0 };
+	struct timeval timeout = { .tv_sec = 2 };
 	struct hostent *host;
 	int fd = -1;
 	int ret;
@@ -70,6 +101,14 @@ int v4l2_bayer_client_open(struct v4l2_bayer_client *client, char *host_name)
 		goto error;
 	}
 
+	/* Reads fail instead of blocking when the server went away. */
+	ret = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			 sizeof(timeout));
+	if (ret) {
+		ret = -errno;
+		goto error;
+	}
+
 	client->fd = fd;
 
 	return 0;
@@ -92,85 +131,251 @@ int v4l2_bayer_client_close(struct v4l2_bayer_client *client)
 	return 0;
 }
 
+/* Fragments were received in place, following the previous ones. */
 static int frame_fragment_process(struct v4l2_bayer_client *client,
-				  void *buffer, unsigned int length)
+				  unsigned int length)
 {
-	if (client->dump_fd >= 0)
-		write(client->dump_fd, buffer, length);
+	unsigned char *raw = client->raw_buffer;
+	int ret;
 
-	if (client->raw_pointer) {
-		memcpy(client->raw_pointer, buffer, length);
+	/* Compressed fragments are decoded as whole bands are received. */
+	if (client->codec_buffer) {
+		client->codec_length += length;
+
+		ret = v4l2_bayer_codec_decode(&client->decoder,
+					      client->raw_buffer,
+					      client->codec_buffer,
+					      client->codec_length);
+		if (ret < 0)
+			return ret;
+
+		client->raw_pointer = raw + ret;
+	} else {
 		client->raw_pointer += length;
 	}
 
+	/* Convert lines as soon as their neighbours are received. */
+	if (client->convert_used)
+		image_convert_stream_update(&client->convert,
+					    client->raw_pointer - raw);
+
+	return 0;
+}
+
+/* Frames must match the request and fit the buffer they are received to. */
+static int frame_begin_process(struct v4l2_bayer_client *client,
+			       struct v4l2_bayer_frame_begin *begin)
+{
+	struct v4l2_bayer_capture_request *request = &client->request;
+	unsigned int size;
+
+	printf("Rx frame size %ux%u, format %#x, bytesperline %u, "
+	       "length %u\n", begin->width, begin->height, begin->format,
+	       begin->bytesperline, begin->length);
+
+	if (begin->width != request->width ||
+	    begin->height != request->height ||
+	    begin->format != request->format) {
+		printf("Frame does not match the request!\n");
+		return -EINVAL;
+	}
+
+	size = client->codec_buffer ? client->codec_size : client->raw_length;
+	if (begin->length > size)
+		return -EINVAL;
+
+	client->frame = *begin;
+	client->frame_received = 0;
+	client->frame_begun = true;
+
 	return 0;
 }
 
+/*
+ * Messages are read until the frame end, which follows the last fragment,
+ * or until the server reports an unchanged scene. Fragment payloads are
+ * received straight to their place in the raw or compressed frame buffer.
+ */
 static int frame_fragments_read(struct v4l2_bayer_client *client)
 {
 	struct v4l2_bayer_message message;
 	struct v4l2_bayer_frame_fragment fragment;
-	struct timeval timeout = { 0 };
-	unsigned int length = V4L2_BAYER_FRAME_FRAGMENT_SIZE;
-	void *buffer;
+	struct v4l2_bayer_frame_begin begin;
+	struct v4l2_bayer_frame_end end;
+	unsigned char *destination;
+	struct iovec iov[2];
+	unsigned int length;
 	int ret = -1;
 
-	buffer = malloc(length);
+	client->frame_begun = false;
 
 	do {
-		timeout.tv_sec = 2;
-		timeout.tv_usec = 0;
-
-		ret = v4l2_bayer_data_read_poll(client->fd, &timeout);
-		if (ret <= 0)
-			break;
-
 		ret = v4l2_bayer_data_read(client->fd, &message,
 					   sizeof(message));
 		if (ret <= 0)
-			goto complete;
-
-		if (message.id != V4L2_BAYER_FRAME_FRAGMENT ||
-		    message.length < sizeof(struct v4l2_bayer_frame_fragment))
-			return -EINVAL;
+			goto error;
 
-		ret = v4l2_bayer_data_read(client->fd, &fragment,
-					   sizeof(fragment));
-		if (ret <= 0)
+		switch (message.id) {
+		case V4L2_BAYER_STREAM_STOP:
+			client->stream_stopped = true;
+			ret = 0;
+			goto complete;
+		case V4L2_BAYER_FRAME_UNCHANGED:
+			client->unchanged = true;
+			ret = 0;
 			goto complete;
+		case V4L2_BAYER_FRAME_BEGIN:
+			if (message.length < sizeof(begin)) {
+				ret = -EINVAL;
+				goto complete;
+			}
 
-		if (length < fragment.length) {
-			length = fragment.length;
-			buffer = realloc(buffer, length);
-		}
+			ret = v4l2_bayer_data_read(client->fd, &begin,
+						   sizeof(begin));
+			if (ret <= 0)
+				goto error;
 
-		ret = v4l2_bayer_data_read_poll(client->fd, &timeout);
-		if (ret <= 0)
+			ret = frame_begin_process(client, &begin);
+			if (ret)
+				goto complete;
 			break;
+		case V4L2_BAYER_FRAME_END:
+			if (message.length < sizeof(end)) {
+				ret = -EINVAL;
+				goto complete;
+			}
 
-		ret = v4l2_bayer_data_read(client->fd, buffer, fragment.length);
-		if (ret <= 0)
+			ret = v4l2_bayer_data_read(client->fd, &end,
+						   sizeof(end));
+			if (ret <= 0)
+				goto error;
+
+			if (end.status < 0) {
+				printf("Frame capture failed!\n");
+				ret = end.status;
+			} else if (!client->frame_begun ||
+				   client->frame_received <
+				   client->frame.length) {
+				ret = -EIO;
+			} else {
+				ret = 0;
+			}
 			goto complete;
+		case V4L2_BAYER_FRAME_FRAGMENT:
+			if (message.length < sizeof(fragment) ||
+			    !client->frame_begun) {
+				ret = -EINVAL;
+				goto complete;
+			}
+
+			length = message.length - sizeof(fragment);
+			if (length > client->frame.length -
+				     client->frame_received) {
+				ret = -EINVAL;
+				goto complete;
+			}
+
+			destination = client->codec_buffer ?
+				      client->codec_buffer :
+				      client->raw_buffer;
+
+			iov[0].iov_base = &fragment;
+			iov[0].iov_len = sizeof(fragment);
+			iov[1].iov_base = destination + client->frame_received;
+			iov[1].iov_len = length;
+
+			ret = v4l2_bayer_data_readv(client->fd, iov,
+						    ARRAY_SIZE(iov));
+			if (ret <= 0)
+				goto error;
+
+			if (fragment.length != length) {
+				ret = -EINVAL;
+				goto complete;
+			}
 
 /*
-		printf("Rx fragment %u length %u\n", fragment.serial,
-		       fragment.length);
+			printf("Rx fragment %u length %u\n", fragment.serial,
+			       fragment.length);
 */
 
-		ret = frame_fragment_process(client, buffer, fragment.length);
-		if (ret < 0)
+			client->frame_received += fragment.length;
+
+			ret = frame_fragment_process(client, fragment.length);
+			if (ret < 0)
+				goto complete;
+			break;
+		default:
+			ret = -EINVAL;
 			goto complete;
+		}
 	} while (1);
 
-	ret = 0;
+error:
+	/* Reads time out when the server went away. */
+	if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+		ret = -ETIMEDOUT;
+
+	ret = ret ? ret : -EIO;
 
 complete:
-	if (buffer)
-		free(buffer);
-
 	return ret;
 }
 
+/* Frames are received from the start of the buffers, for each of them. */
+static int frame_receive_prepare(struct v4l2_bayer_client *client)
+{
+	struct v4l2_bayer_capture_request *request = &client->request;
+	int ret;
+
+	client->raw_pointer = client->raw_buffer;
+	client->codec_length = 0;
+	client->unchanged = false;
+	client->stream_stopped = false;
+
+	if (client->codec_buffer) {
+		ret = v4l2_bayer_codec_decode_start(&client->decoder,
+						    request->width,
+						    request->height,
+						    request->format);
+		if (ret)
+			return ret;
+	}
+
+	if (client->convert_used) {
+		ret = image_convert_stream_restart(&client->convert);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int frame_receive_finish(struct v4l2_bayer_client *client)
+{
+	unsigned char *raw = client->raw_buffer;
+	int ret;
+
+	if (client->codec_buffer &&
+	    client->decoder.lines < client->decoder.height) {
+		printf("Compressed frame incomplete!\n");
+		return -EIO;
+	}
+
+	/* Dumps are written from the frame buffer, as decoded. */
+	if (client->dump_fd >= 0) {
+		ret = v4l2_bayer_data_write(client->dump_fd, raw,
+					    client->raw_pointer - raw);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (client->convert_used)
+		image_convert_stream_finish(&client->convert);
+
+	return 0;
+}
+
 static int capture_request(struct v4l2_bayer_client *client, unsigned int width,
 			   unsigned int height, unsigned int format)
 {
@@ -190,12 +395,53 @@ static int capture_request(struct v4l2_bayer_client *client, unsigned int width,
 	if (ret < 0)
 		return ret;
 
+	client->request = request;
+
 	printf("Tx capture request size %ux%u, format %#x\n", request.width,
 	       request.height, request.format);
 
 	return 0;
 }
 
+static int session_setup(struct v4l2_bayer_client *client,
+			 unsigned int compression, unsigned int fragment_size)
+{
+	struct v4l2_bayer_session_setup setup = {
+		.compression = compression,
+		.fragment_size = fragment_size,
+	};
+	struct v4l2_bayer_message message;
+	int ret;
+
+	ret = v4l2_bayer_message_write(client->fd, V4L2_BAYER_SESSION_SETUP,
+				       sizeof(setup));
+	if (ret < 0)
+		return ret;
+
+	ret = v4l2_bayer_data_write(client->fd, &setup, sizeof(setup));
+	if (ret < 0)
+		return ret;
+
+	ret = v4l2_bayer_data_read(client->fd, &message, sizeof(message));
+	if (ret <= 0)
+		return -EIO;
+
+	if (message.id != V4L2_BAYER_SESSION_SETUP ||
+	    message.length < sizeof(setup))
+		return -EINVAL;
+
+	ret = v4l2_bayer_data_read(client->fd, &setup, sizeof(setup));
+	if (ret <= 0)
+		return -EIO;
+
+	client->compression = setup.compression;
+
+	printf("Session compression %u, fragment size %u\n",
+	       client->compression, setup.fragment_size);
+
+	return 0;
+}
+
 static int stream_start(struct v4l2_bayer_client *client, unsigned int width,
 		     unsigned int height, unsigned int format)
 {
@@ -215,6 +461,14 @@ static int stream_start(struct v4l2_bayer_client *client, unsigned int width,
 	if (ret < 0)
 		return ret;
 
+	/* Streamed frames are checked against the stream setup. */
+	client->request.width = width;
+	client->request.height = height;
+	client->request.format = format;
+
+	printf("Tx stream start size %ux%u, format %#x\n", width, height,
+	       format);
+
 	return 0;
 }
 
@@ -229,27 +483,112 @@ static int stream_stop(struct v4l2_bayer_client *client)
 	return 0;
 }
 
-#include "image-convert.c"
+static volatile sig_atomic_t stream_interrupted;
+
+static void stream_interrupt(int signal)
+{
+	stream_interrupted = 1;
+}
 
-void image_write(char *path, void *rgb_data, unsigned int width, unsigned int height)
+/*
+ * Streamed frames are received until the count is reached, or until the
+ * stream is interrupted, and then until the server answers the stop since
+ * frames may still be in flight. Dumps hold all received frames in a row.
+ */
+static int stream_frames_read(struct v4l2_bayer_client *client,
+			      unsigned int count)
 {
-	cairo_surface_t *surface = NULL;
+	struct v4l2_bayer_frame_begin *frame = &client->frame;
+	uint64_t timestamp_first = 0;
+	uint64_t timestamp_last = 0;
+	unsigned int received = 0;
+	unsigned int frames = 0;
+	bool stopping = false;
+	int ret;
+
+	signal(SIGINT, stream_interrupt);
+
+	while (1) {
+		if (!stopping && (stream_interrupted ||
+				  (count && frames >= count))) {
+			ret = stream_stop(client);
+			if (ret)
+				return ret;
+
+			stopping = true;
+		}
+
+		ret = frame_receive_prepare(client);
+		if (ret)
+			return ret;
+
+		ret = frame_fragments_read(client);
+		if (ret)
+			return ret;
+
+		if (client->stream_stopped)
+			break;
+
+		frames++;
 
-	surface = cairo_image_surface_create_for_data(rgb_data, CAIRO_FORMAT_RGB24, width, height, width * 4);
-	if (!surface)
-		return;
+		/* The previous output is kept for unchanged scenes. */
+		if (client->unchanged) {
+			printf("Frame unchanged!\n");
+			continue;
+		}
 
-	cairo_surface_write_to_png(surface, path);
+		ret = frame_receive_finish(client);
+		if (ret)
+			return ret;
 
-	cairo_surface_destroy(surface);
+		if (!received)
+			timestamp_first = frame->timestamp;
+
+		timestamp_last = frame->timestamp;
+		received++;
+
+		printf("Rx frame sequence %u, timestamp %llu us\n",
+		       frame->sequence,
+		       (unsigned long long)frame->timestamp / 1000);
+	}
+
+	printf("Stream received %u frames", received);
+
+	if (received > 1 && timestamp_last > timestamp_first)
+		printf(", %.2f fps", (received - 1) * 1e9 /
+				     (timestamp_last - timestamp_first));
+
+	printf("\n");
+
+	return received;
 }
 
 struct v4l2_bayer_format formats[] = {
 	/* Bayer */
 	{ "bggr8",	V4L2_PIX_FMT_SBGGR8 },
+	{ "gbrg8",	V4L2_PIX_FMT_SGBRG8 },
+	{ "grbg8",	V4L2_PIX_FMT_SGRBG8 },
 	{ "rggb8",	V4L2_PIX_FMT_SRGGB8 },
 	{ "bggr10",	V4L2_PIX_FMT_SBGGR10 },
+	{ "gbrg10",	V4L2_PIX_FMT_SGBRG10 },
+	{ "grbg10",	V4L2_PIX_FMT_SGRBG10 },
 	{ "rggb10",	V4L2_PIX_FMT_SRGGB10 },
+	{ "bggr12",	V4L2_PIX_FMT_SBGGR12 },
+	{ "gbrg12",	V4L2_PIX_FMT_SGBRG12 },
+	{ "grbg12",	V4L2_PIX_FMT_SGRBG12 },
+	{ "rggb12",	V4L2_PIX_FMT_SRGGB12 },
+	{ "bggr16",	V4L2_PIX_FMT_SBGGR16 },
+	{ "gbrg16",	V4L2_PIX_FMT_SGBRG16 },
+	{ "grbg16",	V4L2_PIX_FMT_SGRBG16 },
+	{ "rggb16",	V4L2_PIX_FMT_SRGGB16 },
+	{ "bggr10p",	V4L2_PIX_FMT_SBGGR10P },
+	{ "gbrg10p",	V4L2_PIX_FMT_SGBRG10P },
+	{ "grbg10p",	V4L2_PIX_FMT_SGRBG10P },
+	{ "rggb10p",	V4L2_PIX_FMT_SRGGB10P },
+	{ "bggr12p",	V4L2_PIX_FMT_SBGGR12P },
+	{ "gbrg12p",	V4L2_PIX_FMT_SGBRG12P },
+	{ "grbg12p",	V4L2_PIX_FMT_SGRBG12P },
+	{ "rggb12p",	V4L2_PIX_FMT_SRGGB12P },
 	/* YUV420 */
 	{ "nv12",	V4L2_PIX_FMT_NV12 },
 	{ "nv21",	V4L2_PIX_FMT_NV21 },
@@ -263,6 +602,16 @@ struct v4l2_bayer_format formats[] = {
 	{ "yuv422p",	V4L2_PIX_FMT_YUV422P },
 };
 
+void stats_print(struct image_convert_stats *stats)
+{
+	static const char *names[] = { "R", "Gr", "Gb", "B" };
+	unsigned int c;
+
+	for (c = 0; c < IMAGE_CONVERT_CHANNEL_COUNT; c++)
+		printf("%-2s mean %5u, clipped %u/%u\n", names[c],
+		       stats->means[c], stats->clipped[c], stats->counts[c]);
+}
+
 int main(int argc, char *argv[])
 {
 	struct v4l2_bayer_client client = {
@@ -271,10 +620,34 @@ int main(int argc, char *argv[])
 	};
 	char *host_name = strdup("localhost");
 	unsigned int width, height, format;
+	enum image_convert_algorithm algorithm = IMAGE_CONVERT_BILINEAR;
+	struct image_convert_isp isp = {
+		.bayer = {
+			.offset_r = 32,
+			.offset_gr = 32,
+			.offset_gb = 32,
+			.offset_b = 32,
+			.gain_r = 256,
+			.gain_gr = 256,
+			.gain_gb = 256,
+			.gain_b = 256,
+		},
+	};
+	bool isp_used = false;
+	struct image_convert_stats stats = { 0 };
+	bool stats_used = false;
+	enum image_write_format write_format = IMAGE_WRITE_PNG;
+	int write_level = Z_BEST_SPEED;
+	char write_path[16];
+	unsigned int threads = 1;
+	unsigned int scale;
 	unsigned int command;
 	unsigned int i;
 	int option = 0;
 	bool dump = false;
+	bool compression_used = false;
+	unsigned int fragment_size = FRAGMENT_SIZE;
+	unsigned int stream_count = 0;
 	int ret;
 
 	width = 2592;
@@ -283,7 +656,7 @@ int main(int argc, char *argv[])
 	command = V4L2_BAYER_CAPTURE_REQUEST;
 
 	while (option != -1) {
-		option = getopt(argc, argv, "w:h:f:r:");
+		option = getopt(argc, argv, "w:h:f:r:j:bmiso:z:cF:dn:");
 		if (option < 0)
 			break;
 
@@ -308,13 +681,52 @@ int main(int argc, char *argv[])
 		case 'r':
 			host_name = strdup(optarg);
 			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'b':
+			algorithm = IMAGE_CONVERT_BINNING;
+			break;
+		case 'm':
+			algorithm = IMAGE_CONVERT_MALVAR;
+			break;
+		case 'i':
+			isp_used = true;
+			break;
+		case 's':
+			stats_used = true;
+			break;
+		case 'o':
+			ret = image_write_format_find(optarg);
+			if (ret < 0)
+				goto error;
+
+			write_format = ret;
+			break;
+		case 'z':
+			write_level = atoi(optarg);
+			break;
+		case 'c':
+			compression_used = true;
+			break;
+		case 'F':
+			/* Zero asks for whole frames. */
+			fragment_size = atoi(optarg);
+			break;
+		case 'd':
+			dump = true;
+			break;
+		case 'n':
+			/* Zero streams until interrupted. */
+			stream_count = atoi(optarg);
+			break;
 		}
 	}
 
 	if (optind < argc) {
 		if (!strcmp(argv[optind], "request"))
 			command = V4L2_BAYER_CAPTURE_REQUEST;
-		else if (!strcmp(argv[optind], "stream-start"))
+		else if (!strcmp(argv[optind], "stream"))
 			command = V4L2_BAYER_STREAM_START;
 		else if (!strcmp(argv[optind], "stream-stop"))
 			command = V4L2_BAYER_STREAM_STOP;
@@ -322,24 +734,59 @@ int main(int argc, char *argv[])
 			printf("Invalid command, using default.\n");
 	}
 
+	ret = image_convert_threads_setup(threads);
+	if (ret)
+		goto error;
+
 	ret = v4l2_bayer_client_open(&client, host_name);
 	if (ret)
 		goto error;
 
 	free(host_name);
 
+	ret = session_setup(&client, compression_used ?
+			    V4L2_BAYER_COMPRESSION_BAYER :
+			    V4L2_BAYER_COMPRESSION_NONE, fragment_size);
+	if (ret)
+		goto error;
+
 	switch (command) {
 	case V4L2_BAYER_CAPTURE_REQUEST:
+	case V4L2_BAYER_STREAM_START:
 		switch (format) {
 		/* Bayer */
 		case V4L2_PIX_FMT_SBGGR8:
+		case V4L2_PIX_FMT_SGBRG8:
+		case V4L2_PIX_FMT_SGRBG8:
 		case V4L2_PIX_FMT_SRGGB8:
 			client.raw_length = width * height;
 			break;
 		case V4L2_PIX_FMT_SBGGR10:
+		case V4L2_PIX_FMT_SGBRG10:
+		case V4L2_PIX_FMT_SGRBG10:
 		case V4L2_PIX_FMT_SRGGB10:
+		case V4L2_PIX_FMT_SBGGR12:
+		case V4L2_PIX_FMT_SGBRG12:
+		case V4L2_PIX_FMT_SGRBG12:
+		case V4L2_PIX_FMT_SRGGB12:
+		case V4L2_PIX_FMT_SBGGR16:
+		case V4L2_PIX_FMT_SGBRG16:
+		case V4L2_PIX_FMT_SGRBG16:
+		case V4L2_PIX_FMT_SRGGB16:
 			client.raw_length = width * height * 2;
 			break;
+		case V4L2_PIX_FMT_SBGGR10P:
+		case V4L2_PIX_FMT_SGBRG10P:
+		case V4L2_PIX_FMT_SGRBG10P:
+		case V4L2_PIX_FMT_SRGGB10P:
+			client.raw_length = width * height * 5 / 4;
+			break;
+		case V4L2_PIX_FMT_SBGGR12P:
+		case V4L2_PIX_FMT_SGBRG12P:
+		case V4L2_PIX_FMT_SGRBG12P:
+		case V4L2_PIX_FMT_SRGGB12P:
+			client.raw_length = width * height * 3 / 2;
+			break;
 		/* YUV420 */
 		case V4L2_PIX_FMT_NV12:
 		case V4L2_PIX_FMT_NV21:
@@ -361,6 +808,20 @@ int main(int argc, char *argv[])
 		client.raw_buffer = malloc(client.raw_length);
 		client.raw_pointer = client.raw_buffer;
 
+		if (client.compression == V4L2_BAYER_COMPRESSION_BAYER &&
+		    v4l2_bayer_codec_depth(format) > 0) {
+			client.codec_size = v4l2_bayer_codec_bound(width,
+								   height,
+								   format);
+			client.codec_buffer = malloc(client.codec_size);
+
+			ret = v4l2_bayer_codec_decode_start(&client.decoder,
+							    width, height,
+							    format);
+			if (ret)
+				goto error;
+		}
+
 		client.rgb_length = width * height * 4;
 		client.rgb_buffer = malloc(client.rgb_length);
 
@@ -371,36 +832,105 @@ int main(int argc, char *argv[])
 				goto error;
 		}
 
-		ret = capture_request(&client, width, height, format);
-		if (ret)
-			goto error;
+		/* Sample correction only applies to Bayer formats. */
+		if (isp_used) {
+			if (image_convert_format_bayer(format))
+				isp.modules_used = IMAGE_CONVERT_ISP_BAYER;
 
-		printf("Capture requested!\n");
+			image_convert_isp_gamma(&isp, 2.2);
+		}
 
-		ret = frame_fragments_read(&client);
-		if (ret)
-			goto error;
+		/* DNG frames are written from the raw buffer, as received. */
+		client.convert_used = write_format != IMAGE_WRITE_DNG;
+
+		if (client.convert_used) {
+			ret = image_convert_stream_start(&client.convert,
+							 client.rgb_buffer,
+							 client.raw_buffer,
+							 client.raw_length,
+							 width, height, format,
+							 algorithm,
+							 IMAGE_CONVERT_OUTPUT_XRGB32,
+							 isp_used ? &isp : NULL,
+							 stats_used ?
+							 &stats : NULL);
+			if (ret)
+				goto error;
+		}
 
-		printf("Frame fragments read done!\n");
+		/* Streams are written out from their last received frame. */
+		if (command == V4L2_BAYER_STREAM_START) {
+			ret = stream_start(&client, width, height, format);
+			if (ret)
+				goto error;
 
-		image_convert(client.rgb_buffer, client.raw_buffer, client.raw_length,
-			      width, height, format);
+			printf("Stream on requested!\n");
 
-		printf("Image convert done!\n");
+			ret = stream_frames_read(&client, stream_count);
+			if (ret < 0)
+				goto error;
 
-		image_write("frame.png", client.rgb_buffer, width, height);
+			printf("Stream off done!\n");
 
-		printf("Image write done!\n");
+			if (!ret) {
+				if (dump)
+					close(client.dump_fd);
+				break;
+			}
+		} else {
+			ret = capture_request(&client, width, height, format);
+			if (ret)
+				goto error;
 
-		if (dump)
-			close(client.dump_fd);
-		break;
-	case V4L2_BAYER_STREAM_START:
-		ret = stream_start(&client, width, height, format);
+			printf("Capture requested!\n");
+
+			ret = frame_fragments_read(&client);
+			if (ret)
+				goto error;
+
+			printf("Frame fragments read done!\n");
+
+			/* The previous output is kept for unchanged scenes. */
+			if (client.unchanged) {
+				printf("Frame unchanged!\n");
+
+				if (dump)
+					close(client.dump_fd);
+				break;
+			}
+
+			ret = frame_receive_finish(&client);
+			if (ret)
+				goto error;
+		}
+
+		snprintf(write_path, sizeof(write_path), "frame.%s",
+			 image_write_extension(write_format));
+
+		if (client.convert_used) {
+			printf("Image convert done!\n");
+
+			if (stats_used)
+				stats_print(&stats);
+
+			scale = algorithm == IMAGE_CONVERT_BINNING ? 2 : 1;
+
+			ret = image_write(write_path, client.rgb_buffer,
+					  width / scale, height / scale,
+					  write_format, write_level, threads);
+		} else {
+			ret = image_write_dng(write_path, client.raw_buffer,
+					      client.raw_length, width, height,
+					      format,
+					      isp_used ? isp.bayer.offset_r : 0);
+		}
 		if (ret)
 			goto error;
 
-		printf("Stream on requested!\n");
+		printf("Image write done!\n");
+
+		if (dump)
+			close(client.dump_fd);
 		break;
 	case V4L2_BAYER_STREAM_STOP:
 		ret = stream_stop(&client);
@@ -415,6 +945,8 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto error;
 
+	image_convert_threads_teardown();
+
 	return 0;
 
 error:
@@ -0,0 +1,568 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <linux/videodev2.h>
+
+#include <v4l2-bayer-codec.h>
+
+/*
+ * Each sample is predicted from the left, up and up-left samples of the same
+ * colour, two samples away, with the median edge detector of LOCO-I. Folded
+ * residuals are Rice coded with a parameter adapted to the running mean of
+ * each context, selected by CFA position and local activity. Unary prefixes
+ * are limited, longer codes escape to the residual as it is.
+ *
+ * Each band starts with a little-endian 32-bit header holding the length of
+ * its payload. Prediction refers to lines of previous bands but contexts are
+ * reset, so that bands can be coded independently. Bands that do not shrink
+ * are stored as they are instead.
+ */
+
+#define codec_inline	static inline __attribute__((always_inline))
+
+#define CODEC_ACTIVITY_COUNT	16
+#define CODEC_MEAN_SHIFT	4
+#define CODEC_LIMIT		24
+#define CODEC_HEADER_SIZE	4
+
+struct codec_context {
+	uint32_t mean;
+};
+
+struct codec_contexts {
+	struct codec_context contexts[4][CODEC_ACTIVITY_COUNT];
+};
+
+struct codec_writer {
+	uint64_t value;
+	unsigned int count;
+	uint8_t *pointer;
+	uint8_t *end;
+	bool overflow;
+};
+
+struct codec_reader {
+	const uint8_t *start;
+	const uint8_t *end;
+	unsigned long position;
+};
+
+int v4l2_bayer_codec_depth(unsigned int format)
+{
+	switch (format) {
+	case V4L2_PIX_FMT_SBGGR8:
+	case V4L2_PIX_FMT_SGBRG8:
+	case V4L2_PIX_FMT_SGRBG8:
+	case V4L2_PIX_FMT_SRGGB8:
+		return 1;
+	case V4L2_PIX_FMT_SBGGR10:
+	case V4L2_PIX_FMT_SGBRG10:
+	case V4L2_PIX_FMT_SGRBG10:
+	case V4L2_PIX_FMT_SRGGB10:
+	case V4L2_PIX_FMT_SBGGR12:
+	case V4L2_PIX_FMT_SGBRG12:
+	case V4L2_PIX_FMT_SGRBG12:
+	case V4L2_PIX_FMT_SRGGB12:
+	case V4L2_PIX_FMT_SBGGR16:
+	case V4L2_PIX_FMT_SGBRG16:
+	case V4L2_PIX_FMT_SGRBG16:
+	case V4L2_PIX_FMT_SRGGB16:
+		return 2;
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Largest coded frame, with all bands stored. */
+unsigned int v4l2_bayer_codec_bound(unsigned int width, unsigned int height,
+				    unsigned int format)
+{
+	unsigned int bands;
+	int depth;
+
+	depth = v4l2_bayer_codec_depth(format);
+	if (depth < 0)
+		return 0;
+
+	bands = (height + V4L2_BAYER_CODEC_BAND_LINES - 1) /
+		V4L2_BAYER_CODEC_BAND_LINES;
+
+	return width * height * depth + bands * CODEC_HEADER_SIZE;
+}
+
+codec_inline void codec_contexts_reset(struct codec_contexts *contexts)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < CODEC_ACTIVITY_COUNT; j++)
+			contexts->contexts[i][j].mean = 4 << CODEC_MEAN_SHIFT;
+	}
+}
+
+codec_inline unsigned int codec_sample(const uint8_t *row, unsigned int x,
+				       unsigned int depth)
+{
+	if (depth == 1)
+		return row[x];
+
+	return ((const uint16_t *)row)[x];
+}
+
+codec_inline void codec_sample_store(uint8_t *row, unsigned int x,
+				     unsigned int depth, unsigned int value)
+{
+	if (depth == 1)
+		row[x] = value;
+	else
+		((uint16_t *)row)[x] = value;
+}
+
+/* Neighbours missing at the top and left edges repeat the available ones. */
+codec_inline unsigned int codec_predict(const uint8_t *row, const uint8_t *up,
+					unsigned int x, unsigned int depth,
+					unsigned int *activity)
+{
+	unsigned int left, top, corner, low, high;
+	int gradient;
+
+	if (up && x >= 2) {
+		left = codec_sample(row, x - 2, depth);
+		top = codec_sample(up, x, depth);
+		corner = codec_sample(up, x - 2, depth);
+	} else if (up) {
+		left = top = corner = codec_sample(up, x, depth);
+	} else if (x >= 2) {
+		left = top = corner = codec_sample(row, x - 2, depth);
+	} else {
+		left = top = corner = 1U << (depth * 8 - 1);
+	}
+
+	gradient = (int)left - (int)corner;
+	*activity = gradient < 0 ? -gradient : gradient;
+	gradient = (int)top - (int)corner;
+	*activity += gradient < 0 ? -gradient : gradient;
+
+	/* The median edge detector is the median of left, top and gradient. */
+	gradient = (int)left + (int)top - (int)corner;
+	low = left < top ? left : top;
+	high = left < top ? top : left;
+	gradient = gradient < (int)high ? gradient : (int)high;
+
+	return gradient > (int)low ? (unsigned int)gradient : low;
+}
+
+codec_inline struct codec_context *codec_context(struct codec_contexts *contexts,
+						 unsigned int x, unsigned int y,
+						 unsigned int activity)
+{
+	unsigned int bucket = activity ? 32 - __builtin_clz(activity) : 0;
+
+	if (bucket >= CODEC_ACTIVITY_COUNT)
+		bucket = CODEC_ACTIVITY_COUNT - 1;
+
+	return &contexts->contexts[(y & 1) * 2 + (x & 1)][bucket];
+}
+
+/*
+ * The parameter is the bit length of half the running mean, close to the
+ * best one for geometrically distributed residuals.
+ */
+codec_inline unsigned int codec_context_parameter(struct codec_context *context)
+{
+	uint32_t mean = context->mean >> (CODEC_MEAN_SHIFT + 1);
+
+	return mean ? 32 - __builtin_clz(mean) : 0;
+}
+
+/* Running mean with exponential decay, scaled up by its decay factor. */
+codec_inline void codec_context_update(struct codec_context *context,
+				       unsigned int folded)
+{
+	context->mean += folded - (context->mean >> CODEC_MEAN_SHIFT);
+}
+
+/* Residuals wrap around the sample range and are folded to positive. */
+codec_inline unsigned int codec_fold(unsigned int sample, unsigned int predicted,
+				     unsigned int depth)
+{
+	int residual;
+
+	if (depth == 1)
+		residual = (int8_t)(sample - predicted);
+	else
+		residual = (int16_t)(sample - predicted);
+
+	return (unsigned int)(residual * 2) ^ (unsigned int)(residual >> 31);
+}
+
+codec_inline unsigned int codec_unfold(unsigned int folded,
+				       unsigned int predicted,
+				       unsigned int depth)
+{
+	unsigned int residual = (folded >> 1) ^ -(folded & 1);
+
+	return (predicted + residual) & ((1U << (depth * 8)) - 1);
+}
+
+codec_inline void codec_be64_store(uint8_t *data, uint64_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	value = __builtin_bswap64(value);
+#endif
+	memcpy(data, &value, sizeof(value));
+}
+
+codec_inline uint64_t codec_be64_load(const uint8_t *data)
+{
+	uint64_t value;
+
+	memcpy(&value, data, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	value = __builtin_bswap64(value);
+#endif
+	return value;
+}
+
+/*
+ * Codes are at most 56 bits. Whole bytes are written out after each code
+ * with a single 64-bit store, which may spill past them, except close to
+ * the end of the payload.
+ */
+codec_inline void codec_write(struct codec_writer *writer, uint64_t value,
+			      unsigned int count)
+{
+	writer->value = (writer->value << count) | value;
+	writer->count += count;
+
+	if (writer->pointer + 8 <= writer->end) {
+		codec_be64_store(writer->pointer,
+				 writer->value << (64 - writer->count));
+		writer->pointer += writer->count / 8;
+		writer->count %= 8;
+		return;
+	}
+
+	while (writer->count >= 8) {
+		writer->count -= 8;
+
+		if (writer->pointer == writer->end) {
+			writer->overflow = true;
+			return;
+		}
+
+		*writer->pointer++ = writer->value >> writer->count;
+	}
+}
+
+/* Pad to a byte boundary, which writes the remaining bits. */
+static void codec_write_flush(struct codec_writer *writer)
+{
+	if (writer->count && !writer->overflow)
+		codec_write(writer, 0, 8 - writer->count);
+}
+
+/*
+ * Codes are read from a single 64-bit load holding at least 57 bits. Past
+ * the end of the payload, zeros are loaded and fail to decode.
+ */
+codec_inline uint64_t codec_read_peek(struct codec_reader *reader)
+{
+	const uint8_t *pointer = reader->start + reader->position / 8;
+	uint64_t value = 0;
+	unsigned int i;
+
+	if (pointer + 8 <= reader->end) {
+		value = codec_be64_load(pointer);
+	} else {
+		for (i = 0; i < 8; i++)
+			value = value << 8 | (pointer + i < reader->end ?
+					      pointer[i] : 0);
+	}
+
+	return value << (reader->position % 8);
+}
+
+codec_inline void codec_residual_write(struct codec_writer *writer,
+				       unsigned int folded, unsigned int k,
+				       unsigned int depth)
+{
+	unsigned int quotient = folded >> k;
+
+	/* Unary quotient, ended by a set bit, then the k low bits. */
+	if (quotient < CODEC_LIMIT)
+		codec_write(writer, (1U << k) | (folded & ((1U << k) - 1)),
+			    quotient + 1 + k);
+	else
+		codec_write(writer, (1U << (depth * 8)) | folded,
+			    CODEC_LIMIT + 1 + depth * 8);
+}
+
+codec_inline int codec_residual_read(struct codec_reader *reader,
+				     unsigned int k, unsigned int depth,
+				     unsigned int *folded)
+{
+	uint64_t value = codec_read_peek(reader);
+	unsigned int quotient;
+
+	if (!value)
+		return -EINVAL;
+
+	quotient = __builtin_clzll(value);
+	if (quotient > CODEC_LIMIT)
+		return -EINVAL;
+
+	if (quotient < CODEC_LIMIT) {
+		*folded = (quotient << k) |
+			  ((value >> (63 - quotient - k)) & ((1U << k) - 1));
+		reader->position += quotient + 1 + k;
+	} else {
+		*folded = (value >> (63 - CODEC_LIMIT - depth * 8)) &
+			  ((1U << (depth * 8)) - 1);
+		reader->position += CODEC_LIMIT + 1 + depth * 8;
+	}
+
+	/* Residuals out of range would also let parameters grow unbounded. */
+	if (*folded >> (depth * 8))
+		return -EINVAL;
+
+	return 0;
+}
+
+codec_inline void codec_band_encode_depth(struct codec_writer *writer,
+					  const uint8_t *src,
+					  unsigned int stride,
+					  unsigned int width,
+					  unsigned int y_start,
+					  unsigned int y_end,
+					  unsigned int depth)
+{
+	struct codec_contexts contexts;
+	unsigned int x, y;
+
+	codec_contexts_reset(&contexts);
+
+	for (y = y_start; y < y_end && !writer->overflow; y++) {
+		const uint8_t *row = src + y * stride;
+		const uint8_t *up = y >= 2 ? row - 2 * stride : NULL;
+
+		for (x = 0; x < width; x++) {
+			struct codec_context *context;
+			unsigned int predicted, activity, folded;
+
+			predicted = codec_predict(row, up, x, depth, &activity);
+			context = codec_context(&contexts, x, y, activity);
+			folded = codec_fold(codec_sample(row, x, depth),
+					    predicted, depth);
+
+			codec_residual_write(writer, folded,
+					     codec_context_parameter(context),
+					     depth);
+			codec_context_update(context, folded);
+		}
+	}
+}
+
+codec_inline int codec_band_decode_depth(struct codec_reader *reader,
+					 uint8_t *dst, unsigned int width,
+					 unsigned int y_start,
+					 unsigned int y_end,
+					 unsigned int depth)
+{
+	struct codec_contexts contexts;
+	unsigned int stride = width * depth;
+	unsigned int x, y;
+	int ret;
+
+	codec_contexts_reset(&contexts);
+
+	for (y = y_start; y < y_end; y++) {
+		uint8_t *row = dst + y * stride;
+		const uint8_t *up = y >= 2 ? row - 2 * stride : NULL;
+
+		for (x = 0; x < width; x++) {
+			struct codec_context *context;
+			unsigned int predicted, activity, folded;
+
+			predicted = codec_predict(row, up, x, depth, &activity);
+			context = codec_context(&contexts, x, y, activity);
+
+			ret = codec_residual_read(reader,
+						  codec_context_parameter(context),
+						  depth, &folded);
+			if (ret)
+				return ret;
+
+			codec_sample_store(row, x, depth,
+					   codec_unfold(folded, predicted,
+							depth));
+			codec_context_update(context, folded);
+		}
+	}
+
+	return 0;
+}
+
+static void codec_header_write(uint8_t *header, uint32_t value)
+{
+	header[0] = value;
+	header[1] = value >> 8;
+	header[2] = value >> 16;
+	header[3] = value >> 24;
+}
+
+static uint32_t codec_header_read(const uint8_t *header)
+{
+	return (uint32_t)header[0] | (uint32_t)header[1] << 8 |
+	       (uint32_t)header[2] << 16 | (uint32_t)header[3] << 24;
+}
+
+/*
+ * Source lines are src_stride bytes apart, which may include padding, while
+ * decoded lines are packed. Returns the coded length, at most the bound.
+ */
+int v4l2_bayer_codec_encode(void *dst, unsigned int size, const void *src,
+			    unsigned int src_stride, unsigned int width,
+			    unsigned int height, unsigned int format)
+{
+	struct codec_writer writer;
+	const uint8_t *source = src;
+	uint8_t *pointer = dst;
+	unsigned int stride, length;
+	unsigned int y, lines, i;
+	int depth;
+
+	depth = v4l2_bayer_codec_depth(format);
+	if (depth < 0 || !dst || !src || !width || !height)
+		return -EINVAL;
+
+	if (size < v4l2_bayer_codec_bound(width, height, format))
+		return -EINVAL;
+
+	stride = width * depth;
+	if (src_stride < stride)
+		return -EINVAL;
+
+	for (y = 0; y < height; y += lines) {
+		lines = height - y;
+		if (lines > V4L2_BAYER_CODEC_BAND_LINES)
+			lines = V4L2_BAYER_CODEC_BAND_LINES;
+
+		length = lines * stride;
+
+		writer.value = 0;
+		writer.count = 0;
+		writer.pointer = pointer + CODEC_HEADER_SIZE;
+		writer.end = writer.pointer + length;
+		writer.overflow = false;
+
+		if (depth == 1)
+			codec_band_encode_depth(&writer, source, src_stride,
+						width, y, y + lines, 1);
+		else
+			codec_band_encode_depth(&writer, source, src_stride,
+						width, y, y + lines, 2);
+
+		codec_write_flush(&writer);
+
+		if (writer.overflow || writer.pointer == writer.end) {
+			for (i = 0; i < lines; i++)
+				memcpy(pointer + CODEC_HEADER_SIZE + i * stride,
+				       source + (y + i) * src_stride, stride);
+			codec_header_write(pointer,
+					   length | V4L2_BAYER_CODEC_BAND_STORED);
+		} else {
+			length = writer.pointer - pointer - CODEC_HEADER_SIZE;
+			codec_header_write(pointer, length);
+		}
+
+		pointer += CODEC_HEADER_SIZE + length;
+	}
+
+	return pointer - (uint8_t *)dst;
+}
+
+int v4l2_bayer_codec_decode_start(struct v4l2_bayer_codec_decoder *decoder,
+				  unsigned int width, unsigned int height,
+				  unsigned int format)
+{
+	int depth;
+
+	depth = v4l2_bayer_codec_depth(format);
+	if (depth < 0 || !decoder || !width || !height)
+		return -EINVAL;
+
+	decoder->width = width;
+	decoder->height = height;
+	decoder->depth = depth;
+	decoder->lines = 0;
+	decoder->offset = 0;
+
+	return 0;
+}
+
+/*
+ * Decode the bands fully available in the first length bytes of the coded
+ * frame. Returns the length of raw data decoded so far.
+ */
+int v4l2_bayer_codec_decode(struct v4l2_bayer_codec_decoder *decoder,
+			    void *dst, const void *src, unsigned int length)
+{
+	const uint8_t *pointer = src;
+	struct codec_reader reader;
+	unsigned int stride = decoder->width * decoder->depth;
+	unsigned int lines, size;
+	uint32_t header;
+	int ret;
+
+	while (decoder->lines < decoder->height &&
+	       length - decoder->offset >= CODEC_HEADER_SIZE) {
+		header = codec_header_read(pointer + decoder->offset);
+		size = header & ~V4L2_BAYER_CODEC_BAND_STORED;
+
+		if (length - decoder->offset - CODEC_HEADER_SIZE < size)
+			break;
+
+		lines = decoder->height - decoder->lines;
+		if (lines > V4L2_BAYER_CODEC_BAND_LINES)
+			lines = V4L2_BAYER_CODEC_BAND_LINES;
+
+		reader.start = pointer + decoder->offset + CODEC_HEADER_SIZE;
+		reader.end = reader.start + size;
+		reader.position = 0;
+
+		if (header & V4L2_BAYER_CODEC_BAND_STORED) {
+			if (size != lines * stride)
+				return -EINVAL;
+
+			memcpy((uint8_t *)dst + decoder->lines * stride,
+			       reader.start, size);
+		} else {
+			if (decoder->depth == 1)
+				ret = codec_band_decode_depth(&reader, dst,
+							      decoder->width,
+							      decoder->lines,
+							      decoder->lines +
+							      lines, 1);
+			else
+				ret = codec_band_decode_depth(&reader, dst,
+							      decoder->width,
+							      decoder->lines,
+							      decoder->lines +
+							      lines, 2);
+			if (ret)
+				return ret;
+
+			if (reader.position > size * 8)
+				return -EINVAL;
+		}
+
+		decoder->offset += CODEC_HEADER_SIZE + size;
+		decoder->lines += lines;
+	}
+
+	return decoder->lines * stride;
+}
@@ -0,0 +1,38 @@
+#ifndef _V4L2_BAYER_CODEC_H_
+#define _V4L2_BAYER_CODEC_H_
+
+#include <stdint.h>
+
+/*
+ * Lossless Bayer codec: samples are predicted from their same-colour
+ * neighbours and residuals are Rice coded, in bands of lines that can be
+ * decoded as soon as they are received.
+ */
+
+#define V4L2_BAYER_CODEC_BAND_LINES	16
+
+/* Band header flag for bands stored as they are. */
+#define V4L2_BAYER_CODEC_BAND_STORED	(1U << 31)
+
+struct v4l2_bayer_codec_decoder {
+	unsigned int width;
+	unsigned int height;
+	unsigned int depth;
+
+	unsigned int lines;
+	unsigned int offset;
+};
+
+int v4l2_bayer_codec_depth(unsigned int format);
+unsigned int v4l2_bayer_codec_bound(unsigned int width, unsigned int height,
+				    unsigned int format);
+int v4l2_bayer_codec_encode(void *dst, unsigned int size, const void *src,
+			    unsigned int src_stride, unsigned int width,
+			    unsigned int height, unsigned int format);
+int v4l2_bayer_codec_decode_start(struct v4l2_bayer_codec_decoder *decoder,
+				  unsigned int width, unsigned int height,
+				  unsigned int format);
+int v4l2_bayer_codec_decode(struct v4l2_bayer_codec_decoder *decoder,
+			    void *dst, const void *src, unsigned int length);
+
+#endif
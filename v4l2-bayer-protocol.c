@@ -38,7 +38,9 @@ static int chunks_read(int fd, void *buffer, unsigned int length)
 		unsigned int count = length - written;
 
 		ret = read(fd, pointer, count);
-		if (ret <= 0)
+		if (ret < 0 && errno == EINTR)
+			continue;
+		else if (ret <= 0)
 			return -errno;
 
 		count = (unsigned int)ret;
@@ -64,6 +66,44 @@ int v4l2_bayer_data_write(int fd, void *buffer, unsigned int length)
 	return chunks_write(fd, buffer, length);
 }
 
+/* Skip the first bytes of vectors, which may end within a vector. */
+void v4l2_bayer_iov_advance(struct iovec **iov, size_t *count, size_t length)
+{
+	while (*count && length >= (*iov)->iov_len) {
+		length -= (*iov)->iov_len;
+		(*iov)++;
+		(*count)--;
+	}
+
+	if (length) {
+		(*iov)->iov_base = (unsigned char *)(*iov)->iov_base + length;
+		(*iov)->iov_len -= length;
+	}
+}
+
+/* Vectors are gathered in as few calls as possible, updated as they go. */
+int v4l2_bayer_data_writev(int fd, struct iovec *iov, unsigned int count)
+{
+	struct msghdr msg = { 0 };
+	unsigned int written = 0;
+	ssize_t ret;
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+
+	while (msg.msg_iovlen) {
+		ret = sendmsg(fd, &msg, 0);
+		if (ret <= 0)
+			return ret < 0 ? -errno : -EIO;
+
+		written += ret;
+
+		v4l2_bayer_iov_advance(&msg.msg_iov, &msg.msg_iovlen, ret);
+	}
+
+	return (int)written;
+}
+
 int v4l2_bayer_data_write_poll(int fd,  struct timeval *timeout)
 {
 	fd_set write_fds;
@@ -87,6 +127,32 @@ int v4l2_bayer_data_read(int fd, void *buffer, unsigned int length)
 	return chunks_read(fd, buffer, length);
 }
 
+/* Vectors are filled in as few calls as possible, waiting for all data. */
+int v4l2_bayer_data_readv(int fd, struct iovec *iov, unsigned int count)
+{
+	struct msghdr msg = { 0 };
+	unsigned int received = 0;
+	ssize_t ret;
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+
+	while (msg.msg_iovlen) {
+		/* Signals interrupt reads on sockets with a timeout. */
+		ret = recvmsg(fd, &msg, MSG_WAITALL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		else if (ret <= 0)
+			return ret < 0 ? -errno : -EIO;
+
+		received += ret;
+
+		v4l2_bayer_iov_advance(&msg.msg_iov, &msg.msg_iovlen, ret);
+	}
+
+	return (int)received;
+}
+
 int v4l2_bayer_data_read_poll(int fd,  struct timeval *timeout)
 {
 	fd_set read_fds;
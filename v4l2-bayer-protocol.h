@@ -1,15 +1,31 @@
 #ifndef _V4L2_BAYER_PROTOCOL_H_
 #define _V4L2_BAYER_PROTOCOL_H_
 
+#include <stdint.h>
+#include <sys/uio.h>
+
 #define V4L2_BAYER_SERVER_PORT		4321
 #define V4L2_BAYER_FRAME_FRAGMENT_SIZE	1024
 
 #define V4L2_BAYER_CAPTURE_REQUEST	0x1001
 
+/*
+ * Frames are pushed by the server from the stream start, until it answers
+ * the stream stop with the same message, after the last streamed frame.
+ */
 #define V4L2_BAYER_STREAM_START		0x2001
 #define V4L2_BAYER_STREAM_STOP		0x2002
 
 #define V4L2_BAYER_FRAME_FRAGMENT	0x3001
+/* Sent instead of fragments when the scene did not change. */
+#define V4L2_BAYER_FRAME_UNCHANGED	0x3002
+#define V4L2_BAYER_FRAME_BEGIN		0x3003
+#define V4L2_BAYER_FRAME_END		0x3004
+
+#define V4L2_BAYER_SESSION_SETUP	0x4001
+
+#define V4L2_BAYER_COMPRESSION_NONE	0
+#define V4L2_BAYER_COMPRESSION_BAYER	1
 
 struct v4l2_bayer_message {
 	unsigned int id;
@@ -28,6 +44,42 @@ struct v4l2_bayer_capture_request {
 	unsigned int format;
 } __attribute__((packed));
 
+/*
+ * Sent by the client with the compression it asks for and answered by the
+ * server with the one it uses for the session. Compressed frames are coded
+ * with the Bayer codec, other formats are always sent as they are.
+ *
+ * Fragments carry up to fragment_size bytes of payload, or whole frames
+ * when zero. Sizes below V4L2_BAYER_FRAME_FRAGMENT_SIZE, which is used
+ * until a session is set up, are raised to it.
+ */
+struct v4l2_bayer_session_setup {
+	unsigned int compression;
+	unsigned int fragment_size;
+} __attribute__((packed));
+
+/*
+ * Frames are sent as a frame begin message, fragments and a frame end
+ * message. The length is that of the fragment payload, which is compressed
+ * when the session uses compression, while the other fields describe the
+ * frame as captured. The sequence and timestamp, in nanoseconds, are those
+ * reported by the driver.
+ */
+struct v4l2_bayer_frame_begin {
+	unsigned int length;
+	unsigned int format;
+	unsigned int width;
+	unsigned int height;
+	unsigned int bytesperline;
+	unsigned int sequence;
+	uint64_t timestamp;
+} __attribute__((packed));
+
+/* Also sent alone, with a negative error code, when the capture failed. */
+struct v4l2_bayer_frame_end {
+	int status;
+} __attribute__((packed));
+
 struct v4l2_bayer_frame_fragment {
 	unsigned int serial;
 	unsigned int length;
@@ -35,8 +87,11 @@ struct v4l2_bayer_frame_fragment {
 
 int v4l2_bayer_message_write(int fd, unsigned int id, unsigned int length);
 int v4l2_bayer_data_write(int fd, void *buffer, unsigned int length);
+int v4l2_bayer_data_writev(int fd, struct iovec *iov, unsigned int count);
+void v4l2_bayer_iov_advance(struct iovec **iov, size_t *count, size_t length);
 int v4l2_bayer_data_write_poll(int fd,  struct timeval *timeout);
 int v4l2_bayer_data_read(int fd, void *buffer, unsigned int length);
+int v4l2_bayer_data_readv(int fd, struct iovec *iov, unsigned int count);
 int v4l2_bayer_data_read_poll(int fd,  struct timeval *timeout);
 
 #endif
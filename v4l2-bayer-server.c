@@ -1,24 +1,101 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 
+#include <fcntl.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/un.h>
 
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+
 #include <v4l2-bayer-protocol.h>
+#include <v4l2-bayer-codec.h>
 #include <v4l2-camera.h>
 #include <v4l2.h>
 
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+/*
+ * Frame signatures are the mean sample values of blocks on a grid, over
+ * samples of the first plane subsampled in both directions. Steps are odd
+ * so that all CFA colours are sampled for Bayer formats.
+ */
+#define SIGNATURE_GRID	16
+#define SIGNATURE_STEP	3
+
+/*
+ * Zero-copy transmission sends from the capture buffers themselves, with
+ * MSG_ZEROCOPY or else by splicing their pages to the socket through a
+ * pipe. Buffers are then only requeued once the kernel released them: when
+ * all zero-copy sends are reported complete on the socket error queue, or
+ * when the send queue is empty after splicing. Compressed frames are still
+ * copied, since the codec buffer is reused for each frame.
+ */
+enum transmit_mode {
+	TRANSMIT_COPY,
+	TRANSMIT_ZEROCOPY,
+	TRANSMIT_SPLICE,
+};
+
+#define TRANSMIT_RELEASE_TIMEOUT	1000
+#define TRANSMIT_PIPE_SIZE		(1024 * 1024)
+
 struct v4l2_bayer_server {
 	int server_fd;
 	int client_fd;
 
 	bool run;
+	bool streaming;
+
+	/*
+	 * Warm streams keep the camera running between capture requests, with
+	 * buffers cycling while the server waits, until idle for the timeout
+	 * in milliseconds. Requests get the latest frame, or the next one.
+	 */
+	unsigned int warm_timeout;
+	bool warm_next;
+	bool warm;
+	bool warm_ready;
+	uint64_t warm_time;
+
+	unsigned int compression;
+	unsigned int fragment_size;
+	void *codec_buffer;
+	unsigned int codec_size;
+
+	bool zerocopy;
+	enum transmit_mode transmit;
+	uint32_t zerocopy_sent;
+	uint32_t zerocopy_completed;
+	bool zerocopy_copied;
+	int pipe_fds[2];
+	bool splice_pending;
+
+	/*
+	 * Static scene suppression, against the last transmitted frame, which
+	 * is kept across connections until the camera is set up again.
+	 */
+	bool suppress;
+	unsigned int suppress_threshold;
+	uint32_t signature[SIGNATURE_GRID * SIGNATURE_GRID];
+	struct v4l2_camera_setup signature_setup;
+	unsigned int signature_compression;
+	bool signature_valid;
 
 	struct v4l2_camera camera;
 };
@@ -90,67 +167,676 @@ int v4l2_bayer_server_close(struct v4l2_bayer_server *server)
 	return 0;
 }
 
+static int frame_begin_write(struct v4l2_bayer_server *server,
+			     struct v4l2_camera_buffer *buffer,
+			     unsigned int length)
+{
+	struct v4l2_camera *camera = &server->camera;
+	struct v4l2_format *format = &camera->capture_format;
+	struct v4l2_bayer_frame_begin begin = {
+		.length = length,
+		.sequence = buffer->buffer.sequence,
+	};
+	uint64_t timestamp;
+	int ret;
+
+	v4l2_buffer_timestamp_get(&buffer->buffer, &timestamp);
+	begin.timestamp = timestamp;
+
+	/* The format as set by the driver, which may adjust the request. */
+	if (v4l2_type_mplane_check(camera->capture_type)) {
+		begin.format = format->fmt.pix_mp.pixelformat;
+		begin.width = format->fmt.pix_mp.width;
+		begin.height = format->fmt.pix_mp.height;
+		begin.bytesperline =
+			format->fmt.pix_mp.plane_fmt[0].bytesperline;
+	} else {
+		begin.format = format->fmt.pix.pixelformat;
+		begin.width = format->fmt.pix.width;
+		begin.height = format->fmt.pix.height;
+		begin.bytesperline = format->fmt.pix.bytesperline;
+	}
+
+	ret = v4l2_bayer_message_write(server->client_fd,
+				       V4L2_BAYER_FRAME_BEGIN, sizeof(begin));
+	if (ret < 0)
+		return ret;
+
+	ret = v4l2_bayer_data_write(server->client_fd, &begin, sizeof(begin));
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+static int frame_end_write(struct v4l2_bayer_server *server, int status)
+{
+	struct v4l2_bayer_frame_end end = {
+		.status = status,
+	};
+	int ret;
+
+	ret = v4l2_bayer_message_write(server->client_fd, V4L2_BAYER_FRAME_END,
+				       sizeof(end));
+	if (ret < 0)
+		return ret;
+
+	ret = v4l2_bayer_data_write(server->client_fd, &end, sizeof(end));
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+/* Partial segments are held back until the frame is uncorked. */
+static void frame_cork(struct v4l2_bayer_server *server, int cork)
+{
+	setsockopt(server->client_fd, IPPROTO_TCP, TCP_CORK, &cork,
+		   sizeof(cork));
+}
+
+static void transmit_setup(struct v4l2_bayer_server *server)
+{
+	int fd = server->client_fd;
+	int enable = 1;
+	int ret;
+
+	server->transmit = TRANSMIT_COPY;
+	server->zerocopy_sent = 0;
+	server->zerocopy_completed = 0;
+	server->zerocopy_copied = false;
+	server->splice_pending = false;
+
+	if (!server->zerocopy)
+		return;
+
+	ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable));
+	if (!ret) {
+		server->transmit = TRANSMIT_ZEROCOPY;
+		printf("Transmit with zero-copy\n");
+		return;
+	}
+
+	/* Pipes are not reused, since failed splices may leave data behind. */
+	ret = pipe(server->pipe_fds);
+	if (ret) {
+		printf("Transmit with copy\n");
+		return;
+	}
+
+	/* Larger pipes take more pages for each splice. */
+	fcntl(server->pipe_fds[1], F_SETPIPE_SZ, TRANSMIT_PIPE_SIZE);
+
+	server->transmit = TRANSMIT_SPLICE;
+	printf("Transmit with splice\n");
+}
+
+static void transmit_teardown(struct v4l2_bayer_server *server)
+{
+	if (server->pipe_fds[0] >= 0) {
+		close(server->pipe_fds[0]);
+		close(server->pipe_fds[1]);
+		server->pipe_fds[0] = -1;
+		server->pipe_fds[1] = -1;
+	}
+
+	server->transmit = TRANSMIT_COPY;
+	server->zerocopy_sent = 0;
+	server->zerocopy_completed = 0;
+	server->splice_pending = false;
+}
+
+/* Completions report ranges of send calls, counted from the first. */
+static int zerocopy_completions_read(struct v4l2_bayer_server *server)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct msghdr msg = { 0 };
+	struct sock_extended_err *error;
+	struct cmsghdr *cmsg;
+	int ret;
+
+	while (1) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ret = recvmsg(server->client_fd, &msg,
+			      MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			return -errno;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP &&
+			      cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == SOL_IPV6 &&
+			      cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+			    error->ee_errno != 0)
+				continue;
+
+			server->zerocopy_completed += error->ee_data -
+						      error->ee_info + 1;
+
+			/* Loopback and some devices copy the data anyway. */
+			if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED &&
+			    !server->zerocopy_copied) {
+				printf("Transmit zero-copy fell back to copy\n");
+				server->zerocopy_copied = true;
+			}
+		}
+	}
+}
+
+/* Capture buffers are only requeued once the kernel released their pages. */
+static int frame_buffers_release(struct v4l2_bayer_server *server)
+{
+	struct pollfd pollfd = {
+		.fd = server->client_fd,
+	};
+	unsigned int waited = 0;
+	int pending;
+	int ret;
+
+	while (server->zerocopy_completed != server->zerocopy_sent) {
+		ret = zerocopy_completions_read(server);
+		if (ret)
+			return ret;
+
+		if (server->zerocopy_completed == server->zerocopy_sent)
+			break;
+
+		/* Errors are always polled for, without any event. */
+		ret = poll(&pollfd, 1, TRANSMIT_RELEASE_TIMEOUT);
+		if (ret < 0)
+			return -errno;
+		else if (ret == 0)
+			return -ETIMEDOUT;
+	}
+
+	/* Spliced pages are released once acknowledged by the peer. */
+	while (server->splice_pending) {
+		ret = ioctl(server->client_fd, SIOCOUTQ, &pending);
+		if (ret)
+			return -errno;
+
+		if (!pending)
+			break;
+
+		if (waited++ >= TRANSMIT_RELEASE_TIMEOUT)
+			return -ETIMEDOUT;
+
+		usleep(1000);
+	}
+
+	server->splice_pending = false;
+
+	return 0;
+}
+
+static int frame_zerocopy_write(struct v4l2_bayer_server *server,
+				struct iovec *iov, unsigned int count)
+{
+	struct msghdr msg = { 0 };
+	unsigned int written = 0;
+	int flags = MSG_ZEROCOPY;
+	ssize_t ret;
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+
+	while (msg.msg_iovlen) {
+		ret = sendmsg(server->client_fd, &msg, flags);
+		if (ret < 0 && errno == ENOBUFS && flags) {
+			/* Out of pinned memory: this frame is copied instead. */
+			flags = 0;
+			continue;
+		} else if (ret < 0) {
+			return -errno;
+		}
+
+		if (flags)
+			server->zerocopy_sent++;
+
+		written += ret;
+
+		v4l2_bayer_iov_advance(&msg.msg_iov, &msg.msg_iovlen, ret);
+	}
+
+	return (int)written;
+}
+
+/* Payload pages are moved to the socket through the pipe. */
+static int frame_splice_write(struct v4l2_bayer_server *server,
+			      struct iovec *iov, unsigned int count)
+{
+	size_t iov_count = count;
+	unsigned int written = 0;
+	ssize_t length;
+	ssize_t ret;
+
+	while (iov_count) {
+		length = vmsplice(server->pipe_fds[1], iov, iov_count, 0);
+		if (length < 0)
+			return -errno;
+
+		v4l2_bayer_iov_advance(&iov, &iov_count, length);
+		server->splice_pending = true;
+
+		while (length) {
+			ret = splice(server->pipe_fds[0], NULL,
+				     server->client_fd, NULL, length,
+				     SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (ret < 0)
+				return -errno;
+
+			length -= ret;
+			written += ret;
+		}
+	}
+
+	return (int)written;
+}
+
+/*
+ * Each fragment is sent in a single call, gathering its headers and its
+ * payload, which spans all planes of the buffer or the compressed frame.
+ */
 static int frame_fragments_write(struct v4l2_bayer_server *server,
 				 struct v4l2_camera_buffer *buffer)
 {
-	struct v4l2_bayer_frame_fragment fragment = { 0 };
-	unsigned int fragment_size = V4L2_BAYER_FRAME_FRAGMENT_SIZE;
-	struct timeval timeout = { 0 };
-	unsigned char *pointer = buffer->mmap_data[0];
+	struct {
+		struct v4l2_bayer_message message;
+		struct v4l2_bayer_frame_fragment fragment;
+	} __attribute__((packed)) header = { 0 };
+	struct v4l2_camera *camera = &server->camera;
+	struct v4l2_format *format = &camera->capture_format;
+	struct v4l2_camera_setup *setup = &camera->setup;
+	unsigned int fragment_size = server->fragment_size;
+	struct iovec payload[ARRAY_SIZE(buffer->mmap_data)];
+	struct iovec iov[1 + ARRAY_SIZE(buffer->mmap_data)];
+	unsigned int payload_count = buffer->planes_count;
+	unsigned int plane = 0, plane_offset = 0;
 	unsigned int written = 0;
 	unsigned int length = 0;
+	bool zerocopy = server->transmit != TRANSMIT_COPY;
+	unsigned int size, stride, i;
+	int depth;
 	int ret;
 
-	ret = v4l2_buffer_plane_length(&buffer->buffer, 0, &length);
-	if (ret)
-		return ret;
+	if (payload_count > ARRAY_SIZE(payload))
+		return -EINVAL;
+
+	for (i = 0; i < payload_count; i++) {
+		ret = v4l2_buffer_plane_length(&buffer->buffer, i, &size);
+		if (ret)
+			return ret;
+
+		payload[i].iov_base = buffer->mmap_data[i];
+		payload[i].iov_len = size;
+		length += size;
+	}
 
 	printf("Tx frame size %u\n", length);
 
+	depth = v4l2_bayer_codec_depth(setup->format);
+
+	if (server->compression == V4L2_BAYER_COMPRESSION_BAYER && depth > 0) {
+		/* Lines may be padded, the encoder skips the padding. */
+		if (v4l2_type_mplane_check(camera->capture_type))
+			stride = format->fmt.pix_mp.plane_fmt[0].bytesperline;
+		else
+			stride = format->fmt.pix.bytesperline;
+
+		if (stride < setup->width * depth ||
+		    payload[0].iov_len / stride < setup->height)
+			return -EINVAL;
+
+		size = v4l2_bayer_codec_bound(setup->width, setup->height,
+					      setup->format);
+		if (server->codec_size < size) {
+			free(server->codec_buffer);
+
+			server->codec_buffer = malloc(size);
+			if (!server->codec_buffer) {
+				server->codec_size = 0;
+				return -ENOMEM;
+			}
+
+			server->codec_size = size;
+		}
+
+		ret = v4l2_bayer_codec_encode(server->codec_buffer,
+					      server->codec_size,
+					      payload[0].iov_base, stride,
+					      setup->width, setup->height,
+					      setup->format);
+		if (ret < 0)
+			return ret;
+
+		payload[0].iov_base = server->codec_buffer;
+		payload[0].iov_len = ret;
+		payload_count = 1;
+		length = ret;
+		zerocopy = false;
+
+		printf("Tx frame compressed to %u\n", length);
+	}
+
+	frame_cork(server, 1);
+
+	ret = frame_begin_write(server, buffer, length);
+	if (ret)
+		goto complete;
+
+	header.message.id = V4L2_BAYER_FRAME_FRAGMENT;
+
 	do {
 		unsigned int count = length - written;
+		unsigned int remaining;
 
-		if (count > fragment_size)
+		if (fragment_size && count > fragment_size)
 			count = fragment_size;
 
-		fragment.length = count;
+		header.message.length = sizeof(header.fragment) + count;
+		header.fragment.length = count;
 
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 300000;
+		iov[0].iov_base = &header;
+		iov[0].iov_len = sizeof(header);
+		i = 1;
 
-		ret = v4l2_bayer_data_write_poll(server->client_fd, &timeout);
-		if (ret <= 0)
-			return ret;
+		for (remaining = count; remaining; i++) {
+			unsigned int chunk = payload[plane].iov_len -
+					     plane_offset;
 
-		ret = v4l2_bayer_message_write(server->client_fd,
-					       V4L2_BAYER_FRAME_FRAGMENT,
-					       sizeof(fragment) + count);
+			if (chunk > remaining)
+				chunk = remaining;
+
+			iov[i].iov_base = (unsigned char *)
+					  payload[plane].iov_base +
+					  plane_offset;
+			iov[i].iov_len = chunk;
+
+			remaining -= chunk;
+			plane_offset += chunk;
+
+			if (plane_offset == payload[plane].iov_len) {
+				plane++;
+				plane_offset = 0;
+			}
+		}
+
+		/* Headers live on the stack and are always copied. */
+		if (zerocopy) {
+			ret = v4l2_bayer_data_write(server->client_fd, &header,
+						    sizeof(header));
+			if (ret < 0)
+				goto complete;
+
+			if (server->transmit == TRANSMIT_ZEROCOPY)
+				ret = frame_zerocopy_write(server, &iov[1],
+							   i - 1);
+			else
+				ret = frame_splice_write(server, &iov[1], i - 1);
+		} else {
+			ret = v4l2_bayer_data_writev(server->client_fd, iov, i);
+		}
 		if (ret < 0)
-			return ret;
+			goto complete;
+
+/*
+		printf("Tx fragment %u length %u\n", header.fragment.serial,
+		       header.fragment.length);
+*/
+
+		header.fragment.serial++;
+
+		written += count;
+	} while (written < length);
+
+	ret = frame_end_write(server, 0);
+
+complete:
+	frame_cork(server, 0);
+
+	return ret;
+}
+
+static void frame_signature(struct v4l2_bayer_server *server,
+			    struct v4l2_camera_buffer *buffer,
+			    unsigned int stride, uint32_t *signature)
+{
+	struct v4l2_camera_setup *setup = &server->camera.setup;
+	uint32_t sums[SIGNATURE_GRID * SIGNATURE_GRID] = { 0 };
+	uint32_t counts[SIGNATURE_GRID * SIGNATURE_GRID] = { 0 };
+	unsigned char *data = buffer->mmap_data[0];
+	unsigned int height = setup->height;
+	unsigned int samples, block;
+	unsigned int x, y;
+	int depth;
+
+	/*
+	 * Other formats are sampled by bytes of the luma or packed lines,
+	 * which still follow changes.
+	 */
+	depth = v4l2_bayer_codec_depth(setup->format);
+	if (depth > 0) {
+		samples = setup->width;
+	} else {
+		depth = 1;
+		samples = stride;
+	}
+
+	for (y = 0; y < height; y += SIGNATURE_STEP) {
+		unsigned char *row = data + y * stride;
+		uint32_t *row_sums = sums + y * SIGNATURE_GRID / height *
+				     SIGNATURE_GRID;
+		uint32_t *row_counts = counts + y * SIGNATURE_GRID / height *
+				       SIGNATURE_GRID;
+
+		for (x = 0; x < samples; x += SIGNATURE_STEP) {
+			block = x * SIGNATURE_GRID / samples;
+
+			if (depth == 2)
+				row_sums[block] += ((uint16_t *)row)[x];
+			else
+				row_sums[block] += row[x];
+
+			row_counts[block]++;
+		}
+	}
+
+	for (block = 0; block < SIGNATURE_GRID * SIGNATURE_GRID; block++)
+		signature[block] = counts[block] ?
+				   sums[block] / counts[block] : 0;
+}
+
+/* Frames are unchanged when no block mean moved beyond the threshold. */
+static bool frame_unchanged(struct v4l2_bayer_server *server,
+			    uint32_t *signature)
+{
+	struct v4l2_camera_setup *setup = &server->camera.setup;
+	unsigned int block;
+	uint32_t delta;
+
+	if (!server->signature_valid ||
+	    server->signature_setup.width != setup->width ||
+	    server->signature_setup.height != setup->height ||
+	    server->signature_setup.format != setup->format ||
+	    server->signature_compression != server->compression)
+		return false;
+
+	for (block = 0; block < SIGNATURE_GRID * SIGNATURE_GRID; block++) {
+		delta = signature[block] > server->signature[block] ?
+			signature[block] - server->signature[block] :
+			server->signature[block] - signature[block];
+
+		if (delta > server->suppress_threshold)
+			return false;
+	}
+
+	return true;
+}
+
+static int frame_transmit(struct v4l2_bayer_server *server,
+			  struct v4l2_camera_buffer *buffer)
+{
+	struct v4l2_camera *camera = &server->camera;
+	struct v4l2_format *format = &camera->capture_format;
+	uint32_t signature[SIGNATURE_GRID * SIGNATURE_GRID];
+	unsigned int length = 0;
+	unsigned int stride;
+	int depth;
+	int ret;
+
+	if (!server->suppress)
+		return frame_fragments_write(server, buffer);
+
+	ret = v4l2_buffer_plane_length(&buffer->buffer, 0, &length);
+	if (ret)
+		return ret;
+
+	/* Lines may be padded, and chroma planes follow the luma plane. */
+	if (v4l2_type_mplane_check(camera->capture_type))
+		stride = format->fmt.pix_mp.plane_fmt[0].bytesperline;
+	else
+		stride = format->fmt.pix.bytesperline;
+
+	depth = v4l2_bayer_codec_depth(camera->setup.format);
+	if (depth > 0 && stride < camera->setup.width * depth)
+		return -EINVAL;
 
-		ret = v4l2_bayer_data_write(server->client_fd, &fragment,
-					    sizeof(fragment));
+	if (!stride || length / stride < camera->setup.height)
+		return -EINVAL;
+
+	frame_signature(server, buffer, stride, signature);
+
+	if (frame_unchanged(server, signature)) {
+		printf("Tx frame unchanged\n");
+
+		ret = v4l2_bayer_message_write(server->client_fd,
+					       V4L2_BAYER_FRAME_UNCHANGED, 0);
 		if (ret < 0)
 			return ret;
 
-		ret = v4l2_bayer_data_write_poll(server->client_fd, &timeout);
+		return 0;
+	}
+
+	ret = frame_fragments_write(server, buffer);
+	if (ret)
+		return ret;
+
+	memcpy(server->signature, signature, sizeof(signature));
+	server->signature_setup = server->camera.setup;
+	server->signature_compression = server->compression;
+	server->signature_valid = true;
+
+	return 0;
+}
+
+static uint64_t warm_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Stopped cameras leave no warm frame ready. */
+static int camera_stop(struct v4l2_bayer_server *server)
+{
+	server->warm = false;
+	server->warm_ready = false;
+
+	return v4l2_camera_stop(&server->camera);
+}
+
+/* The buffer of the ready frame is requeued for the next completed one. */
+static int warm_cycle(struct v4l2_bayer_server *server)
+{
+	struct v4l2_camera *camera = &server->camera;
+	int ret;
+
+	ret = frame_buffers_release(server);
+	if (ret)
+		return ret;
+
+	ret = v4l2_camera_run(camera);
+	if (ret)
+		return ret;
+
+	return v4l2_camera_complete(camera);
+}
+
+/* Frames completed since the last cycle are skipped to the latest one. */
+static int warm_drain(struct v4l2_bayer_server *server)
+{
+	struct timeval timeout;
+	int ret;
+
+	while (1) {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 0;
+
+		ret = v4l2_poll(server->camera.video_fd, &timeout);
 		if (ret <= 0)
 			return ret;
 
-		ret = v4l2_bayer_data_write(server->client_fd, pointer, count);
-		if (ret < count)
+		ret = warm_cycle(server);
+		if (ret)
 			return ret;
+	}
+}
 
 /*
-		printf("Tx fragment %u length %u\n", fragment.serial,
-		       fragment.length);
-*/
+ * Buffers keep cycling until the descriptor is ready to read, or until
+ * the warm stream is stopped, when idle or when cycling failed.
+ */
+static int warm_wait(struct v4l2_bayer_server *server, int fd)
+{
+	struct v4l2_camera *camera = &server->camera;
+	struct pollfd pollfds[2] = { 0 };
+	uint64_t elapsed;
+	int ret;
+
+	while (server->warm) {
+		elapsed = warm_time() - server->warm_time;
+		if (elapsed >= server->warm_timeout) {
+			printf("Warm stream idle\n");
+			camera_stop(server);
+			break;
+		}
 
-		fragment.serial++;
+		pollfds[0].fd = fd;
+		pollfds[0].events = POLLIN;
+		pollfds[1].fd = camera->video_fd;
+		pollfds[1].events = POLLIN;
 
-		written += count;
-		pointer += count;
-	} while (written < length);
+		ret = poll(pollfds, ARRAY_SIZE(pollfds),
+			   server->warm_timeout - elapsed);
+		if (ret < 0)
+			return -errno;
+
+		if (pollfds[0].revents & (POLLIN | POLLHUP))
+			break;
+
+		if (!(pollfds[1].revents & POLLIN))
+			continue;
+
+		ret = warm_cycle(server);
+		if (ret) {
+			printf("Warm stream failed\n");
+			camera_stop(server);
+			break;
+		}
+	}
 
 	return 0;
 }
@@ -172,6 +858,10 @@ static int capture_request(struct v4l2_bayer_server *server)
 	printf("Rx capture request size %ux%u, format %#x\n", request.width,
 	       request.height, request.format);
 
+	ret = frame_buffers_release(server);
+	if (ret)
+		return ret;
+
 	if (!camera->started)
 		started_already = false;
 
@@ -179,7 +869,7 @@ static int capture_request(struct v4l2_bayer_server *server)
 	                   camera->setup.height != request.height ||
 	                   camera->setup.format != request.format)) {
 		if (camera->started) {
-			ret = v4l2_camera_stop(camera);
+			ret = camera_stop(server);
 			if (ret)
 				return ret;
 		}
@@ -202,6 +892,8 @@ static int capture_request(struct v4l2_bayer_server *server)
 		ret = v4l2_camera_setup(camera);
 		if (ret)
 			return ret;		
+
+		server->signature_valid = false;
 	}
 
 	if (!camera->started) {
@@ -214,24 +906,37 @@ static int capture_request(struct v4l2_bayer_server *server)
 	if (ret)
 		return ret;
 
-	ret = v4l2_camera_run(camera);
-	if (ret)
-		return ret;
+	/* Warm streams hold the latest frame once drained. */
+	if (server->warm_ready) {
+		ret = warm_drain(server);
+		if (ret)
+			return ret;
+	}
+
+	if (!server->warm_ready || server->warm_next) {
+		ret = v4l2_camera_run(camera);
+		if (ret)
+			return ret;
+
+		ret = v4l2_camera_complete(camera);
+		if (ret)
+			return ret;
+	}
 
 	capture_index = camera->capture_buffer_ready_index;
 	capture_buffer = &camera->capture_buffers[capture_index];
 
-	ret = v4l2_camera_complete(camera);
-	if (ret)
-		return ret;
-
-	if (!started_already) {
-		ret = v4l2_camera_stop(camera);
+	if (server->warm_timeout && !server->streaming) {
+		server->warm = true;
+		server->warm_ready = true;
+		server->warm_time = warm_time();
+	} else if (!started_already) {
+		ret = camera_stop(server);
 		if (ret)
 			return ret;
 	}
 
-	ret = frame_fragments_write(server, capture_buffer);
+	ret = frame_transmit(server, capture_buffer);
 	if (ret)
 		return ret;
 
@@ -251,11 +956,15 @@ static int stream_start(struct v4l2_bayer_server *server)
 	printf("Stream size %ux%u, format %#x\n", stream.width, stream.height,
 	       stream.format);
 
+	ret = frame_buffers_release(server);
+	if (ret)
+		return ret;
+
 	if (camera->up && (camera->setup.width != stream.width ||
 	                   camera->setup.height != stream.height ||
 	                   camera->setup.format != stream.format)) {
 		if (camera->started) {
-			ret = v4l2_camera_stop(camera);
+			ret = camera_stop(server);
 			if (ret)
 				return ret;
 		}
@@ -278,6 +987,8 @@ static int stream_start(struct v4l2_bayer_server *server)
 		ret = v4l2_camera_setup(camera);
 		if (ret)
 			return ret;
+
+		server->signature_valid = false;
 	}
 
 	if (!camera->started) {
@@ -286,6 +997,11 @@ static int stream_start(struct v4l2_bayer_server *server)
 			return ret;
 	}
 
+	/* Streams take the camera over from warm streams. */
+	server->warm = false;
+	server->warm_ready = false;
+	server->streaming = true;
+
 	printf("Stream started OK\n");
 
 	return 0;
@@ -296,14 +1012,110 @@ static int stream_stop(struct v4l2_bayer_server *server)
 	struct v4l2_camera *camera = &server->camera;
 	int ret;
 
+	server->streaming = false;
+
+	ret = frame_buffers_release(server);
+	if (ret)
+		return ret;
+
 	if (camera->started) {
-		ret = v4l2_camera_stop(camera);
+		ret = camera_stop(server);
 		if (ret)
 			return ret;
 	}
 
 	printf("Stream stopped OK\n");
 
+	/* No more frames follow the answer. */
+	ret = v4l2_bayer_message_write(server->client_fd,
+				       V4L2_BAYER_STREAM_STOP, 0);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+/*
+ * Streamed frames are pushed as they are captured. The buffer of the
+ * previous frame is only requeued before waiting for the next one, so the
+ * camera fills the other queued buffers while a frame is transmitted.
+ */
+static int stream_frame(struct v4l2_bayer_server *server)
+{
+	struct v4l2_camera *camera = &server->camera;
+	struct v4l2_camera_buffer *capture_buffer;
+	unsigned int capture_index;
+	int ret;
+
+	ret = frame_buffers_release(server);
+	if (ret)
+		goto error;
+
+	ret = v4l2_camera_prepare(camera);
+	if (ret)
+		goto error;
+
+	ret = v4l2_camera_run(camera);
+	if (ret)
+		goto error;
+
+	capture_index = camera->capture_buffer_ready_index;
+	capture_buffer = &camera->capture_buffers[capture_index];
+
+	ret = v4l2_camera_complete(camera);
+	if (ret)
+		goto error;
+
+	return frame_transmit(server, capture_buffer);
+
+error:
+	/* Failed captures end the stream, as they end the frame. */
+	server->streaming = false;
+
+	if (camera->started) {
+		frame_buffers_release(server);
+		camera_stop(server);
+	}
+
+	return frame_end_write(server, ret);
+}
+
+static int session_setup(struct v4l2_bayer_server *server)
+{
+	struct v4l2_bayer_session_setup setup;
+	int ret;
+
+	ret = v4l2_bayer_data_read(server->client_fd, &setup, sizeof(setup));
+	if (ret <= 0)
+		return ret;
+
+	if (setup.compression == V4L2_BAYER_COMPRESSION_BAYER)
+		server->compression = V4L2_BAYER_COMPRESSION_BAYER;
+	else
+		server->compression = V4L2_BAYER_COMPRESSION_NONE;
+
+	if (setup.fragment_size &&
+	    setup.fragment_size < V4L2_BAYER_FRAME_FRAGMENT_SIZE)
+		server->fragment_size = V4L2_BAYER_FRAME_FRAGMENT_SIZE;
+	else
+		server->fragment_size = setup.fragment_size;
+
+	printf("Session compression %u, fragment size %u\n",
+	       server->compression, server->fragment_size);
+
+	setup.compression = server->compression;
+	setup.fragment_size = server->fragment_size;
+
+	ret = v4l2_bayer_message_write(server->client_fd,
+				       V4L2_BAYER_SESSION_SETUP,
+				       sizeof(setup));
+	if (ret < 0)
+		return ret;
+
+	ret = v4l2_bayer_data_write(server->client_fd, &setup, sizeof(setup));
+	if (ret < 0)
+		return ret;
+
 	return 0;
 }
 
@@ -324,17 +1136,29 @@ static int message_handle(struct v4l2_bayer_server *server)
 		if (message.length < sizeof(struct v4l2_bayer_capture_request))
 			return -EINVAL;
 
-		capture_request(server);
+		/* Failed captures still end the frame for the client. */
+		ret = capture_request(server);
+		if (ret < 0)
+			frame_end_write(server, ret);
 		break;
 	case V4L2_BAYER_STREAM_START:
 		if (message.length < sizeof(struct v4l2_bayer_stream_start))
 			return -EINVAL;
 
-		stream_start(server);
+		/* Failed starts end the frame the client waits for. */
+		ret = stream_start(server);
+		if (ret < 0)
+			frame_end_write(server, ret);
 		break;
 	case V4L2_BAYER_STREAM_STOP:
 		stream_stop(server);
 		break;
+	case V4L2_BAYER_SESSION_SETUP:
+		if (message.length < sizeof(struct v4l2_bayer_session_setup))
+			return -EINVAL;
+
+		session_setup(server);
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -345,6 +1169,8 @@ static int message_handle(struct v4l2_bayer_server *server)
 int v4l2_bayer_server_poll(struct v4l2_bayer_server *server)
 {
 	struct sockaddr_in client_addr = { 0 };
+	struct timeval timeout = { .tv_usec = 300000 };
+	struct pollfd pollfd = { 0 };
 	fd_set read_fds;
 	int ret;
 
@@ -353,6 +1179,11 @@ int v4l2_bayer_server_poll(struct v4l2_bayer_server *server)
 
 	if (server->client_fd < 0) {
 		unsigned int client_addr_size = sizeof(client_addr);
+
+		ret = warm_wait(server, server->server_fd);
+		if (ret)
+			return ret;
+
 		server->client_fd = accept(server->server_fd,
 					   (struct sockaddr *)&client_addr,
 					   &client_addr_size);
@@ -360,8 +1191,54 @@ int v4l2_bayer_server_poll(struct v4l2_bayer_server *server)
 			ret = -errno;
 			goto error;
 		}
+
+		/* Stalled clients fail writes instead of blocking them. */
+		ret = setsockopt(server->client_fd, SOL_SOCKET, SO_SNDTIMEO,
+				 &timeout, sizeof(timeout));
+		if (ret) {
+			ret = -errno;
+			goto error;
+		}
+
+		server->compression = V4L2_BAYER_COMPRESSION_NONE;
+		server->fragment_size = V4L2_BAYER_FRAME_FRAGMENT_SIZE;
+
+		transmit_setup(server);
+	}
+
+	/*
+	 * Messages are only checked for between streamed frames, without
+	 * taking zero-copy completions on the error queue for them.
+	 */
+	if (server->streaming) {
+		pollfd.fd = server->client_fd;
+		pollfd.events = POLLIN;
+
+		ret = poll(&pollfd, 1, 0);
+		if (ret < 0) {
+			ret = -errno;
+			goto error;
+		}
+
+		if (pollfd.revents & (POLLIN | POLLHUP)) {
+			ret = message_handle(server);
+			if (ret)
+				goto error;
+		}
+
+		if (server->streaming) {
+			ret = stream_frame(server);
+			if (ret)
+				goto error;
+		}
+
+		return 0;
 	}
 
+	ret = warm_wait(server, server->client_fd);
+	if (ret)
+		goto error;
+
 	ret = v4l2_bayer_data_read_poll(server->client_fd, NULL);
 	if (ret <= 0) {
 		ret = -errno;
@@ -376,10 +1253,23 @@ int v4l2_bayer_server_poll(struct v4l2_bayer_server *server)
 
 error:
 	if (server->client_fd >= 0) {
+		/* Completions can no longer be read once the socket is closed. */
+		frame_buffers_release(server);
+
 		close(server->client_fd);
 		server->client_fd = -1;
 	}
 
+	/* Streams end with the session they were started by. */
+	if (server->streaming) {
+		server->streaming = false;
+
+		if (server->camera.started)
+			camera_stop(server);
+	}
+
+	transmit_teardown(server);
+
 	return ret;
 }
 
@@ -388,6 +1278,7 @@ int main(int argc, char *argv[])
 	struct v4l2_bayer_server server = {
 		.server_fd = -1,
 		.client_fd = -1,
+		.pipe_fds = { -1, -1 },
 	};
 	char *driver = NULL;
 	unsigned int buffers_count = 2;
@@ -396,7 +1287,7 @@ int main(int argc, char *argv[])
 	int ret;
 
 	while (option != -1) {
-		option = getopt(argc, argv, "d:c:p:s");
+		option = getopt(argc, argv, "d:c:p:st:zw:n");
 		if (option < 0)
 			break;
 
@@ -410,9 +1301,26 @@ int main(int argc, char *argv[])
 		case 'p':
 			buffers_preload_count = atoi(optarg);
 			break;
+		case 't':
+			/* Threshold on block means, in sample values. */
+			server.suppress = true;
+			server.suppress_threshold = atoi(optarg);
+			break;
+		case 'z':
+			server.zerocopy = true;
+			break;
+		case 'w':
+			server.warm_timeout = atoi(optarg);
+			break;
+		case 'n':
+			server.warm_next = true;
+			break;
 		}
 	}
 
+	/* Clients going away fail writes instead of ending the server. */
+	signal(SIGPIPE, SIG_IGN);
+
 	ret = v4l2_bayer_server_open(&server);
 	if (ret)
 		goto error;
@@ -427,8 +1335,10 @@ int main(int argc, char *argv[])
 	while (server.run)
 		v4l2_bayer_server_poll(&server);
 
+	transmit_teardown(&server);
+
 	if (server.camera.started) {
-		ret = v4l2_camera_stop(&server.camera);
+		ret = camera_stop(&server);
 		if (ret)
 			goto error;
 	}
@@ -441,6 +1351,8 @@ int main(int argc, char *argv[])
 
 	v4l2_camera_close(&server.camera);
 
+	free(server.codec_buffer);
+
 	ret = v4l2_bayer_server_close(&server);
 	if (ret)
 		goto error;
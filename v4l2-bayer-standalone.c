@@ -1,6 +1,8 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -14,10 +16,11 @@
 
 #include <linux/videodev2.h>
 
-#include <cairo.h>
-
 #include <v4l2-camera.h>
 
+#include <image-convert.h>
+#include <image-write.h>
+
 struct v4l2_bayer_standalone {
 	struct v4l2_camera camera;
 
@@ -31,306 +34,14 @@ struct v4l2_bayer_standalone {
 	int dump_fd;
 };
 
-static inline uint32_t pixel_pack(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
-{
-	uint32_t color = 0;
-
-	color |= b << 0;
-	color |= g << 8;
-	color |= r << 16;
-	color |= a << 24;
-
-	return color;
-}
-
-static inline uint8_t clip(float v)
-{
-	if (v > 255.)
-		return 255;
-	else
-		return (uint8_t)v;
-}
-
-static uint8_t interpol_r(void *raw_data, unsigned int width,
-			  unsigned int height, unsigned int x, unsigned int y)
-{
-	uint16_t *samples = raw_data;
-	float value;
-	float range_max = (1 << 10) - 1;
-	unsigned int xp, yp;
-	unsigned int xn, yn;
-
-	if ((x % 2 == 1) && (y % 2 == 1)) {
-		value = samples[y * width + x];
-		goto ret;
-	}
-
-	if (x < 2 || x >= (width - 1))
-		return 0;
-	if (y < 2 || y >= (height - 1))
-		return 0;
-
-	xp = (x - 2) | 1;
-	yp = (y - 2) | 1;
-
-	xn = x | 1;
-	yn = y | 1;
-
-//	value = (samples[yp * width + xp] + samples[yn * width + xn]) / 2.;
-	value = samples[yp * width + xp];
-
-ret:
-	return clip(255. * value / range_max);
-}
-
-static uint8_t interpol_g(void *raw_data, unsigned int width,
-			  unsigned int height, unsigned int x, unsigned int y)
-{
-	uint16_t *samples = raw_data;
-	float value;
-	float range_max = (1 << 10) - 1;
-	unsigned int xp, yp;
-	unsigned int xn, yn;
-
-	if (((x % 2 == 1) && (y % 2 == 0)) || ((x % 2) == 0 && (y % 2 == 1))) {
-		value = samples[y * width + x];
-		goto ret;
-	}
-
-	if (x < 2 || x >= (width - 1))
-		return 0;
-	if (y < 2 || y >= (height - 1))
-		return 0;
-
-	xp = x - 1;
-	yp = y;
-
-	xn = x + 1;
-	yn = y;
-
-//	value = (samples[yp * width + xp] + samples[yn * width + xn]) / 2.;
-	value = samples[yp * width + xp];
-
-ret:
-	return clip(255. * value / range_max);
-}
-
-static uint8_t interpol_b(void *raw_data, unsigned int width,
-			  unsigned int height, unsigned int x, unsigned int y)
-{
-	uint16_t *samples = raw_data;
-	float value;
-	float range_max = (1 << 10) - 1;
-	unsigned int xp, yp;
-	unsigned int xn, yn;
-
-	if (x % 2 == 0 && y % 2 == 0) {
-		value = samples[y * width + x];
-		goto ret;
-	}
-
-	if (x < 2 || x >= (width - 1))
-		return 0;
-	if (y < 2 || y >= (height - 1))
-		return 0;
-
-	xp = x & ~1;
-	yp = y & ~1;
-
-	xn = x & ~1;
-	yn = y & ~1;
-
-//	value = (samples[yp * width + xp] + samples[yn * width + xn]) / 2.;
-	value = samples[yp * width + xp];
-
-ret:
-	return clip(255. * value / range_max);
-}
-
-int bayer_10_convert(void *rgb_data, void *raw_data, unsigned int length,
-		     unsigned int width, unsigned int height)
-{
-	unsigned int x, y;
-	uint16_t *samples = raw_data;
-	uint32_t *pixels = rgb_data;
-	float range_max = (1 << 10) - 1;
-	uint8_t r = 0, g = 0, b = 0;
-	// BGGR
-
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			float sample_range;
-			uint8_t v;
-/*
-			// average B-G-G-R
-			accumulator = (samples[0] + (samples[1] + samples[2]) / 2 + samples[3]) / 3;
-*/
-			//sample_range = 255. * samples[0] / range_max;
-
-//			r = 255;
-//			g = 120;
-//			b = 255;
-
-
-			r = interpol_r(raw_data, width, height, x, y);
-			g = interpol_g(raw_data, width, height, x, y);
-			b = interpol_b(raw_data, width, height, x, y);
-
-/*
-			// correct bayer cfa
-			if (x % 2 == 0) {
-				if (y % 2 == 0)
-					b = clip(sample_range);
-				else
-					g = clip(sample_range);
-			} else {
-				if (y % 2 == 0)
-					g = clip(sample_range);
-				else
-					r = clip(sample_range);
-			}
-*/
-
-
-/*
-			if (index % 4 == 0)
-				b = clip(sample_range);
-			else if (index % 4 == 1)
-				g = clip(sample_range);
-			else if (index % 4 == 2)
-				g = clip(sample_range);
-			else if (index % 4 == 3)
-				r = clip(sample_range);
-*/
-
-//			printf("%3u/%3u/%3u\n", r, g, b);
-			*pixels++ = pixel_pack(r, g, b, 255);
-
-			samples++;
-		}
-	}
-}
-
-int bayer_8_convert(uint8_t *dst, uint8_t *img, uint32_t length, uint32_t w,
-		    uint32_t h, unsigned int format)
-{
-	uint32_t x = 0, y = 0;
-	uint32_t i = w * h;
-	
-	if(length < i) return(-1);
-	
-	/* SBGGR8 bayer pattern:
-	 * 
-	 * BGBGBGBGBG
-	 * GRGRGRGRGR
-	 * BGBGBGBGBG
-	 * GRGRGRGRGR
-	 * 
-	 * SGBRG8 bayer pattern:
-	 * 
-	 * GBGBGBGBGB
-	 * RGRGRGRGRG
-	 * GBGBGBGBGB
-	 * RGRGRGRGRG
-	 *
-	 * SGRBG8 bayer pattern:
-	 *
-	 * GRGRGRGRGR
-	 * BGBGBGBGBG
-	 * GRGRGRGRGR
-	 * BGBGBGBGBG
-	*/
-	
-	while(i-- > 0)
-	{
-		uint8_t *p[8];
-		uint8_t hn, vn, di;
-		uint8_t r, g, b;
-		int mode;
-		
-		/* Setup pointers to this pixel's neighbours. */
-		p[0] = img - w - 1;
-		p[1] = img - w;
-		p[2] = img - w + 1;
-		p[3] = img - 1;
-		p[4] = img + 1;
-		p[5] = img + w - 1;
-		p[6] = img + w;
-		p[7] = img + w + 1;
-		
-		/* Juggle pointers if they are out of bounds. */
-		if(!y)              { p[0]=p[5]; p[1]=p[6]; p[2]=p[7]; }
-		else if(y == h - 1) { p[5]=p[0]; p[6]=p[1]; p[7]=p[2]; }
-		if(!x)              { p[0]=p[2]; p[3]=p[4]; p[5]=p[7]; }
-		else if(x == w - 1) { p[2]=p[0]; p[4]=p[3]; p[7]=p[5]; }
-		
-		/* Average matching neighbours. */
-		hn = (*p[3] + *p[4]) / 2;
-		vn = (*p[1] + *p[6]) / 2;
-		di = (*p[0] + *p[2] + *p[5] + *p[7]) / 4;
-		
-		/* Calculate RGB */
-		if(format == V4L2_PIX_FMT_SBGGR8 ||
-		   format == V4L2_PIX_FMT_SRGGB8) {
-			mode = (x + y) & 0x01;
-		} else {
-			mode = ~(x + y) & 0x01;
-		}
-		
-		if(mode)
-		{
-			g = *img;
-			if(y & 0x01) { r = hn; b = vn; }
-			else         { r = vn; b = hn; }
-		}
-		else if(y & 0x01) { r = *img; g = (vn + hn) / 2; b = di; }
-		else              { b = *img; g = (vn + hn) / 2; r = di; }
-		
-		if(format == V4L2_PIX_FMT_SGRBG8 ||
-		   format == V4L2_PIX_FMT_SRGGB8)
-		{
-			uint8_t t = r;
-			r = b;
-			b = t;
-		}
-		
-		*(dst++) += b;
-		*(dst++) += g;
-		*(dst++) += r;
-		*(dst++) += 0;
-		
-		/* Move to the next pixel (or line) */
-		if(++x == w) { x = 0; y++; }
-		img++;
-	}
-	
-	return(0);
-}
-
-int bayer_convert(uint8_t *dst, uint8_t *img, uint32_t length, uint32_t w,
-		  uint32_t h, unsigned int format)
+void stats_print(struct image_convert_stats *stats)
 {
-	switch (format) {
-	case V4L2_PIX_FMT_SBGGR8:
-		return bayer_8_convert(dst, img, length, w, h, format);
-	case V4L2_PIX_FMT_SBGGR10:
-		return bayer_10_convert(dst, img, length, w, h);
-	default:
-		return -EINVAL;
-	}
-}
-
-void image_write(char *path, void *rgb_data, unsigned int width, unsigned int height)
-{
-	cairo_surface_t *surface = NULL;
-
-	surface = cairo_image_surface_create_for_data(rgb_data, CAIRO_FORMAT_RGB24, width, height, width * 4);
-	if (!surface)
-		return;
-
-	cairo_surface_write_to_png(surface, path);
+	static const char *names[] = { "R", "Gr", "Gb", "B" };
+	unsigned int c;
 
-	cairo_surface_destroy(surface);
+	for (c = 0; c < IMAGE_CONVERT_CHANNEL_COUNT; c++)
+		printf("%-2s mean %5u, clipped %u/%u\n", names[c],
+		       stats->means[c], stats->clipped[c], stats->counts[c]);
 }
 
 int main(int argc, char *argv[])
@@ -342,12 +53,68 @@ int main(int argc, char *argv[])
 	struct v4l2_camera_buffer *capture_buffer;
 	unsigned int capture_index;
 	unsigned int width, height, format;
+	enum image_convert_algorithm algorithm = IMAGE_CONVERT_BILINEAR;
+	struct image_convert_isp isp = {
+		.bayer = {
+			.offset_r = 32,
+			.offset_gr = 32,
+			.offset_gb = 32,
+			.offset_b = 32,
+			.gain_r = 256,
+			.gain_gr = 256,
+			.gain_gb = 256,
+			.gain_b = 256,
+		},
+	};
+	bool isp_used = false;
+	struct image_convert_stats stats = { 0 };
+	bool stats_used = false;
+	enum image_write_format write_format = IMAGE_WRITE_PNG;
+	int write_level = Z_BEST_SPEED;
+	char write_path[16];
+	unsigned int threads = 1;
+	unsigned int scale;
+	int option = 0;
 	bool dump = false;
 	int ret;
 
-	if (argc > 2) {
-		width = atoi(argv[1]);
-		height = atoi(argv[2]);
+	while (option != -1) {
+		option = getopt(argc, argv, "j:bmiso:z:");
+		if (option < 0)
+			break;
+
+		switch (option) {
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'b':
+			algorithm = IMAGE_CONVERT_BINNING;
+			break;
+		case 'm':
+			algorithm = IMAGE_CONVERT_MALVAR;
+			break;
+		case 'i':
+			isp_used = true;
+			break;
+		case 's':
+			stats_used = true;
+			break;
+		case 'o':
+			ret = image_write_format_find(optarg);
+			if (ret < 0)
+				goto error;
+
+			write_format = ret;
+			break;
+		case 'z':
+			write_level = atoi(optarg);
+			break;
+		}
+	}
+
+	if (argc - optind > 1) {
+		width = atoi(argv[optind]);
+		height = atoi(argv[optind + 1]);
 	} else {
 		width = 2592;
 		height = 1944;
@@ -355,6 +122,15 @@ int main(int argc, char *argv[])
 
 	format = V4L2_PIX_FMT_SBGGR8;
 
+	if (isp_used) {
+		isp.modules_used = IMAGE_CONVERT_ISP_BAYER;
+		image_convert_isp_gamma(&isp, 2.2);
+	}
+
+	ret = image_convert_threads_setup(threads);
+	if (ret)
+		goto error;
+
 	ret = v4l2_camera_open(camera, NULL);
 	if (ret)
 		goto error;
@@ -402,6 +178,10 @@ int main(int argc, char *argv[])
 
 	standalone.rgb_length = width * height * 4;
 	standalone.rgb_buffer = malloc(standalone.rgb_length);
+	if (!standalone.rgb_buffer) {
+		ret = -ENOMEM;
+		goto error;
+	}
 
 	if (dump) {
 		standalone.dump_fd = open("frame.raw", O_RDWR | O_CREAT | O_TRUNC,
@@ -410,14 +190,42 @@ int main(int argc, char *argv[])
 			goto error;
 	}
 
-	printf("Bayer convert start!\n");
+	snprintf(write_path, sizeof(write_path), "frame.%s",
+		 image_write_extension(write_format));
+
+	/* DNG frames are written straight from the capture buffer. */
+	if (write_format == IMAGE_WRITE_DNG) {
+		ret = image_write_dng(write_path, standalone.raw_buffer,
+				      standalone.raw_length, width, height,
+				      format, isp_used ? isp.bayer.offset_r : 0);
+		if (ret)
+			goto error;
+	} else {
+		printf("Bayer convert start!\n");
+
+		ret = image_convert(standalone.rgb_buffer,
+				    standalone.raw_buffer,
+				    standalone.raw_length, width, height,
+				    format, algorithm,
+				    IMAGE_CONVERT_OUTPUT_XRGB32,
+				    isp_used ? &isp : NULL,
+				    stats_used ? &stats : NULL);
+		if (ret)
+			goto error;
 
-	bayer_convert(standalone.rgb_buffer, standalone.raw_buffer,
-		      standalone.raw_length, width, height, format);
+		printf("Bayer convert done!\n");
 
-	printf("Bayer convert done!\n");
+		if (stats_used)
+			stats_print(&stats);
 
-	image_write("frame.png", standalone.rgb_buffer, width, height);
+		scale = algorithm == IMAGE_CONVERT_BINNING ? 2 : 1;
+
+		ret = image_write(write_path, standalone.rgb_buffer,
+				  width / scale, height / scale, write_format,
+				  write_level, threads);
+		if (ret)
+			goto error;
+	}
 
 	printf("Image write done!\n");
 
@@ -436,6 +244,8 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto error;
 
+	image_convert_threads_teardown();
+
 	return 0;
 
 error:
@@ -75,8 +75,16 @@ int v4l2_camera_run(struct v4l2_camera *camera)
 			return ret;
 	} while (ret == -EAGAIN);
 
+	if (buffer.index >= camera->capture_buffers_count)
+		return -EINVAL;
+
 	camera->capture_buffer_ready_index = buffer.index;
 
+	/* Keep the capture metadata along with the ready buffer. */
+	capture_buffer = &camera->capture_buffers[buffer.index];
+	capture_buffer->buffer.sequence = buffer.sequence;
+	capture_buffer->buffer.timestamp = buffer.timestamp;
+
 	printf("dequeue-buffer: %d\n", buffer.index);
 
 	return 0;